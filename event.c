@@ -0,0 +1,664 @@
+/* Event loop for sockets, timers and signals
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * On Linux everything is a descriptor in one epoll set: sockets, one
+ * timerfd per timer, and a single signalfd for all signals.  So there
+ * is no FD_SETSIZE limit, timers run on the monotonic clock, and signal
+ * callbacks are called from the main loop instead of in signal context.
+ *
+ * Other systems use poll(), with timers kept as deadlines on the
+ * monotonic clock and a self-pipe to get signals into the main loop.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_SIGNALFD_H) && defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+#include "event.h"
+#include "queue.h"
+
+#define EVENT_BATCH 16
+
+enum {
+	EV_IO,
+	EV_TIMER,
+	EV_SIGNAL
+};
+
+struct event {
+	LIST_ENTRY(event) link;
+
+	int    type;
+	int    id;		/* Socket, timer id, or signal number */
+	int    active;		/* Cleared when removed, freed later */
+
+	void (*cb)(int id, void *arg);
+	void  *arg;
+
+#ifndef USE_EPOLL
+	struct timespec expires;	/* Timers only, zero when disarmed */
+	unsigned int    period;		/* Timers only, msec or zero */
+#endif
+};
+
+/* Removed events are only marked inactive, and freed after each round
+ * of callbacks.  So callbacks may safely remove any event. */
+static LIST_HEAD(, event) event_list = LIST_HEAD_INITIALIZER();
+static int event_dirty;
+static int running;
+
+#ifdef USE_EPOLL
+static int      epfd  = -1;
+static int      sigfd = -1;
+static sigset_t sigmask;
+#else
+static int      sigpipe[2] = { -1, -1 };
+static int      timer_next = -2;	/* Timer ids must not clash with sockets */
+#endif
+
+static struct event *find(int type, int id)
+{
+	struct event *ev;
+
+	LIST_FOREACH(ev, &event_list, link) {
+		if (ev->active && ev->type == type && ev->id == id)
+			return ev;
+	}
+
+	return NULL;
+}
+
+static struct event *alloc(int type, int id, void (*cb)(int, void *), void *arg)
+{
+	struct event *ev;
+
+	ev = calloc(1, sizeof(*ev));
+	if (!ev)
+		return NULL;
+
+	ev->type   = type;
+	ev->id     = id;
+	ev->active = 1;
+	ev->cb     = cb;
+	ev->arg    = arg;
+	LIST_INSERT_HEAD(&event_list, ev, link);
+
+	return ev;
+}
+
+static void release(struct event *ev)
+{
+	ev->active  = 0;
+	event_dirty = 1;
+}
+
+static void collect(void)
+{
+	struct event *ev, *tmp;
+
+	if (!event_dirty)
+		return;
+
+	LIST_FOREACH_SAFE(ev, &event_list, link, tmp) {
+		if (ev->active)
+			continue;
+
+		LIST_REMOVE(ev, link);
+		free(ev);
+	}
+	event_dirty = 0;
+}
+
+static void signal_run(int signo)
+{
+	struct event *ev;
+
+	LIST_FOREACH(ev, &event_list, link) {
+		if (ev->active && ev->type == EV_SIGNAL && ev->id == signo)
+			ev->cb(signo, ev->arg);
+	}
+}
+
+#ifdef USE_EPOLL
+static int watch(struct event *ev)
+{
+	struct epoll_event ee;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events   = EPOLLIN;
+	ee.data.ptr = ev;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, ev->id, &ee);
+}
+
+static void unwatch(struct event *ev)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, ev->id, NULL);
+}
+
+static void signal_read(int sd, void *arg)
+{
+	struct signalfd_siginfo si;
+
+	(void)arg;
+	while (read(sd, &si, sizeof(si)) == sizeof(si))
+		signal_run(si.ssi_signo);
+}
+#else
+static int watch(struct event *ev)
+{
+	(void)ev;
+	return 0;
+}
+
+static void unwatch(struct event *ev)
+{
+	(void)ev;
+}
+
+static void signal_handler(int signo)
+{
+	int err = errno;
+	unsigned char c = signo;
+	ssize_t rc;
+
+	/* Pipe full means the signal is already pending */
+	rc = write(sigpipe[1], &c, 1);
+	(void)rc;
+	errno = err;
+}
+
+static void signal_read(int sd, void *arg)
+{
+	unsigned char c;
+
+	(void)arg;
+	while (read(sd, &c, 1) == 1)
+		signal_run(c);
+}
+
+static void now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void add_msec(struct timespec *ts, unsigned int msec)
+{
+	ts->tv_sec  += msec / 1000;
+	ts->tv_nsec += (msec % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int before(struct timespec *a, struct timespec *b)
+{
+	if (a->tv_sec == b->tv_sec)
+		return a->tv_nsec < b->tv_nsec;
+
+	return a->tv_sec < b->tv_sec;
+}
+
+/* Milliseconds until the next timer expires, or -1 for none */
+static int timeout(void)
+{
+	struct timespec ts, *next = NULL;
+	struct event *ev;
+	long msec;
+
+	LIST_FOREACH(ev, &event_list, link) {
+		if (!ev->active || ev->type != EV_TIMER || !ev->expires.tv_sec)
+			continue;
+
+		if (!next || before(&ev->expires, next))
+			next = &ev->expires;
+	}
+
+	if (!next)
+		return -1;
+
+	now(&ts);
+	if (before(next, &ts))
+		return 0;
+
+	msec  = (next->tv_sec - ts.tv_sec) * 1000;
+	msec += (next->tv_nsec - ts.tv_nsec) / 1000000;
+
+	return msec + 1;
+}
+
+static void timer_run(void)
+{
+	struct timespec ts;
+	struct event *ev;
+
+	now(&ts);
+	LIST_FOREACH(ev, &event_list, link) {
+		if (!ev->active || ev->type != EV_TIMER || !ev->expires.tv_sec)
+			continue;
+		if (before(&ts, &ev->expires))
+			continue;
+
+		if (ev->period) {
+			add_msec(&ev->expires, ev->period);
+			if (before(&ev->expires, &ts)) {
+				ev->expires = ts;
+				add_msec(&ev->expires, ev->period);
+			}
+		} else {
+			memset(&ev->expires, 0, sizeof(ev->expires));
+		}
+
+		ev->cb(ev->id, ev->arg);
+	}
+}
+
+static int dispatch(void)
+{
+	static struct pollfd *pfd;
+	static struct event **pev;
+	static size_t max;
+	struct event *ev;
+	size_t i, num = 0;
+	int n;
+
+	LIST_FOREACH(ev, &event_list, link) {
+		if (ev->active && ev->type == EV_IO)
+			num++;
+	}
+
+	if (num > max) {
+		struct pollfd *fds;
+		struct event **evs;
+
+		fds = realloc(pfd, num * sizeof(*pfd));
+		if (!fds)
+			return -1;
+		pfd = fds;
+
+		evs = realloc(pev, num * sizeof(*pev));
+		if (!evs)
+			return -1;
+		pev = evs;
+		max = num;
+	}
+
+	i = 0;
+	LIST_FOREACH(ev, &event_list, link) {
+		if (!ev->active || ev->type != EV_IO)
+			continue;
+
+		pfd[i].fd      = ev->id;
+		pfd[i].events  = POLLIN;
+		pfd[i].revents = 0;
+		pev[i++]       = ev;
+	}
+
+	n = poll(pfd, num, timeout());
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	timer_run();
+	for (i = 0; n > 0 && i < num; i++) {
+		if (!pfd[i].revents)
+			continue;
+
+		n--;
+		if (pev[i]->active)
+			pev[i]->cb(pev[i]->id, pev[i]->arg);
+	}
+
+	return 0;
+}
+#endif /* USE_EPOLL */
+
+/**
+ * event_init - Set up the event loop
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int event_init(void)
+{
+#ifdef USE_EPOLL
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+
+	sigemptyset(&sigmask);
+#endif
+
+	return 0;
+}
+
+/**
+ * event_exit - Release all events and the event loop
+ */
+void event_exit(void)
+{
+	struct event *ev;
+
+	while (!LIST_EMPTY(&event_list)) {
+		ev = LIST_FIRST(&event_list);
+		LIST_REMOVE(ev, link);
+#ifdef USE_EPOLL
+		if (ev->active && ev->type == EV_TIMER)
+			close(ev->id);
+#endif
+		free(ev);
+	}
+	event_dirty = 0;
+
+#ifdef USE_EPOLL
+	if (sigfd >= 0)
+		close(sigfd);
+	sigfd = -1;
+
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+#else
+	if (sigpipe[0] >= 0) {
+		close(sigpipe[0]);
+		close(sigpipe[1]);
+	}
+	sigpipe[0] = sigpipe[1] = -1;
+#endif
+}
+
+/**
+ * event_add - Call back when a socket is readable
+ * @sd:  Socket, or any other descriptor, to watch
+ * @cb:  Callback
+ * @arg: Argument to @cb
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int event_add(int sd, void (*cb)(int sd, void *arg), void *arg)
+{
+	struct event *ev;
+
+	ev = alloc(EV_IO, sd, cb, arg);
+	if (!ev)
+		return -1;
+
+	if (watch(ev)) {
+		release(ev);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * event_del - Stop watching a socket
+ * @sd: Socket given to event_add()
+ *
+ * Must be called before closing @sd.
+ */
+void event_del(int sd)
+{
+	struct event *ev;
+
+	ev = find(EV_IO, sd);
+	if (!ev)
+		return;
+
+	unwatch(ev);
+	release(ev);
+}
+
+/**
+ * event_timer_add - Create a timer
+ * @cb:  Callback
+ * @arg: Argument to @cb
+ *
+ * The timer is created disarmed, see event_timer_set().
+ *
+ * Returns:
+ * A timer id on success, or -1 on error with @errno set.
+ */
+int event_timer_add(void (*cb)(int id, void *arg), void *arg)
+{
+	struct event *ev;
+	int id;
+
+#ifdef USE_EPOLL
+	id = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (id < 0)
+		return -1;
+#else
+	id = timer_next--;
+#endif
+
+	ev = alloc(EV_TIMER, id, cb, arg);
+	if (!ev)
+		goto fail;
+
+	if (watch(ev)) {
+		release(ev);
+		goto fail;
+	}
+
+	return id;
+fail:
+#ifdef USE_EPOLL
+	close(id);
+#endif
+	return -1;
+}
+
+/**
+ * event_timer_set - Arm or disarm a timer
+ * @id:     Timer id from event_timer_add()
+ * @msec:   Time until first expiry, in milliseconds, or zero to disarm
+ * @period: Interval of following expiries, in milliseconds, or zero
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int event_timer_set(int id, unsigned int msec, unsigned int period)
+{
+#ifdef USE_EPOLL
+	struct itimerspec its;
+
+	its.it_value.tv_sec     = msec / 1000;
+	its.it_value.tv_nsec    = (msec % 1000) * 1000000;
+	its.it_interval.tv_sec  = period / 1000;
+	its.it_interval.tv_nsec = (period % 1000) * 1000000;
+
+	return timerfd_settime(id, 0, &its, NULL);
+#else
+	struct event *ev;
+
+	ev = find(EV_TIMER, id);
+	if (!ev) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	memset(&ev->expires, 0, sizeof(ev->expires));
+	ev->period = period;
+	if (msec) {
+		now(&ev->expires);
+		add_msec(&ev->expires, msec);
+	}
+
+	return 0;
+#endif
+}
+
+/**
+ * event_timer_del - Remove a timer
+ * @id: Timer id from event_timer_add()
+ */
+void event_timer_del(int id)
+{
+	struct event *ev;
+
+	ev = find(EV_TIMER, id);
+	if (!ev)
+		return;
+
+	unwatch(ev);
+#ifdef USE_EPOLL
+	close(id);
+#endif
+	release(ev);
+}
+
+/**
+ * event_signal - Call back when a signal has been received
+ * @signo: Signal number
+ * @cb:    Callback, called from the event loop, not in signal context
+ * @arg:   Argument to @cb
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int event_signal(int signo, void (*cb)(int signo, void *arg), void *arg)
+{
+#ifdef USE_EPOLL
+	int sd;
+
+	sigaddset(&sigmask, signo);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL))
+		return -1;
+
+	sd = signalfd(sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sd < 0)
+		return -1;
+
+	if (sigfd < 0) {
+		sigfd = sd;
+		if (event_add(sigfd, signal_read, NULL))
+			return -1;
+	}
+#else
+	struct sigaction sa;
+
+	if (sigpipe[0] < 0) {
+		if (pipe(sigpipe))
+			return -1;
+
+		fcntl(sigpipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(sigpipe[1], F_SETFL, O_NONBLOCK);
+		fcntl(sigpipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(sigpipe[1], F_SETFD, FD_CLOEXEC);
+		if (event_add(sigpipe[0], signal_read, NULL))
+			return -1;
+	}
+
+	sa.sa_handler = signal_handler;
+	sa.sa_flags   = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL))
+		return -1;
+#endif
+
+	if (!alloc(EV_SIGNAL, signo, cb, arg))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * event_run - Run the event loop
+ *
+ * Waits for events and calls their callbacks, until event_stop() is
+ * called from any of them.
+ *
+ * Returns:
+ * POSIX OK(0) when stopped, non-zero on error with @errno set.
+ */
+int event_run(void)
+{
+	running = 1;
+	while (running) {
+#ifdef USE_EPOLL
+		struct epoll_event ee[EVENT_BATCH];
+		int i, num;
+
+		num = epoll_wait(epfd, ee, EVENT_BATCH, -1);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < num; i++) {
+			struct event *ev = ee[i].data.ptr;
+
+			if (!ev->active)
+				continue;
+
+			if (ev->type == EV_TIMER) {
+				uint64_t exp;
+
+				if (read(ev->id, &exp, sizeof(exp)) != sizeof(exp))
+					continue;
+			}
+
+			ev->cb(ev->id, ev->arg);
+		}
+#else
+		if (dispatch())
+			return -1;
+#endif
+		collect();
+	}
+
+	return 0;
+}
+
+/**
+ * event_stop - Stop the event loop
+ *
+ * Makes event_run() return after the current round of callbacks.
+ */
+void event_stop(void)
+{
+	running = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,32 @@
+/* Event loop for sockets, timers and signals */
+#ifndef SMCROUTE_EVENT_H_
+#define SMCROUTE_EVENT_H_
+
+/*
+ * All callbacks have the same signature, the first argument is the
+ * socket for I/O events, the timer id for timers, and the signal
+ * number for signals.
+ */
+int  event_init      (void);
+void event_exit      (void);
+
+int  event_add       (int sd, void (*cb)(int sd, void *arg), void *arg);
+void event_del       (int sd);
+
+int  event_timer_add (void (*cb)(int id, void *arg), void *arg);
+int  event_timer_set (int id, unsigned int msec, unsigned int period);
+void event_timer_del (int id);
+
+int  event_signal    (int signo, void (*cb)(int signo, void *arg), void *arg);
+
+int  event_run       (void);
+void event_stop      (void);
+
+#endif /* SMCROUTE_EVENT_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
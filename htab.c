@@ -0,0 +1,231 @@
+/* Open addressing hash table
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Entries are pointers to caller owned objects, collisions are resolved
+ * using linear probing.  The table is kept at most half full, and since
+ * removal shifts following entries back into place, there are no
+ * tombstones.  So insert, lookup and remove are all O(1) on average.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "htab.h"
+
+#define HTAB_MIN_SIZE 64
+
+static int resize(struct htab *htab, size_t size)
+{
+	void **slot, **old = htab->slot;
+	size_t i, j, oldsize = htab->size;
+
+	slot = calloc(size, sizeof(void *));
+	if (!slot)
+		return -1;
+
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+
+		j = htab->hash(old[i]) & (size - 1);
+		while (slot[j])
+			j = (j + 1) & (size - 1);
+		slot[j] = old[i];
+	}
+
+	htab->slot = slot;
+	htab->size = size;
+	free(old);
+
+	return 0;
+}
+
+/* Slot holding @key, or the empty slot where it would be inserted */
+static size_t probe(struct htab *htab, const void *key)
+{
+	size_t i = htab->hash(key) & (htab->size - 1);
+
+	while (htab->slot[i] && htab->cmp(htab->slot[i], key))
+		i = (i + 1) & (htab->size - 1);
+
+	return i;
+}
+
+/**
+ * htab_find - Look up an entry
+ * @htab: Pointer to a &struct htab
+ * @key:  Pointer to an object with the same key fields as the entry
+ *
+ * Returns:
+ * The matching entry, or %NULL.
+ */
+void *htab_find(struct htab *htab, const void *key)
+{
+	if (!htab->count)
+		return NULL;
+
+	return htab->slot[probe(htab, key)];
+}
+
+/**
+ * htab_insert - Add an entry
+ * @htab:  Pointer to a &struct htab
+ * @entry: Entry to add, must not be %NULL
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.  If an
+ * entry with the same key already exists @errno is set to %EEXIST.
+ */
+int htab_insert(struct htab *htab, void *entry)
+{
+	size_t i;
+
+	if ((htab->count + 1) * 2 > htab->size) {
+		if (resize(htab, htab->size ? htab->size * 2 : HTAB_MIN_SIZE))
+			return -1;
+	}
+
+	i = probe(htab, entry);
+	if (htab->slot[i]) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	htab->slot[i] = entry;
+	htab->count++;
+
+	return 0;
+}
+
+/**
+ * htab_remove - Remove an entry
+ * @htab: Pointer to a &struct htab
+ * @key:  Pointer to an object with the same key fields as the entry
+ *
+ * Returns:
+ * The removed entry, or %NULL if not found.
+ */
+void *htab_remove(struct htab *htab, const void *key)
+{
+	size_t i, j, k, mask = htab->size - 1;
+	void *entry;
+
+	if (!htab->count)
+		return NULL;
+
+	i = probe(htab, key);
+	entry = htab->slot[i];
+	if (!entry)
+		return NULL;
+
+	/* Shift back entries that would no longer be found after @i */
+	for (j = (i + 1) & mask; htab->slot[j]; j = (j + 1) & mask) {
+		k = htab->hash(htab->slot[j]) & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			htab->slot[i] = htab->slot[j];
+			i = j;
+		}
+	}
+	htab->slot[i] = NULL;
+	htab->count--;
+
+	return entry;
+}
+
+/**
+ * htab_next - Iterate over all entries
+ * @htab: Pointer to a &struct htab
+ * @pos:  Iterator, set to zero before the first call
+ *
+ * The table must not be modified while iterating.
+ *
+ * Returns:
+ * The next entry, or %NULL when there are no more entries.
+ */
+void *htab_next(struct htab *htab, size_t *pos)
+{
+	while (*pos < htab->size) {
+		void *entry = htab->slot[(*pos)++];
+
+		if (entry)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * htab_exit - Remove all entries and release the table
+ * @htab: Pointer to a &struct htab
+ * @cb:   Optional callback to release each entry
+ *
+ * The table can be reused afterwards.
+ */
+void htab_exit(struct htab *htab, void (*cb)(void *entry))
+{
+	size_t i;
+
+	for (i = 0; cb && i < htab->size; i++) {
+		if (htab->slot[i])
+			cb(htab->slot[i]);
+	}
+
+	free(htab->slot);
+	htab->slot  = NULL;
+	htab->size  = 0;
+	htab->count = 0;
+}
+
+/**
+ * htab_hash - Hash a key
+ * @buf: Key data
+ * @len: Length of @buf in bytes
+ *
+ * FNV-1a, followed by a final mix so all bits affect the low order bits
+ * used to index the table.
+ *
+ * Returns:
+ * A 32-bit hash of @buf.
+ */
+uint32_t htab_hash(const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= *ptr++;
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
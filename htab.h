@@ -0,0 +1,35 @@
+/* Open addressing hash table */
+#ifndef SMCROUTE_HTAB_H_
+#define SMCROUTE_HTAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct htab {
+	void    **slot;
+	size_t    size;		/* Number of slots, always a power of two */
+	size_t    count;	/* Number of entries */
+
+	uint32_t (*hash)(const void *entry);
+	int      (*cmp) (const void *a, const void *b);	/* 0 when equal */
+};
+
+/* Slots are allocated on first insert, so no init function is needed */
+#define HTAB_INITIALIZER(hash, cmp) { NULL, 0, 0, hash, cmp }
+
+void    *htab_find   (struct htab *htab, const void *key);
+int      htab_insert (struct htab *htab, void *entry);
+void    *htab_remove (struct htab *htab, const void *key);
+void    *htab_next   (struct htab *htab, size_t *pos);
+void     htab_exit   (struct htab *htab, void (*cb)(void *entry));
+
+uint32_t htab_hash   (const void *buf, size_t len);
+
+#endif /* SMCROUTE_HTAB_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
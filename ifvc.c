@@ -26,67 +26,122 @@
 #include <netinet/in.h>
 #include <ifaddrs.h>
 
+#include "htab.h"
 #include "ifvc.h"
 #include "mclab.h"
 
-static unsigned int num_ifaces = 0, num_ifaces_alloc = 0;
-static struct iface *iface_list = NULL;
+static uint32_t name_hash(const void *entry);
+static int name_cmp(const void *a, const void *b);
+static uint32_t index_hash(const void *entry);
+static int index_cmp(const void *a, const void *b);
 
-/**
- * iface_init - Setup vector of active interfaces
+/*
+ * Interfaces are allocated one by one and never move, so pointers to
+ * them, e.g. in the VIF table, stay valid until the interface is gone.
  *
- * Builds up a vector with active system interfaces.  Must be called
- * before any other interface functions in this module!
+ * Besides the list, interfaces are indexed by name and ifindex in hash
+ * tables, and by VIF/MIF in the maps below, kept up to date by
+ * iface_set_vif() and iface_set_mif().  So looking up the interface of
+ * an upcall, or a name in the .conf file, does not depend on the number
+ * of interfaces.
  */
-void iface_init(void)
+static TAILQ_HEAD(, iface) iface_list = TAILQ_HEAD_INITIALIZER(iface_list);
+static struct iface *iface_iter;
+
+static struct htab name_tab  = HTAB_INITIALIZER(name_hash, name_cmp);
+static struct htab index_tab = HTAB_INITIALIZER(index_hash, index_cmp);
+
+static struct iface *vif_map[MAXVIFS];
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+static struct iface *mif_map[MAXMIFS];
+#endif
+
+static uint32_t name_hash(const void *entry)
 {
-	struct iface *iface;
-	struct ifaddrs *ifaddr, *ifa;
+	const struct iface *iface = entry;
 
-	num_ifaces = 0;
+	return htab_hash(iface->name, strlen(iface->name));
+}
 
-	if (iface_list)
-		free(iface_list);
+static int name_cmp(const void *a, const void *b)
+{
+	const struct iface *x = a, *y = b;
 
-	num_ifaces_alloc = 1;
-	iface_list = calloc(num_ifaces_alloc, sizeof(struct iface));
-	if (!iface_list) {
-		smclog(LOG_ERR, "Failed allocating space for interfaces: %s", strerror(errno));
-		exit(255);
+	return strcmp(x->name, y->name);
+}
+
+static uint32_t index_hash(const void *entry)
+{
+	const struct iface *iface = entry;
+
+	return htab_hash(&iface->ifindex, sizeof(iface->ifindex));
+}
+
+static int index_cmp(const void *a, const void *b)
+{
+	const struct iface *x = a, *y = b;
+
+	return x->ifindex != y->ifindex;
+}
+
+static struct iface *iface_new(unsigned int ifindex, const char *ifname)
+{
+	struct iface *iface;
+
+	iface = calloc(1, sizeof(*iface));
+	if (!iface) {
+		smclog(LOG_ERR, "Failed allocating space for interface %s: %s", ifname, strerror(errno));
+		return NULL;
 	}
 
-	if (getifaddrs(&ifaddr) == -1) {
-		smclog(LOG_ERR, "Failed retrieving interface addresses: %s", strerror(errno));
-		exit(255);
+	strncpy(iface->name, ifname, IFNAMSIZ);
+	iface->name[IFNAMSIZ] = 0;
+	iface->ifindex   = ifindex;
+	iface->vif       = -1;
+	iface->mif       = -1;
+	iface->threshold = DEFAULT_THRESHOLD;
+
+	if (htab_insert(&name_tab, iface))
+		goto fail;
+	if (htab_insert(&index_tab, iface)) {
+		htab_remove(&name_tab, iface);
+		goto fail;
 	}
+	TAILQ_INSERT_TAIL(&iface_list, iface, link);
+
+	return iface;
+fail:
+	smclog(LOG_ERR, "Failed adding interface %s, ifindex %u: %s", ifname, ifindex, strerror(errno));
+	free(iface);
+	return NULL;
+}
+
+/* Release VIF/MIF of an interface that is gone and forget about it */
+static void iface_free(struct iface *iface)
+{
+	mroute_vif_gone(iface);
+
+	if (iface_iter == iface)
+		iface_iter = TAILQ_NEXT(iface, link);
+	TAILQ_REMOVE(&iface_list, iface, link);
+	htab_remove(&name_tab, iface);
+	htab_remove(&index_tab, iface);
+	free(iface);
+}
+
+/* Fallback for systems without netlink, one entry per address */
+static int iface_getifaddrs(void)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	if (getifaddrs(&ifaddr) == -1)
+		return -1;
 
 	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
-		/* Check if already added? */
-		if ((iface = iface_find_by_name(ifa->ifa_name))) {
-			if (!iface->inaddr.s_addr && ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET)
-				/* If we know the interface but don't know an address
-				 * yet, remember this one.
-				 */
-				iface->inaddr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-			continue;
-		}
-
-		/* Allocate more space? */
-		if (num_ifaces == num_ifaces_alloc) {
-			num_ifaces_alloc *= 2;
-			iface_list = realloc(iface_list, num_ifaces_alloc * sizeof(struct iface));
-			if (!iface_list) {
-				smclog(LOG_ERR, "Failed allocating space for interfaces: %m");
-				exit(255);
-			}
-			/* Initialize 2nd half of interface list */
-			memset(&iface_list[num_ifaces], 0, num_ifaces * sizeof(struct iface));
-		}
-
-		/* Copy data from interface iterator 'ifa' */
-		iface = &iface_list[num_ifaces++];
-		strncpy(iface->name, ifa->ifa_name, IFNAMSIZ);
-		iface->name[IFNAMSIZ] = 0;
+		struct iface *iface;
+
+		/* Also for known interfaces, to clear their stale mark */
+		iface_update(if_nametoindex(ifa->ifa_name), ifa->ifa_name, ifa->ifa_flags);
 
 		/*
 		 * Only copy interface address if inteface has one.  On
@@ -95,15 +150,49 @@ void iface_init(void)
 		 * systems will fail on the MRT_ADD_VIF ioctl. if the
 		 * kernel cannot find a matching interface.
 		 */
-		if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET)
-			iface->inaddr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-		iface->flags = ifa->ifa_flags;
-		iface->ifindex = if_nametoindex(iface->name);
-		iface->vif = -1;
-		iface->mif = -1;
-		iface->threshold = DEFAULT_THRESHOLD;
+		iface = iface_find_by_name(ifa->ifa_name);
+		if (iface && ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET)
+			iface_update_addr(iface->ifindex, ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, 1);
 	}
 	freeifaddrs(ifaddr);
+
+	return 0;
+}
+
+/**
+ * iface_init - Setup list of active interfaces
+ *
+ * Builds up the list of system interfaces, from a netlink dump on Linux,
+ * otherwise from getifaddrs().  Must be called before any other
+ * interface functions in this module!  When called again, on reload,
+ * the list is synced with the system, interfaces still present keep
+ * their VIF/MIF.  In between, on Linux, the list is kept up to date
+ * with netlink events, see netlink_init().
+ */
+void iface_init(void)
+{
+	struct iface *iface, *tmp;
+	int rc = -1;
+
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		iface->inaddr.s_addr = 0;
+		iface->stale = 1;
+	}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+	rc = netlink_dump();
+	if (rc)
+		smclog(LOG_WARNING, "Failed reading interfaces using netlink, trying getifaddrs(): %s", strerror(errno));
+#endif
+	if (rc && iface_getifaddrs()) {
+		smclog(LOG_ERR, "Failed retrieving interface addresses: %s", strerror(errno));
+		exit(255);
+	}
+
+	TAILQ_FOREACH_SAFE(iface, &iface_list, link, tmp) {
+		if (iface->stale)
+			iface_free(iface);
+	}
 }
 
 /**
@@ -111,40 +200,151 @@ void iface_init(void)
  */
 void iface_exit(void)
 {
-	if (iface_list) {
-		free(iface_list);
-		iface_list = NULL;
+	struct iface *iface;
+
+	htab_exit(&name_tab, NULL);
+	htab_exit(&index_tab, NULL);
+	memset(vif_map, 0, sizeof(vif_map));
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	memset(mif_map, 0, sizeof(mif_map));
+#endif
+
+	while ((iface = TAILQ_FIRST(&iface_list))) {
+		TAILQ_REMOVE(&iface_list, iface, link);
+		free(iface);
+	}
+	iface_iter = NULL;
+}
+
+/**
+ * iface_update - Add new interface, or update a known one
+ * @ifindex: Kernel interface index
+ * @ifname:  Interface name
+ * @flags:   Interface flags, IFF_*
+ *
+ * An interface with the same @ifindex keeps its VIF/MIF, also when it
+ * has been renamed.  An interface with the same name but another
+ * @ifindex has been replaced, the old one is removed.
+ *
+ * Returns:
+ * 1 if the interface is new, renamed, its multicast capability has
+ * changed, or its link has gone up or down, otherwise 0.
+ */
+int iface_update(unsigned int ifindex, const char *ifname, unsigned int flags)
+{
+	struct iface *iface;
+	int changed = 0;
+
+	iface = iface_find_by_name(ifname);
+	if (iface && iface->ifindex != ifindex) {
+		iface_free(iface);
+		changed = 1;
+	}
+
+	iface = iface_find_by_index(ifindex);
+	if (!iface) {
+		iface = iface_new(ifindex, ifname);
+		if (!iface)
+			return changed;
+		changed = 1;
+	} else if (strcmp(iface->name, ifname)) {
+		smclog(LOG_INFO, "Interface %s renamed to %s", iface->name, ifname);
+		htab_remove(&name_tab, iface);
+		snprintf(iface->name, sizeof(iface->name), "%s", ifname);
+		if (htab_insert(&name_tab, iface))
+			smclog(LOG_ERR, "Failed indexing interface %s: %s", ifname, strerror(errno));
+		changed = 1;
+	}
+
+	if ((iface->flags ^ flags) & (IFF_LOOPBACK | IFF_MULTICAST | IFF_UP | IFF_RUNNING))
+		changed = 1;
+	iface->flags = flags;
+	iface->stale = 0;
+
+	return changed;
+}
+
+/**
+ * iface_update_addr - Interface address added or removed
+ * @ifindex: Kernel interface index
+ * @addr:    IPv4 address
+ * @add:     Address added if set, otherwise removed
+ *
+ * The first address of an interface is used, for IGMP and for setting
+ * up VIFs on systems that cannot use the ifindex.
+ */
+void iface_update_addr(unsigned int ifindex, struct in_addr addr, int add)
+{
+	struct iface *iface;
+
+	iface = iface_find_by_index(ifindex);
+	if (!iface)
+		return;
+
+	if (add) {
+		if (!iface->inaddr.s_addr)
+			iface->inaddr = addr;
+	} else if (iface->inaddr.s_addr == addr.s_addr) {
+		iface->inaddr.s_addr = 0;
 	}
 }
 
+/**
+ * iface_remove - Interface removed from the system
+ * @ifindex: Kernel interface index
+ *
+ * Returns:
+ * 1 if the interface was known, otherwise 0.
+ */
+int iface_remove(unsigned int ifindex)
+{
+	struct iface *iface;
+
+	iface = iface_find_by_index(ifindex);
+	if (!iface)
+		return 0;
+
+	smclog(LOG_INFO, "Interface %s removed", iface->name);
+	iface_free(iface);
+
+	return 1;
+}
+
+/**
+ * iface_iterator - Iterate over all interfaces
+ * @first: Set to start from the first interface
+ *
+ * Returns:
+ * The first, or next, interface, or %NULL when there are no more.
+ */
+struct iface *iface_iterator(int first)
+{
+	if (first)
+		iface_iter = TAILQ_FIRST(&iface_list);
+	else if (iface_iter)
+		iface_iter = TAILQ_NEXT(iface_iter, link);
+
+	return iface_iter;
+}
+
 /**
  * iface_find_by_name - Find an interface by name
  * @ifname: Interface name
  *
  * Returns:
  * Pointer to a @struct iface of the matching interface, or %NULL if no
- * interface exists, or is up.  If more than one interface exists, chose
- * the interface that corresponds to a virtual interface.
+ * interface exists, or is up.
  */
 struct iface *iface_find_by_name(const char *ifname)
 {
-	unsigned int i;
-	struct iface *iface;
-	struct iface *candidate = NULL;
+	struct iface key;
 
-	if (!ifname)
+	if (!ifname || strlen(ifname) > IFNAMSIZ)
 		return NULL;
 
-	for (i = 0; i < num_ifaces; i++) {
-		iface = &iface_list[i];
-		if (!strcmp(ifname, iface->name)) {
-			if (iface->vif >= 0)
-				return iface;
-			candidate = iface;
-		}
-	}
+	strcpy(key.name, ifname);
 
-	return candidate;
+	return htab_find(&name_tab, &key);
 }
 
 /**
@@ -157,16 +357,31 @@ struct iface *iface_find_by_name(const char *ifname)
  */
 struct iface *iface_find_by_vif(int vif)
 {
-	size_t i;
+	if (vif < 0 || (size_t)vif >= NELEMS(vif_map))
+		return NULL;
 
-	for (i = 0; i < num_ifaces; i++) {
-		struct iface *iface = &iface_list[i];
+	return vif_map[vif];
+}
 
-		if (iface->vif >= 0 && iface->vif == vif)
-			return iface;
-	}
+/**
+ * iface_find_by_mif - Find by IPv6 virtual interface index
+ * @mif: Virtual multicast interface index
+ *
+ * Returns:
+ * Pointer to a @struct iface of the requested interface, or %NULL if no
+ * interface matching @mif exists.
+ */
+struct iface *iface_find_by_mif(int mif)
+{
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	if (mif < 0 || (size_t)mif >= NELEMS(mif_map))
+		return NULL;
 
+	return mif_map[mif];
+#else
+	(void)mif;
 	return NULL;
+#endif
 }
 
 /**
@@ -179,12 +394,52 @@ struct iface *iface_find_by_vif(int vif)
  */
 struct iface *iface_find_by_index(unsigned int ifindex)
 {
-	if (ifindex >= num_ifaces)
-		return NULL;
+	struct iface key;
+
+	key.ifindex = ifindex;
 
-	return &iface_list[ifindex];
+	return htab_find(&index_tab, &key);
 }
 
+/**
+ * iface_set_vif - Set, or clear, the VIF of an interface (IPv4)
+ * @iface: Pointer to a @struct iface interface
+ * @vif:   Virtual interface index, or -1 when the VIF is removed
+ *
+ * Must be used instead of setting @iface->vif directly, to keep the
+ * lookup for iface_find_by_vif() up to date.
+ */
+void iface_set_vif(struct iface *iface, int vif)
+{
+	if (iface->vif >= 0 && (size_t)iface->vif < NELEMS(vif_map) && vif_map[iface->vif] == iface)
+		vif_map[iface->vif] = NULL;
+
+	iface->vif = vif;
+	if (vif >= 0 && (size_t)vif < NELEMS(vif_map))
+		vif_map[vif] = iface;
+}
+
+/**
+ * iface_set_mif - Set, or clear, the MIF of an interface (IPv6)
+ * @iface: Pointer to a @struct iface interface
+ * @mif:   Virtual interface index, or -1 when the MIF is removed
+ *
+ * Must be used instead of setting @iface->mif directly, to keep the
+ * lookup for iface_find_by_mif() up to date.
+ */
+void iface_set_mif(struct iface *iface, int mif)
+{
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	if (iface->mif >= 0 && (size_t)iface->mif < NELEMS(mif_map) && mif_map[iface->mif] == iface)
+		mif_map[iface->mif] = NULL;
+#endif
+
+	iface->mif = mif;
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	if (mif >= 0 && (size_t)mif < NELEMS(mif_map))
+		mif_map[mif] = iface;
+#endif
+}
 
 /**
  * iface_get_vif - Get virtual interface index for an interface (IPv4)
@@ -2,11 +2,20 @@
 #ifndef SMCROUTE_IFVC_H_
 #define SMCROUTE_IFVC_H_
 
+#include <netinet/in.h>
+
 void          iface_init            (void);
 void          iface_exit            (void);
+int           iface_update          (unsigned int ifindex, const char *ifname, unsigned int flags);
+void          iface_update_addr     (unsigned int ifindex, struct in_addr addr, int add);
+int           iface_remove          (unsigned int ifindex);
+struct iface *iface_iterator        (int first);
 struct iface *iface_find_by_name    (const char *ifname);
 struct iface *iface_find_by_index   (unsigned int ifindex);
 struct iface *iface_find_by_vif     (int vif);
+struct iface *iface_find_by_mif     (int mif);
+void          iface_set_vif         (struct iface *iface, int vif);
+void          iface_set_mif         (struct iface *iface, int mif);
 int           iface_get_vif         (struct iface *iface);
 int           iface_get_mif         (struct iface *iface);
 int           iface_get_vif_by_name (const char *ifname);
@@ -22,6 +22,7 @@
  */
 
 #include <stddef.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -129,47 +130,64 @@ void ipc_exit(void)
 }
 
 /**
- * ipc_server_read - Read IPC message from client
- * @buf: Buffer for message
- * @len: Size of @buf in bytes
+ * ipc_server_accept - Accept new client connection
  *
- * Reads a message from the IPC socket and stores in @buf, respecting
- * the size @len.  Connects and resets connection as necessary.
+ * Each client connection is read with ipc_server_read() until closed
+ * by the client, so the server can serve several clients at a time.
  *
  * Returns:
- * Pointer to a successfuly read command packet in @buf, or %NULL on error.
+ * The client socket, or -1 on error with @errno set.
  */
-void *ipc_server_read(char *buf, size_t len)
+int ipc_server_accept(void)
 {
-	size_t sz;
 	socklen_t socklen = 0;
+	int sd;
 
 	/* sanity check */
 	if (server_sd < 0) {
 		errno = EBADF;
-		return NULL;
+		return -1;
 	}
 
-	/* wait for connections */
-	if (client_sd < 0) {
-		client_sd = accept(server_sd, NULL, &socklen);
-		if (client_sd < 0)
-			return NULL;
-	}
+	/* Not to be inherited by scripts */
+	sd = accept(server_sd, NULL, &socklen);
+	if (sd >= 0)
+		fcntl(sd, F_SETFD, fcntl(sd, F_GETFD) | FD_CLOEXEC);
 
+	return sd;
+}
+
+/**
+ * ipc_server_read - Read IPC message from client
+ * @sd:  Client socket, from ipc_server_accept()
+ * @buf: Buffer for message
+ * @len: Size of @buf in bytes
+ *
+ * Reads a message from the client socket @sd and stores in @buf,
+ * respecting the size @len.  Replies with ipc_send() go to @sd.
+ *
+ * Returns:
+ * Pointer to a successfuly read command packet in @buf, or %NULL on
+ * error.  With @errno %ECONNRESET the client has disconnected and @sd
+ * should be closed with ipc_server_close().
+ */
+void *ipc_server_read(int sd, char *buf, size_t len)
+{
+	ssize_t sz;
+
+	client_sd = sd;
 	sz = recv(client_sd, buf, len, 0);
-	if (!sz) {
-		close(client_sd);
-		client_sd = -1;
-		errno = ECONNRESET;
+	if (sz <= 0) {
+		if (!sz)
+			errno = ECONNRESET;
 		return NULL;
 	}
 
 	/* successful read */
-	if (sz >= sizeof(struct ipc_msg)) {
+	if ((size_t)sz >= sizeof(struct ipc_msg)) {
 		struct ipc_msg *msg = (struct ipc_msg *)buf;
 
-		if (sz == msg->len)
+		if ((size_t)sz == msg->len)
 			return msg;
 	}
 
@@ -177,6 +195,17 @@ void *ipc_server_read(char *buf, size_t len)
 	return NULL;
 }
 
+/**
+ * ipc_server_close - Close client connection
+ * @sd: Client socket, from ipc_server_accept()
+ */
+void ipc_server_close(int sd)
+{
+	if (client_sd == sd)
+		client_sd = -1;
+	close(sd);
+}
+
 /**
  * ipc_send - Send message to peer
  * @buf: Message to send
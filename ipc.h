@@ -2,14 +2,16 @@
 #ifndef SMCROUTE_IPC_H_
 #define SMCROUTE_IPC_H_
 
-int   ipc_server_init (void);
-int   ipc_client_init (void);
-void  ipc_exit        (void);
+int   ipc_server_init   (void);
+int   ipc_client_init   (void);
+void  ipc_exit          (void);
 
-void *ipc_server_read (char *buf, size_t len);
+int   ipc_server_accept (void);
+void *ipc_server_read   (int sd, char *buf, size_t len);
+void  ipc_server_close  (int sd);
 
-int   ipc_send        (char *buf, size_t len);
-int   ipc_receive     (char *buf, size_t len);
+int   ipc_send          (char *buf, size_t len);
+int   ipc_receive       (char *buf, size_t len);
 
 #endif /* SMCROUTE_IPC_H_ */
 
@@ -21,10 +21,108 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include "config.h"
+#include <sys/resource.h>
+
 #include "ifvc.h"
 #include "mclab.h"
 
-static int mcgroup4_socket = -1;
+/* Bulk programming of source filters, see struct mcfilter below */
+#if defined(HAVE_SETSOURCEFILTER) && defined(MCAST_JOIN_SOURCE_GROUP)
+#define USE_MSFILTER
+#endif
+
+#define MSF_DEFAULT 64		/* Sources per socket and group, if unknown */
+
+/*
+ * Memberships are bound to the socket used to join, and Linux limits
+ * each socket to net.ipv4.igmp_max_memberships groups, default 20, and
+ * to igmp_max_msf sources per group, and option memory.  So joins are
+ * spread over a pool of sockets per address family, opened on demand.
+ * A join is tried on each socket not yet full, a socket refusing it
+ * with ENOBUFS or ENOMEM is marked full, and moved last, and when all
+ * are full a new socket is opened.  Leaving a group on a socket makes
+ * it available again, and a socket with no memberships left is closed.
+ */
+struct mcsock {
+	TAILQ_ENTRY(mcsock) link;
+
+	int          sd;
+	unsigned int count;		/* Memberships on this socket */
+	int          full;		/* Last join refused, sockets not full first */
+};
+
+TAILQ_HEAD(mcsock_pool, mcsock);
+
+static struct mcsock_pool mcsock4_pool = TAILQ_HEAD_INITIALIZER(mcsock4_pool);
+#ifdef HAVE_IPV6_MULTICAST_HOST
+static struct mcsock_pool mcsock6_pool = TAILQ_HEAD_INITIALIZER(mcsock6_pool);
+#endif
+
+/*
+ * Joined groups, so a reload only needs to join new groups and leave
+ * the ones removed from the .conf file, instead of closing the sockets
+ * and dropping all memberships.  Addresses are zero padded to IPv6 size
+ * and an ASM join has an all zero source.
+ *
+ * The same group can be joined both from the .conf file and over IPC,
+ * so each entry counts its users.  The kernel membership is only
+ * dropped when the last one leaves, and a reload only recounts the
+ * .conf file users, never touching the groups joined over IPC.
+ */
+union mcaddr {
+	struct in_addr  in;
+	struct in6_addr in6;
+};
+
+struct mcgroup {
+	LIST_ENTRY(mcgroup) link;
+
+	char             ifname[IFNAMSIZ];
+	unsigned int     ifindex;	/* Membership is lost if it changes */
+	int              family;
+	union mcaddr     source;
+	union mcaddr     group;
+	int              exclude;	/* Source excluded, not included */
+	struct mcsock   *sock;		/* Socket holding the membership */
+	struct mcfilter *filter;	/* Or, source filter holding the source */
+	int              programmed;	/* Source set in kernel filter */
+	int              conf;		/* Lines in .conf file joining this group */
+	int              refcnt;	/* Joins over IPC */
+};
+
+static LIST_HEAD(, mcgroup) mcgroup_list = LIST_HEAD_INITIALIZER();
+
+#ifdef USE_MSFILTER
+/*
+ * Source specific joins, and excluded sources, are collected per group
+ * and interface, and set with one setsourcefilter() call, instead of
+ * one system call, and one IGMPv3/MLDv2 report, per source.  Joins from
+ * the .conf file are set when the whole file has been applied, joins
+ * over IPC at once.
+ *
+ * The kernel limits the sources per socket and group, so included
+ * sources are set in chunks on as many sockets as needed, which the
+ * kernel merges into one include list for the interface.  Excluded
+ * sources must all be set on one socket.
+ */
+struct mcfilter {
+	LIST_ENTRY(mcfilter) link;
+
+	char            ifname[IFNAMSIZ];
+	unsigned int    ifindex;
+	int             family;
+	union mcaddr    group;
+	uint32_t        fmode;		/* MCAST_INCLUDE or MCAST_EXCLUDE */
+	int             dirty;		/* Sources changed, not yet set */
+	size_t          nsrc;		/* Entries in mcgroup_list using this */
+	size_t          nsock;
+	struct mcsock **sock;		/* One socket per chunk of sources */
+};
+
+static LIST_HEAD(, mcfilter) mcfilter_list = LIST_HEAD_INITIALIZER();
+static size_t msf_max[2];		/* Sources per chunk, IPv4 and IPv6 */
+#endif
 
 #ifdef __linux__
 /* Extremely simple "drop everything" filter for Linux so we do not get
@@ -39,6 +137,339 @@ static struct sock_fprog fprog = {
 };
 #endif
 
+static struct mcsock_pool *mcsock_pool(int family)
+{
+#ifdef HAVE_IPV6_MULTICAST_HOST
+	if (family == AF_INET6)
+		return &mcsock6_pool;
+#endif
+	(void)family;
+
+	return &mcsock4_pool;
+}
+
+/* Open a new socket, raising the limit of open files if needed */
+static int mcsock_open(int family)
+{
+	struct rlimit rlim;
+	int sd;
+
+	sd = create_socket(family, SOCK_DGRAM, family == AF_INET ? 0 : IPPROTO_UDP);
+	if (sd >= 0 || errno != EMFILE || getrlimit(RLIMIT_NOFILE, &rlim))
+		return sd;
+
+	if (rlim.rlim_cur >= rlim.rlim_max) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim)) {
+		errno = EMFILE;
+		return -1;
+	}
+	smclog(LOG_INFO, "Raised limit of open files to %ld for multicast group joins", (long)rlim.rlim_cur);
+
+	return create_socket(family, SOCK_DGRAM, family == AF_INET ? 0 : IPPROTO_UDP);
+}
+
+static struct mcsock *mcsock_new(int family)
+{
+	const char *proto = family == AF_INET ? "IPv4" : "IPv6";
+	struct mcsock *ms;
+
+	ms = calloc(1, sizeof(*ms));
+	if (!ms) {
+		smclog(LOG_ERR, "Failed allocating socket for joining %s multicast groups: %s", proto, strerror(errno));
+		return NULL;
+	}
+
+	ms->sd = mcsock_open(family);
+	if (ms->sd < 0) {
+		smclog(LOG_ERR, "Failed creating socket for joining %s multicast groups: %s", proto, strerror(errno));
+		free(ms);
+		return NULL;
+	}
+
+#ifdef __linux__
+	if (setsockopt(ms->sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+		smclog(LOG_DEBUG, "Failed setting %s socket filter, continuing anyway", proto);
+#endif
+	TAILQ_INSERT_HEAD(mcsock_pool(family), ms, link);
+
+	return ms;
+}
+
+static void mcsock_free(struct mcsock_pool *pool, struct mcsock *ms)
+{
+	TAILQ_REMOVE(pool, ms, link);
+	close(ms->sd);
+	free(ms);
+}
+
+/* A membership on @ms has been dropped */
+static void mcsock_put(int family, struct mcsock *ms)
+{
+	struct mcsock_pool *pool = mcsock_pool(family);
+
+	if (ms->count)
+		ms->count--;
+	if (!ms->count) {
+		mcsock_free(pool, ms);
+		return;
+	}
+
+	if (ms->full) {
+		ms->full = 0;
+		TAILQ_REMOVE(pool, ms, link);
+		TAILQ_INSERT_HEAD(pool, ms, link);
+	}
+}
+
+/* Close all sockets of @family, dropping all their memberships */
+static void mcsock_flush(int family)
+{
+	struct mcsock_pool *pool = mcsock_pool(family);
+	struct mcsock *ms;
+
+	while ((ms = TAILQ_FIRST(pool)))
+		mcsock_free(pool, ms);
+}
+
+/* Socket refused another membership, or source, try the next one */
+static int mcsock_is_full(int err)
+{
+	return err == ENOBUFS || err == ENOMEM;
+}
+
+/*
+ * Sockets can hold only one membership per group and interface, with
+ * one filter mode, so @ms cannot be used for a new membership of
+ * @group if it already holds one.  Except, without setsourcefilter(),
+ * for source specific joins, which add to the same include list.
+ */
+static int mcsock_holds(struct mcsock *ms, const char *ifname, int family, const union mcaddr *group, int ssm)
+{
+	static const union mcaddr any;
+	struct mcgroup *mcg;
+#ifdef USE_MSFILTER
+	struct mcfilter *f;
+	size_t i;
+#endif
+
+	LIST_FOREACH(mcg, &mcgroup_list, link) {
+		if (mcg->sock != ms || mcg->family != family || strcmp(mcg->ifname, ifname) ||
+		    memcmp(&mcg->group, group, sizeof(*group)))
+			continue;
+
+		if (!ssm || !memcmp(&mcg->source, &any, sizeof(any)))
+			return 1;
+	}
+
+#ifdef USE_MSFILTER
+	LIST_FOREACH(f, &mcfilter_list, link) {
+		if (f->family != family || strcmp(f->ifname, ifname) || memcmp(&f->group, group, sizeof(*group)))
+			continue;
+
+		for (i = 0; i < f->nsock; i++) {
+			if (f->sock[i] == ms)
+				return 1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * Make a new membership of @group on the first socket in the pool that
+ * takes it, or on a new socket.  The membership is made by @join, with
+ * @arg.  Returns the socket, or %NULL if the join failed.
+ */
+static struct mcsock *mcsock_join(const char *ifname, int family, const union mcaddr *group, int ssm,
+				  int (*join)(int sd, void *arg), void *arg)
+{
+	struct mcsock_pool *pool = mcsock_pool(family);
+	struct mcsock *ms, *tmp;
+
+	TAILQ_FOREACH_SAFE(ms, pool, link, tmp) {
+		if (ms->full)
+			break;
+		if (mcsock_holds(ms, ifname, family, group, ssm))
+			continue;
+
+		if (!join(ms->sd, arg))
+			goto done;
+		if (!mcsock_is_full(errno))
+			return NULL;
+
+		ms->full = 1;
+		TAILQ_REMOVE(pool, ms, link);
+		TAILQ_INSERT_TAIL(pool, ms, link);
+	}
+
+	ms = mcsock_new(family);
+	if (!ms)
+		return NULL;
+
+	if (join(ms->sd, arg)) {
+		if (mcsock_is_full(errno))
+			smclog(LOG_WARNING, "ADD MEMBERSHIP failed: %s", strerror(errno));
+		mcsock_free(pool, ms);
+		return NULL;
+	}
+done:
+	ms->count++;
+
+	return ms;
+}
+
+#ifdef MCAST_JOIN_SOURCE_GROUP
+/* For the protocol independent API of RFC 3678 */
+static socklen_t mcaddr_to_ss(struct sockaddr_storage *ss, int family, const union mcaddr *addr)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr   = addr->in6;
+#ifdef SIN6_LEN
+		sin6->sin6_len    = sizeof(*sin6);
+#endif
+		return sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr   = addr->in;
+#ifdef SIN6_LEN
+		sin->sin_len    = sizeof(*sin);
+#endif
+		return sizeof(*sin);
+	}
+}
+#endif
+
+/* Forget a group, its membership has been dropped */
+static void mcgroup_free(struct mcgroup *mcg)
+{
+	LIST_REMOVE(mcg, link);
+#ifdef USE_MSFILTER
+	if (mcg->filter) {
+		if (mcg->programmed)
+			watch_group(mcg->exclude ? "unblock" : "leave", mcg->ifname, mcg->family, &mcg->source, &mcg->group);
+		mcg->filter->nsrc--;
+		mcg->filter->dirty = 1;
+	}
+#endif
+	if (mcg->sock)
+		mcsock_put(mcg->family, mcg->sock);
+	free(mcg);
+}
+
+static struct mcgroup *mcgroup_find(const char *ifname, int family, const void *source, const void *group, size_t len, int exclude)
+{
+	struct mcgroup *mcg;
+	union mcaddr src, grp;
+
+	memset(&src, 0, sizeof(src));
+	memset(&grp, 0, sizeof(grp));
+	if (source)
+		memcpy(&src, source, len);
+	memcpy(&grp, group, len);
+
+	LIST_FOREACH(mcg, &mcgroup_list, link) {
+		struct iface *iface;
+
+		if (mcg->family != family || mcg->exclude != exclude || strncmp(mcg->ifname, ifname, sizeof(mcg->ifname)) ||
+		    memcmp(&mcg->source, &src, sizeof(src)) || memcmp(&mcg->group, &grp, sizeof(grp)))
+			continue;
+
+		/* Interface has been replaced, kernel has dropped the membership */
+		iface = iface_find_by_name(ifname);
+		if (!iface || iface->ifindex != mcg->ifindex) {
+			mcgroup_free(mcg);
+			return NULL;
+		}
+
+		return mcg;
+	}
+
+	return NULL;
+}
+
+/* Remember a successful join, on @ms, or a source to be set in a
+ * filter.  On failure the caller must undo the join. */
+static struct mcgroup *mcgroup_add(struct mcgroup *key, struct mcsock *ms)
+{
+	struct mcgroup *mcg;
+	struct iface *iface;
+
+	iface = iface_find_by_name(key->ifname);
+	if (!iface)
+		return NULL;
+
+	mcg = malloc(sizeof(*mcg));
+	if (!mcg)
+		return NULL;
+
+	*mcg = *key;
+	mcg->ifindex = iface->ifindex;
+	mcg->sock    = ms;
+	LIST_INSERT_HEAD(&mcgroup_list, mcg, link);
+
+	return mcg;
+}
+
+static void mcgroup_get(struct mcgroup *mcg, int conf)
+{
+	if (conf)
+		mcg->conf++;
+	else
+		mcg->refcnt++;
+}
+
+/* Drop one user, IPC first, returns number of users left */
+static int mcgroup_put(struct mcgroup *mcg)
+{
+	if (mcg->refcnt)
+		mcg->refcnt--;
+	else if (mcg->conf)
+		mcg->conf--;
+
+	return mcg->refcnt + mcg->conf;
+}
+
+/* Forget all groups of @family, their sockets have been closed */
+static void mcgroup_flush(int family)
+{
+	struct mcgroup *mcg, *tmp;
+#ifdef USE_MSFILTER
+	struct mcfilter *f, *ftmp;
+#endif
+
+	LIST_FOREACH_SAFE(mcg, &mcgroup_list, link, tmp) {
+		if (mcg->family != family)
+			continue;
+
+		LIST_REMOVE(mcg, link);
+		free(mcg);
+	}
+
+#ifdef USE_MSFILTER
+	LIST_FOREACH_SAFE(f, &mcfilter_list, link, ftmp) {
+		if (f->family != family)
+			continue;
+
+		LIST_REMOVE(f, link);
+		free(f->sock);
+		free(f);
+	}
+#endif
+	mcsock_flush(family);
+}
+
 static struct iface *find_valid_iface(const char *ifname, int cmd)
 {
 	const char *command = cmd == 'j' ? "Join" : "Leave";
@@ -52,20 +483,13 @@ static struct iface *find_valid_iface(const char *ifname, int cmd)
 	return iface;
 }
 
-static void mcgroup4_init(void)
+/* Failed join or leave, a full socket is not an error, another is tried */
+static void join_leave_error(int cmd, const char *opt)
 {
-	if (mcgroup4_socket < 0) {
-		mcgroup4_socket = create_socket(AF_INET, SOCK_DGRAM, 0);
-		if (mcgroup4_socket < 0) {
-			smclog(LOG_ERR, "Failed creating socket for joining IPv4 multicast groups: %s", strerror(errno));
-			exit(255);
-		}
+	if (EADDRINUSE == errno || (cmd == 'j' && mcsock_is_full(errno)))
+		return;
 
-#ifdef __linux__
-		if (setsockopt(mcgroup4_socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
-			smclog(LOG_DEBUG, "Failed setting IPv4 socket filter, continuing anyway");
-#endif
-	}
+	smclog(LOG_WARNING, "%s %s failed: %s", cmd == 'j' ? "ADD" : "DROP", opt, strerror(errno));
 }
 
 static int mcgroup_join_leave_ipv4(int sd, int cmd, const char *ifname, struct in_addr group)
@@ -80,161 +504,600 @@ static int mcgroup_join_leave_ipv4(int sd, int cmd, const char *ifname, struct i
 	mreq.imr_multiaddr.s_addr = group.s_addr;
 	mreq.imr_interface.s_addr = iface->inaddr.s_addr;
 	if (setsockopt(sd, IPPROTO_IP, joinleave, (void *)&mreq, sizeof(mreq))) {
-		if (EADDRINUSE != errno)
-			smclog(LOG_WARNING, "%s MEMBERSHIP failed: %s", cmd == 'j' ? "ADD" : "DROP", strerror(errno));
+		join_leave_error(cmd, "MEMBERSHIP");
 		return 1;
 	}
+	watch_group(cmd == 'j' ? "join" : "leave", ifname, AF_INET, NULL, &group);
 
 	return 0;
 }
 
-static int mcgroup_join_leave_ssm_ipv4(int sd, int cmd, const char *ifname, struct in_addr source, struct in_addr group)
+/*
+ * Source specific join or leave, with the protocol independent API of
+ * RFC 3678 where available.  It selects the interface by ifindex, so it
+ * works also for IPv4 interfaces without an address, and for IPv6.
+ * Only used without setsourcefilter().
+ */
+static int mcgroup_join_leave_ssm(int sd, int cmd, const char *ifname, int family, const union mcaddr *source, const union mcaddr *group)
 {
+#ifdef MCAST_JOIN_SOURCE_GROUP
+	int joinleave = cmd == 'j' ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP;
+	struct group_source_req gsr;
+#else
 	int joinleave = cmd == 'j' ? IP_ADD_SOURCE_MEMBERSHIP : IP_DROP_SOURCE_MEMBERSHIP;
 	struct ip_mreq_source mreqsrc;
+#endif
 	struct iface *iface = find_valid_iface(ifname, cmd);
 
 	if (!iface)
 		return 1;
 
-	mreqsrc.imr_multiaddr.s_addr = group.s_addr;
-	mreqsrc.imr_sourceaddr.s_addr = source.s_addr;
+#ifdef MCAST_JOIN_SOURCE_GROUP
+	memset(&gsr, 0, sizeof(gsr));
+	gsr.gsr_interface = iface->ifindex;
+	mcaddr_to_ss(&gsr.gsr_source, family, source);
+	mcaddr_to_ss(&gsr.gsr_group, family, group);
+	if (setsockopt(sd, family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP, joinleave, (void *)&gsr, sizeof(gsr))) {
+		join_leave_error(cmd, "SOURCE_MEMBERSHIP");
+		return 1;
+	}
+#else
+	if (family == AF_INET6) {
+		smclog(LOG_WARNING, "IPv6 source specific multicast not supported on this system.");
+		errno = EAFNOSUPPORT;
+		return 1;
+	}
+
+	mreqsrc.imr_multiaddr.s_addr = group->in.s_addr;
+	mreqsrc.imr_sourceaddr.s_addr = source->in.s_addr;
 	mreqsrc.imr_interface.s_addr = iface->inaddr.s_addr;
 	if (setsockopt(sd, IPPROTO_IP, joinleave, (void *)&mreqsrc, sizeof(mreqsrc))) {
-		if (EADDRINUSE != errno)
-			smclog(LOG_WARNING, "%s SOURCE_MEMBERSHIP failed: %s", cmd == 'j' ? "ADD" : "DROP", strerror(errno));
+		join_leave_error(cmd, "SOURCE_MEMBERSHIP");
 		return 1;
 	}
+#endif
+	watch_group(cmd == 'j' ? "join" : "leave", ifname, family, source, group);
 
 	return 0;
 }
 
-/*
- * Joins the MC group with the address 'group' on the interface 'ifname'.
- * The join is bound to the UDP socket 'sd', so if this socket is
- * closed the membership is dropped.
- *
- * returns: - 0 if the function succeeds
- *          - 1 if parameters are wrong or the join fails
- */
-int mcgroup4_join(const char *ifname, struct in_addr source, struct in_addr group)
+#ifdef HAVE_IPV6_MULTICAST_HOST
+static int mcgroup_join_leave_ipv6(int sd, int cmd, const char *ifname, struct in6_addr group)
 {
-	mcgroup4_init();
+	int joinleave = cmd == 'j' ? IPV6_JOIN_GROUP : IPV6_LEAVE_GROUP;
+	struct ipv6_mreq mreq;
+	struct iface *iface = find_valid_iface(ifname, cmd);
 
-	if (!source.s_addr)
-		return mcgroup_join_leave_ipv4(mcgroup4_socket, 'j', ifname, group);
+	if (!iface)
+		return 1;
 
-	return mcgroup_join_leave_ssm_ipv4(mcgroup4_socket, 'j', ifname, source, group);
+	mreq.ipv6mr_multiaddr = group;
+	mreq.ipv6mr_interface = iface->ifindex;
+	if (setsockopt(sd, IPPROTO_IPV6, joinleave, (void *)&mreq, sizeof(mreq))) {
+		join_leave_error(cmd, "MEMBERSHIP");
+		return 1;
+	}
+	watch_group(cmd == 'j' ? "join" : "leave", ifname, AF_INET6, NULL, &group);
+
+	return 0;
 }
+#endif /* HAVE_IPV6_MULTICAST_HOST */
 
-/*
- * Leaves the MC group with the address 'group' on the interface 'ifname'.
- *
- * returns: - 0 if the function succeeds
- *          - 1 if parameters are wrong or the join fails
- */
-int mcgroup4_leave(const char *ifname, struct in_addr source, struct in_addr group)
+static int is_ssm(const struct mcgroup *mcg)
+{
+	static const union mcaddr any;
+
+	return memcmp(&mcg->source, &any, sizeof(any)) != 0;
+}
+
+static int join_leave(int sd, int cmd, struct mcgroup *mcg)
 {
-	mcgroup4_init();
+	if (is_ssm(mcg))
+		return mcgroup_join_leave_ssm(sd, cmd, mcg->ifname, mcg->family, &mcg->source, &mcg->group);
+#ifdef HAVE_IPV6_MULTICAST_HOST
+	if (mcg->family == AF_INET6)
+		return mcgroup_join_leave_ipv6(sd, cmd, mcg->ifname, mcg->group.in6);
+#endif
 
-	if (!source.s_addr)
-		return mcgroup_join_leave_ipv4(mcgroup4_socket, 'l', ifname, group);
+	return mcgroup_join_leave_ipv4(sd, cmd, mcg->ifname, mcg->group.in);
+}
 
-	return mcgroup_join_leave_ssm_ipv4(mcgroup4_socket, 'l', ifname, source, group);
+/* Callback for mcsock_join() */
+static int join(int sd, void *arg)
+{
+	return join_leave(sd, 'j', arg);
+}
+
+#ifdef USE_MSFILTER
+/* Max sources per socket and group, halved if the kernel says no */
+static size_t msf_limit(int family)
+{
+	size_t *max = &msf_max[family == AF_INET6];
+
+	if (*max)
+		return *max;
+
+	*max = MSF_DEFAULT;
+#ifdef __linux__
+	{
+		const char *file = family == AF_INET6 ? "/proc/sys/net/ipv6/mld_max_msf" : "/proc/sys/net/ipv4/igmp_max_msf";
+		FILE *fp;
+		int num;
+
+		fp = fopen(file, "r");
+		if (fp) {
+			if (fscanf(fp, "%d", &num) == 1 && num > 0)
+				*max = num;
+			fclose(fp);
+		}
+	}
+#endif
+
+	return *max;
+}
+
+static struct mcfilter *mcfilter_get(struct mcgroup *key)
+{
+	uint32_t fmode = key->exclude ? MCAST_EXCLUDE : MCAST_INCLUDE;
+	struct mcfilter *f;
+	struct iface *iface;
+
+	LIST_FOREACH(f, &mcfilter_list, link) {
+		if (f->family == key->family && f->fmode == fmode && !strcmp(f->ifname, key->ifname) &&
+		    !memcmp(&f->group, &key->group, sizeof(f->group)))
+			return f;
+	}
+
+	iface = iface_find_by_name(key->ifname);
+	if (!iface)
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	strcpy(f->ifname, key->ifname);
+	f->ifindex = iface->ifindex;
+	f->family  = key->family;
+	f->group   = key->group;
+	f->fmode   = fmode;
+	LIST_INSERT_HEAD(&mcfilter_list, f, link);
+
+	return f;
+}
+
+struct chunk {
+	struct mcfilter         *filter;
+	struct sockaddr_storage *source;	/* First source of the chunk */
+};
+
+/* Callback for mcsock_join(), a filter can only be set on a joined group */
+static int chunk_join(int sd, void *arg)
+{
+	struct chunk *chunk = arg;
+	struct mcfilter *f = chunk->filter;
+	int level = f->family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+
+	if (f->fmode == MCAST_INCLUDE) {
+		struct group_source_req gsr;
+
+		memset(&gsr, 0, sizeof(gsr));
+		gsr.gsr_interface = f->ifindex;
+		gsr.gsr_source    = *chunk->source;
+		mcaddr_to_ss(&gsr.gsr_group, f->family, &f->group);
+
+		return setsockopt(sd, level, MCAST_JOIN_SOURCE_GROUP, (void *)&gsr, sizeof(gsr));
+	} else {
+		struct group_req gr;
+
+		memset(&gr, 0, sizeof(gr));
+		gr.gr_interface = f->ifindex;
+		mcaddr_to_ss(&gr.gr_group, f->family, &f->group);
+
+		return setsockopt(sd, level, MCAST_JOIN_GROUP, (void *)&gr, sizeof(gr));
+	}
+}
+
+static void chunk_leave(struct mcfilter *f, size_t i)
+{
+	struct group_req gr;
+
+	memset(&gr, 0, sizeof(gr));
+	gr.gr_interface = f->ifindex;
+	mcaddr_to_ss(&gr.gr_group, f->family, &f->group);
+	setsockopt(f->sock[i]->sd, f->family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP,
+		   MCAST_LEAVE_GROUP, (void *)&gr, sizeof(gr));
+
+	mcsock_put(f->family, f->sock[i]);
+	f->sock[i] = NULL;
 }
 
 /*
- * Close IPv4 multicast socket to kernel to leave any joined groups
+ * Set all sources of @f in the kernel, one setsourcefilter() call per
+ * chunk, and leave chunks no longer needed.
  */
-void mcgroup4_disable(void)
+static int mcfilter_commit(struct mcfilter *f)
 {
-	if (mcgroup4_socket != -1) {
-		close(mcgroup4_socket);
-		mcgroup4_socket = -1;
+	struct sockaddr_storage *slist = NULL, grp;
+	struct mcgroup *mcg;
+	struct iface *iface;
+	size_t i, n = 0, max, num;
+	socklen_t len;
+	int rc = 0;
+
+	/* Interface replaced, or gone, the kernel has dropped all chunks */
+	iface = iface_find_by_name(f->ifname);
+	if (!iface || iface->ifindex != f->ifindex) {
+		for (i = 0; i < f->nsock; i++) {
+			if (f->sock[i])
+				mcsock_put(f->family, f->sock[i]);
+		}
+		f->nsock = 0;
+		LIST_FOREACH(mcg, &mcgroup_list, link) {
+			if (mcg->filter == f)
+				mcg->programmed = 0;
+		}
+		if (!iface) {
+			if (f->nsrc)
+				smclog(LOG_WARNING, "Join multicast group, unknown interface %s", f->ifname);
+			return f->nsrc ? 1 : 0;
+		}
+		f->ifindex = iface->ifindex;
+	}
+
+	if (f->nsrc) {
+		slist = calloc(f->nsrc, sizeof(*slist));
+		if (!slist) {
+			smclog(LOG_ERR, "Failed setting source filter on %s: %s", f->ifname, strerror(errno));
+			return 1;
+		}
+	}
+	LIST_FOREACH(mcg, &mcgroup_list, link) {
+		if (mcg->filter == f && n < f->nsrc)
+			mcaddr_to_ss(&slist[n++], f->family, &mcg->source);
+	}
+	len = mcaddr_to_ss(&grp, f->family, &f->group);
+
+retry:
+	max = f->fmode == MCAST_EXCLUDE ? MAX(n, 1) : msf_limit(f->family);
+	num = (n + max - 1) / max;
+	if (num > f->nsock) {
+		struct mcsock **sock;
+
+		sock = realloc(f->sock, num * sizeof(*sock));
+		if (!sock) {
+			smclog(LOG_ERR, "Failed setting source filter on %s: %s", f->ifname, strerror(errno));
+			free(slist);
+			return 1;
+		}
+		for (i = f->nsock; i < num; i++)
+			sock[i] = NULL;
+		f->sock  = sock;
+		f->nsock = num;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct sockaddr_storage *src = &slist[i * max];
+		size_t cnt = MIN(max, n - i * max);
+
+		if (!f->sock[i]) {
+			struct chunk chunk = { f, src };
+
+			f->sock[i] = mcsock_join(f->ifname, f->family, &f->group, 0, chunk_join, &chunk);
+			if (!f->sock[i]) {
+				join_leave_error('j', "MEMBERSHIP");
+				rc = 1;
+				break;
+			}
+		}
+
+		if (setsourcefilter(f->sock[i]->sd, f->ifindex, (struct sockaddr *)&grp, len, f->fmode, cnt, src)) {
+			if (mcsock_is_full(errno) && f->fmode == MCAST_INCLUDE && max > 1) {
+				msf_max[f->family == AF_INET6] = max / 2;
+				smclog(LOG_DEBUG, "Kernel refused %zu sources per socket and group, trying %zu", max, max / 2);
+				goto retry;
+			}
+
+			smclog(LOG_WARNING, "Failed setting %zu sources of %s group on %s: %s", cnt,
+			       f->fmode == MCAST_INCLUDE ? "included" : "excluded", f->ifname, strerror(errno));
+			rc = 1;
+			break;
+		}
 	}
+
+	/* Chunks no longer needed, or not set */
+	for (; i < f->nsock; i++) {
+		if (f->sock[i])
+			chunk_leave(f, i);
+	}
+	f->nsock = num;
+	if (rc) {
+		while (f->nsock && !f->sock[f->nsock - 1])
+			f->nsock--;
+	}
+	free(slist);
+
+	if (rc)
+		return rc;
+
+	LIST_FOREACH(mcg, &mcgroup_list, link) {
+		if (mcg->filter != f || mcg->programmed)
+			continue;
+
+		watch_group(mcg->exclude ? "block" : "join", mcg->ifname, mcg->family, &mcg->source, &mcg->group);
+		mcg->programmed = 1;
+	}
+
+	return 0;
 }
 
-#ifdef HAVE_IPV6_MULTICAST_HOST
-static int mcgroup6_socket = -1;
+/* Set sources of @f if changed, release it if no longer used */
+static int mcfilter_update(struct mcfilter *f)
+{
+	int rc = 0;
 
-static void mcgroup6_init(void)
+	if (f->dirty) {
+		f->dirty = 0;
+		rc = mcfilter_commit(f);
+		if (rc)
+			f->dirty = 1;	/* Retried on next commit */
+	}
+
+	if (!f->nsrc && !f->nsock) {
+		LIST_REMOVE(f, link);
+		free(f->sock);
+		free(f);
+	}
+
+	return rc;
+}
+#endif /* USE_MSFILTER */
+
+/* Set all changed source filters */
+static int mcgroup_commit(void)
 {
-	if (mcgroup6_socket < 0) {
-		mcgroup6_socket = create_socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-		if (mcgroup6_socket < 0) {
-			smclog(LOG_WARNING, "Failed creating socket for joining IPv6 multicast groups: %s", strerror(errno));
-			return;
-		}
+	int rc = 0;
+#ifdef USE_MSFILTER
+	struct mcfilter *f, *tmp;
 
-#ifdef __linux__
-		if (setsockopt(mcgroup6_socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
-			smclog(LOG_DEBUG, "Failed setting IPv6 socket filter, continuing anyway");
+	LIST_FOREACH_SAFE(f, &mcfilter_list, link, tmp)
+		rc |= mcfilter_update(f);
 #endif
-	}
+
+	return rc;
 }
 
-static int mcgroup_join_leave_ipv6(int sd, int cmd, const char *ifname, struct in6_addr group)
+/* Leave @mcg, last user gone.  As a source of a filter it is removed
+ * from the kernel by the next commit of the filter. */
+static int mcgroup_drop(struct mcgroup *mcg)
 {
-	int joinleave = cmd == 'j' ? IPV6_JOIN_GROUP : IPV6_LEAVE_GROUP;
-	struct ipv6_mreq mreq;
-	struct iface *iface = find_valid_iface(ifname, cmd);
+	struct iface *iface;
+	int result = 0;
 
-	if (!iface)
-		return 1;
+	/* Interface has been replaced, kernel has dropped the membership */
+	iface = iface_find_by_name(mcg->ifname);
+	if (!mcg->filter && iface && iface->ifindex == mcg->ifindex)
+		result = join_leave(mcg->sock->sd, 'l', mcg);
+	mcgroup_free(mcg);
 
-	mreq.ipv6mr_multiaddr = group;
-	mreq.ipv6mr_interface = iface->ifindex;
-	if (setsockopt(sd, IPPROTO_IPV6, joinleave, (void *)&mreq, sizeof(mreq))) {
-		if (EADDRINUSE != errno)
-			smclog(LOG_WARNING, "%s MEMBERSHIP failed: %s", cmd == 'j' ? "ADD" : "DROP", strerror(errno));
-		return 1;
+	return result;
+}
+
+/*
+ * Joins the MC group with the address 'group' on the interface 'ifname'.
+ * Any-source joins are made at once on a socket from the pool, which is
+ * remembered for the leave.  Sources are set with the other sources of
+ * the group, see mcgroup_commit().  If 'conf' is set the join is from
+ * the .conf file, otherwise from IPC.  Joining an already joined group
+ * only adds a user.
+ */
+static int mcgroup_join(const char *ifname, int family, const void *source, const void *group, size_t len, int exclude, int conf)
+{
+	struct mcgroup *mcg, key;
+	struct mcsock *ms = NULL;
+
+	mcg = mcgroup_find(ifname, family, source, group, len, exclude);
+	if (!mcg) {
+		if (!find_valid_iface(ifname, 'j'))
+			return 1;
+
+		memset(&key, 0, sizeof(key));
+		strncpy(key.ifname, ifname, sizeof(key.ifname) - 1);
+		key.family  = family;
+		key.exclude = exclude;
+		if (source)
+			memcpy(&key.source, source, len);
+		memcpy(&key.group, group, len);
+
+#ifdef USE_MSFILTER
+		if (is_ssm(&key)) {
+			key.filter = mcfilter_get(&key);
+			if (!key.filter)
+				return 1;
+
+			mcg = mcgroup_add(&key, NULL);
+			if (!mcg) {
+				key.filter->dirty = 1;
+				return 1;
+			}
+
+			key.filter->nsrc++;
+			key.filter->dirty = 1;
+			mcgroup_get(mcg, conf);
+			if (conf || !mcfilter_update(key.filter))
+				return 0;
+
+			/* Failed over IPC, undo */
+			mcgroup_put(mcg);
+			mcgroup_free(mcg);
+			mcfilter_update(key.filter);
+
+			return 1;
+		}
+#endif
+		if (exclude) {
+			smclog(LOG_WARNING, "Excluding sources not supported on this system.");
+			return 1;
+		}
+
+		ms = mcsock_join(ifname, family, &key.group, is_ssm(&key), join, &key);
+		if (!ms)
+			return 1;
+
+		mcg = mcgroup_add(&key, ms);
+		if (!mcg) {
+			/* Cannot track it, so undo the join */
+			join_leave(ms->sd, 'l', &key);
+			mcsock_put(family, ms);
+			return 1;
+		}
 	}
+	mcgroup_get(mcg, conf);
 
 	return 0;
 }
 
+/*
+ * Leaves the MC group with the address 'group' on the interface
+ * 'ifname'.  The membership is only dropped when the last user leaves.
+ */
+static int mcgroup_leave(const char *ifname, int family, const void *source, const void *group, size_t len)
+{
+	struct mcgroup *mcg;
+	int result;
+#ifdef USE_MSFILTER
+	struct mcfilter *f;
+#endif
+
+	mcg = mcgroup_find(ifname, family, source, group, len, 0);
+	if (!mcg) {
+		if (find_valid_iface(ifname, 'l'))
+			smclog(LOG_WARNING, "Leave multicast group, not joined on %s", ifname);
+		return 1;
+	}
+	if (mcgroup_put(mcg))
+		return 0;
+
+#ifdef USE_MSFILTER
+	f = mcg->filter;
+	result = mcgroup_drop(mcg);
+	if (f && mcfilter_update(f))
+		result = 1;
+#else
+	result = mcgroup_drop(mcg);
+#endif
+
+	return result;
+}
+
 /*
  * Joins the MC group with the address 'group' on the interface 'ifname'.
- * The join is bound to the UDP socket 'sd', so if this socket is
- * closed the membership is dropped.
+ * The join is bound to a socket in the pool, so if this socket is
+ * closed the membership is dropped.  If 'exclude' is set, traffic from
+ * 'source' is not wanted, from any other source it is.  If 'conf' is
+ * set the join is from the .conf file, otherwise from IPC.  Joining an
+ * already joined group only adds a user.
  *
  * returns: - 0 if the function succeeds
  *          - 1 if parameters are wrong or the join fails
  */
-int mcgroup6_join(const char *ifname, struct in6_addr group)
+int mcgroup4_join(const char *ifname, struct in_addr source, struct in_addr group, int exclude, int conf)
 {
-	mcgroup6_init();
-
-	return mcgroup_join_leave_ipv6(mcgroup6_socket, 'j', ifname, group);
+	return mcgroup_join(ifname, AF_INET, &source, &group, sizeof(group), exclude, conf);
 }
 
 /*
  * Leaves the MC group with the address 'group' on the interface 'ifname'.
+ * The membership is only dropped when the last user leaves.
  *
  * returns: - 0 if the function succeeds
  *          - 1 if parameters are wrong or the join fails
  */
-int mcgroup6_leave(const char *ifname, struct in6_addr group)
+int mcgroup4_leave(const char *ifname, struct in_addr source, struct in_addr group)
 {
-	mcgroup6_init();
+	return mcgroup_leave(ifname, AF_INET, &source, &group, sizeof(group));
+}
 
-	return mcgroup_join_leave_ipv6(mcgroup6_socket, 'l', ifname, group);
+/*
+ * Close IPv4 multicast sockets to kernel to leave any joined groups
+ */
+void mcgroup4_disable(void)
+{
+	mcgroup_flush(AF_INET);
+}
+
+#ifdef HAVE_IPV6_MULTICAST_HOST
+/*
+ * Joins the MC group with the address 'group' on the interface 'ifname',
+ * only from 'source' unless it is the unspecified address.  The join
+ * is bound to a socket in the pool, so if this socket is closed the
+ * membership is dropped.  See mcgroup4_join() for 'exclude' and 'conf'.
+ *
+ * returns: - 0 if the function succeeds
+ *          - 1 if parameters are wrong or the join fails
+ */
+int mcgroup6_join(const char *ifname, struct in6_addr source, struct in6_addr group, int exclude, int conf)
+{
+	return mcgroup_join(ifname, AF_INET6, &source, &group, sizeof(group), exclude, conf);
+}
+
+/*
+ * Leaves the MC group with the address 'group' on the interface 'ifname'.
+ * The membership is only dropped when the last user leaves.
+ *
+ * returns: - 0 if the function succeeds
+ *          - 1 if parameters are wrong or the join fails
+ */
+int mcgroup6_leave(const char *ifname, struct in6_addr source, struct in6_addr group)
+{
+	return mcgroup_leave(ifname, AF_INET6, &source, &group, sizeof(group));
 }
 #endif /* HAVE_IPV6_MULTICAST_HOST */
 
 /*
- * Close IPv6 multicast socket to kernel to leave any joined groups
+ * Close IPv6 multicast sockets to kernel to leave any joined groups
  */
 void mcgroup6_disable(void)
 {
 #ifdef HAVE_IPV6_MULTICAST_HOST
-	if (mcgroup6_socket != -1) {
-		close(mcgroup6_socket);
-		mcgroup6_socket = -1;
-	}
+	mcgroup_flush(AF_INET6);
 #endif /* HAVE_IPV6_MULTICAST_HOST */
 }
 
+/**
+ * mcgroup_mark - Forget all .conf file joins before a reload
+ *
+ * The .conf file is then read, counting its joins again from zero.
+ * Groups still joined only by the old .conf file, not the new one,
+ * are left by mcgroup_sweep().  Joins over IPC are not affected.
+ */
+void mcgroup_mark(void)
+{
+	struct mcgroup *mcg;
+
+	LIST_FOREACH(mcg, &mcgroup_list, link)
+		mcg->conf = 0;
+}
+
+/**
+ * mcgroup_sweep - Leave all groups no longer joined by anyone
+ *
+ * Called when the .conf file has been applied, also sets the sources
+ * joined, or left, by it in the kernel.
+ */
+void mcgroup_sweep(void)
+{
+	struct mcgroup *mcg, *tmp;
+
+	LIST_FOREACH_SAFE(mcg, &mcgroup_list, link, tmp) {
+		if (mcg->conf || mcg->refcnt)
+			continue;
+
+		mcgroup_drop(mcg);
+	}
+	mcgroup_commit();
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -50,6 +50,8 @@
 #include "queue.h"
 #include "config.h"
 #include "common.h"
+#include "timer.h"
+#include "trie.h"
 
 #ifdef HAVE_LINUX_MROUTE_H
 #define _LINUX_IN_H             /* For Linux <= 2.6.25 */
@@ -105,16 +107,24 @@
 #endif
 
 struct iface {
+	TAILQ_ENTRY(iface) link;
+
 	char name[IFNAMSIZ + 1];
 	struct in_addr inaddr;	/* == 0 for non IP interfaces */
-	u_short ifindex;	/* Physical interface index   */
-	short flags;
+	unsigned int ifindex;	/* Physical interface index   */
+	unsigned int flags;
 	short vif;
 	short mif;
 	uint8_t threshold;	/* TTL threshold: 1-255, default: 1 */
+	uint8_t disabled;	/* phyint IFNAME disable, no VIF/MIF on demand */
+	uint8_t stale;		/* Not seen again by iface_init() */
 };
 
 extern int do_vifs;
+extern int lazy_vifs;
+extern int do_wildcard;
+extern int cache_tmo;
+extern int blackhole_tmo;
 
 /* mroute-api.c */
 
@@ -133,9 +143,19 @@ struct mroute4 {
 	struct in_addr sender;
 	struct in_addr group;           /* multicast group */
 	short          len;		/* prefix len, or 0:disabled */
+	short          src_len;		/* source prefix len, or 0:disabled */
 
 	short          inbound;         /* incoming VIF    */
 	uint8_t        ttl[MAX_MC_VIFS];/* outgoing VIFs   */
+	uint8_t        wildcard;	/* (*,G) rule set as kernel route */
+	uint8_t        stale;		/* Not set again since mroute_mark() */
+
+	struct mroute4 *rule;		/* (*,G) rule a dynamic route was set from */
+	LIST_HEAD(, mroute4) dyn_list;	/* dynamic routes set from this (*,G) rule */
+	struct trie    except;		/* sources excluded from this (*,G) rule */
+
+	struct timer   timer;		/* idle timer of a dynamic route */
+	unsigned long  pktcnt;		/* kernel packet count, less wrong VIF, at last check */
 };
 
 /*
@@ -152,10 +172,24 @@ struct mroute4 {
 #endif
 
 struct mroute6 {
+	LIST_ENTRY(mroute6) link;
+
 	struct sockaddr_in6 sender;
 	struct sockaddr_in6 group;      /* multicast group */
+	short   len;			/* prefix len, or 0:disabled */
+	short   src_len;		/* source prefix len, or 0:disabled */
+
 	short   inbound;                /* incoming VIF    */
 	uint8_t ttl[MAX_MC_MIFS];       /* outgoing VIFs   */
+	uint8_t wildcard;		/* (*,G) rule set as kernel route */
+	uint8_t stale;			/* Not set again since mroute_mark() */
+
+	struct mroute6 *rule;		/* (*,G) rule a dynamic route was set from */
+	LIST_HEAD(, mroute6) dyn_list;	/* dynamic routes set from this (*,G) rule */
+	struct trie     except;		/* sources excluded from this (*,G) rule */
+
+	struct timer  timer;		/* idle timer of a dynamic route */
+	unsigned long pktcnt;		/* kernel packet count, less wrong VIF, at last check */
 };
 
 /*
@@ -184,29 +218,49 @@ extern int mroute4_socket;
 extern int mroute6_socket;
 
 int  mroute4_enable    (void);
+int  mroute4_filter_add(uint8_t type);
 void mroute4_disable   (void);
 int  mroute4_dyn_add   (struct mroute4 *mroute);
 void mroute4_dyn_flush (void);
+int  mroute4_except    (struct mroute4 *mroute, struct in_addr source, int len);
 int  mroute4_add       (struct mroute4 *mroute);
 int  mroute4_del       (struct mroute4 *mroute);
 
 int  mroute6_enable    (void);
+int  mroute6_filter_add(uint8_t type);
 void mroute6_disable   (void);
+int  mroute6_dyn_add   (struct mroute6 *mroute);
+void mroute6_dyn_flush (void);
+int  mroute6_except    (struct mroute6 *mroute, struct in6_addr *source, int len);
 int  mroute6_add       (struct mroute6 *mroute);
 int  mroute6_del       (struct mroute6 *mroute);
 
 int  mroute_add_vif    (char *ifname, uint8_t threshold);
 int  mroute_del_vif    (char *ifname);
+int  mroute_pin_vif    (char *ifname, int vif, int mif);
+void mroute_unpin_vifs (void);
+void mroute_vif_gone   (struct iface *iface);
+void mroute_reclaim_vifs (void);
+int  mroute_find_vif_by_name (const char *ifname);
+int  mroute_find_mif_by_name (const char *ifname);
+int  mroute_get_vif_by_name  (const char *ifname);
+int  mroute_get_mif_by_name  (const char *ifname);
+
+void mroute_mark       (void);
+void mroute_sweep      (void);
 
 /* mcgroup.c */
-int  mcgroup4_join      (const char *ifname, struct in_addr  source, struct in_addr  group);
+int  mcgroup4_join      (const char *ifname, struct in_addr  source, struct in_addr  group, int exclude, int conf);
 int  mcgroup4_leave     (const char *ifname, struct in_addr  source, struct in_addr  group);
 void mcgroup4_disable   (void);
 
-int  mcgroup6_join      (const char *ifname, struct in6_addr group);
-int  mcgroup6_leave     (const char *ifname, struct in6_addr group);
+int  mcgroup6_join      (const char *ifname, struct in6_addr source, struct in6_addr group, int exclude, int conf);
+int  mcgroup6_leave     (const char *ifname, struct in6_addr source, struct in6_addr group);
 void mcgroup6_disable   (void);
 
+void mcgroup_mark       (void);
+void mcgroup_sweep      (void);
+
 /* log.c */
 #define LOG_INIT 10
 
@@ -216,9 +270,59 @@ extern char log_message[128];
 int loglvl(const char *level);
 void smclog(int severity, const char *fmt, ...);
 
+/* netlink.c */
+#ifdef HAVE_LINUX_RTNETLINK_H
+int  netlink_init  (void (*cb)(void));
+void netlink_exit  (void);
+int  netlink_dump  (void);
+#else
+#define netlink_init(cb) 0
+#define netlink_exit()   do { } while (0)
+#endif
+
 /* parse-conf.c */
-int run_script(struct mroute *mroute);
-int parse_conf_file(const char *file);
+int  parse_conf_file   (const char *file);
+void parse_conf_reapply(void);
+
+/* script.c */
+extern char *script_exec;
+extern int   script_batch;
+
+int  script_init (void);
+void script_exit (void);
+int  run_script  (const char *action, struct mroute *mroute);
+
+/* upcall.c */
+extern int upcall_rate;
+extern int upcall_burst;
+
+int  upcall_init       (void);
+void upcall_exit       (void);
+void upcall_invalidate (void);
+void upcall_stats      (void);
+int  upcall_filter4    (struct mroute4 *route);
+void upcall_done4      (struct mroute4 *route, int result);
+void upcall_forget4    (struct mroute4 *route);
+void upcall_flush4     (void);
+int  upcall_filter6    (struct mroute6 *route);
+void upcall_done6      (struct mroute6 *route, int result);
+void upcall_forget6    (struct mroute6 *route);
+void upcall_flush6     (void);
+
+/* watch.c */
+#ifdef ENABLE_CLIENT
+int  watch_add     (int sd);
+void watch_exit    (void);
+void watch_mroute4 (const char *event, struct mroute4 *route);
+void watch_mroute6 (const char *event, struct mroute6 *route);
+void watch_vif     (const char *event, const char *ifname, int family, int vif);
+void watch_group   (const char *event, const char *ifname, int family, const void *source, const void *group);
+#else
+#define watch_mroute4(event, route) do { } while (0)
+#define watch_mroute6(event, route) do { } while (0)
+#define watch_vif(event, ifname, family, vif) do { } while (0)
+#define watch_group(event, ifname, family, source, group) do { } while (0)
+#endif
 
 /* pidfile.c */
 int pidfile(const char *basename, uid_t uid, gid_t gid);
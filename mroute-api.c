@@ -25,11 +25,18 @@
 #include "config.h"
 
 #include "ifvc.h"
+#include "htab.h"
 #include "mclab.h"
+#include "trie.h"
 
 #ifdef HAVE_NETINET6_IP6_MROUTE_H
 #include <netinet6/ip6_mroute.h>
 #endif
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+#include <netinet/icmp6.h>
+#endif
+
+#define MROUTE_DROP_MAX 4096	/* Blackhole routes, per address family */
 
 /* MAX_MC_VIFS from mclab.h must have same value as MAXVIFS from mroute.h */
 #if MAX_MC_VIFS != MAXVIFS
@@ -50,13 +57,40 @@
 int mroute4_socket = -1;
 
 /* All user added/configured (*,G) routes that are matched on-demand
- * at runtime. See the mroute4_dyn_list for the actual (S,G) routes
- * set from this "template". */
+ * at runtime. See the dyn_list of each rule for the actual (S,G)
+ * routes set from this "template". */
 LIST_HEAD(, mroute4) mroute4_conf_list = LIST_HEAD_INITIALIZER();
 
+/* Index of the above (*,G) rules, a two-dimensional hierarchical trie:
+ * one trie per inbound VIF keyed on the group prefix, where each group
+ * prefix holds a trie of its rules keyed on the source prefix.  Lookup
+ * finds the rule with the most specific group prefix, and of those the
+ * most specific source prefix, skipping rules excluding the source.  So
+ * a lookup takes at most 33 x 33 steps regardless of the number of
+ * rules, see mroute4_match(). */
+static struct trie mroute4_conf_trie[MAXVIFS];
+static void mroute4_rules_free(void *rules);
+
 /* For dynamically/on-demand set (S,G) routes that we must track
- * if the user removes the configured (*,G) route. */
-LIST_HEAD(, mroute4) mroute4_dyn_list = LIST_HEAD_INITIALIZER();
+ * if the user removes the configured (*,G) route.  Indexed on
+ * (source, group, inbound VIF) to catch duplicate upcalls. */
+static uint32_t mroute4_dyn_hash(const void *entry);
+static int      mroute4_dyn_cmp (const void *a, const void *b);
+static void     mroute4_dyn_release(void *entry);
+static struct htab mroute4_dyn_tab = HTAB_INITIALIZER(mroute4_dyn_hash, mroute4_dyn_cmp);
+
+/* Static (S,G) routes, set from the .conf file or by the user, indexed
+ * on (source, group) like the kernel does, so a reload only needs to
+ * change the kernel routes that have actually changed. */
+static uint32_t mroute4_static_hash(const void *entry);
+static int      mroute4_static_cmp (const void *a, const void *b);
+static struct htab mroute4_static_tab = HTAB_INITIALIZER(mroute4_static_hash, mroute4_static_cmp);
+
+/* Blackhole (S,G) routes, without outbound VIFs, set with -B SEC for
+ * upcalls not matching any (*,G) rule.  Indexed on (source, group) as
+ * the static routes, and listed for rematching when rules are added. */
+static LIST_HEAD(, mroute4) mroute4_drop_list = LIST_HEAD_INITIALIZER();
+static struct htab mroute4_drop_tab = HTAB_INITIALIZER(mroute4_static_hash, mroute4_static_cmp);
 
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
 /*
@@ -64,24 +98,163 @@ LIST_HEAD(, mroute4) mroute4_dyn_list = LIST_HEAD_INITIALIZER();
  * Receives MLD packets and kernel upcall messages.
  */
 int mroute6_socket = -1;
+
+/* All user added/configured (*,G) routes, same as for IPv4 above,
+ * indexed per inbound MIF on the group prefix, and then per group
+ * prefix on the source prefix, at most 129 x 129 lookup steps. */
+LIST_HEAD(, mroute6) mroute6_conf_list = LIST_HEAD_INITIALIZER();
+static struct trie mroute6_conf_trie[MAXMIFS];
+static void mroute6_rules_free(void *rules);
+
+/* Dynamically/on-demand set (S,G) routes, indexed on (source, group,
+ * inbound MIF), and listed in the dyn_list of their (*,G) rule. */
+static uint32_t mroute6_dyn_hash(const void *entry);
+static int      mroute6_dyn_cmp (const void *a, const void *b);
+static void     mroute6_dyn_release(void *entry);
+static struct htab mroute6_dyn_tab = HTAB_INITIALIZER(mroute6_dyn_hash, mroute6_dyn_cmp);
+
+/* Static (S,G) routes, indexed on (source, group), as for IPv4 above. */
+static uint32_t mroute6_static_hash(const void *entry);
+static int      mroute6_static_cmp (const void *a, const void *b);
+static struct htab mroute6_static_tab = HTAB_INITIALIZER(mroute6_static_hash, mroute6_static_cmp);
+
+/* Blackhole (S,G) routes, as for IPv4 above. */
+static LIST_HEAD(, mroute6) mroute6_drop_list = LIST_HEAD_INITIALIZER();
+static struct htab mroute6_drop_tab = HTAB_INITIALIZER(mroute6_static_hash, mroute6_static_cmp);
 #endif
 
-/* IPv4 internal virtual interfaces (VIF) descriptor vector */
-static struct {
+/*
+ * VIF/MIF descriptor.  The name of the last interface to use a VIF is
+ * kept also after the VIF is removed, so the interface gets the same
+ * VIF back if it returns, after a reload or being recreated.  Other
+ * interfaces get VIFs never used before, if possible.  A VIF can also
+ * be pinned to an interface name in the .conf file, reserving it.
+ *
+ * Each VIF counts the (*,G) rules and (S,G) routes using it, inbound or
+ * outbound.  In lazy mode, -z, VIFs are set up when first used by a
+ * route, and removed again when the last route using them is removed.
+ */
+struct vif {
 	struct iface *iface;
-} vif_list[MAXVIFS];
+	char          name[IFNAMSIZ + 1];
+	uint8_t       pinned;
+	uint8_t       lazy;		/* Set up on demand, remove when unused */
+	unsigned int  refcnt;		/* Rules and routes using this VIF */
+};
+
+/* IPv4 internal virtual interfaces (VIF) descriptor vector */
+static struct vif vif_list[MAXVIFS];
 
 static int mroute4_add_vif(struct iface *iface);
 
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
 /* IPv6 internal virtual interfaces (VIF) descriptor vector */
-static struct mif {
-	struct iface *iface;
-} mif_list[MAXMIFS];
+static struct vif mif_list[MAXMIFS];
 
 static int mroute6_add_mif(struct iface *iface);
 #endif
 
+/* IGMP and MLD message types, besides kernel upcalls, that features
+ * have asked to receive on the multicast routing sockets. */
+#define MAX_FILTER_TYPES 8
+
+static uint8_t mroute4_types[MAX_FILTER_TYPES];
+static size_t  mroute4_num_types;
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+static uint8_t mroute6_types[MAX_FILTER_TYPES];
+static size_t  mroute6_num_types;
+#endif
+
+/*
+ * Attach a socket filter to a multicast routing socket so only kernel
+ * upcalls reach us, not every IGMP/MLD packet on the box.  Upcalls are
+ * recognized by a zero where the IPv4 protocol is, or where the ICMPv6
+ * type is, since the IPv6 socket gets the ICMPv6 header first.  Packets
+ * with any of the message @types are also let through.
+ */
+static int mroute_filter(int sd, int ipv4, uint8_t *types, size_t num)
+{
+#ifdef __linux__
+	struct sock_filter filter[MAX_FILTER_TYPES + 6];
+	struct sock_fprog fprog;
+	size_t i, len = 0, accept;
+
+	accept = 2 + (ipv4 && num ? 2 : 0) + num + 1;
+
+	filter[len] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ipv4 ? 9 : 0);
+	len++;
+	filter[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, accept - len - 1, 0);
+	len++;
+
+	/* IGMP message type is after the variable length IP header */
+	if (ipv4 && num) {
+		filter[len++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+		filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0);
+	}
+
+	for (i = 0; i < num; i++) {
+		filter[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, types[i], accept - len - 1, 0);
+		len++;
+	}
+
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	fprog.len    = len;
+	fprog.filter = filter;
+
+	return setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+#else
+	(void)sd;
+	(void)ipv4;
+	(void)types;
+	(void)num;
+
+	return 0;
+#endif
+}
+
+/* Add @type to @types, unless already there */
+static int mroute_filter_type(uint8_t *types, size_t *num, uint8_t type)
+{
+	size_t i;
+
+	for (i = 0; i < *num; i++) {
+		if (types[i] == type)
+			return 0;
+	}
+
+	if (*num >= MAX_FILTER_TYPES) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	types[(*num)++] = type;
+
+	return 0;
+}
+
+/**
+ * mroute4_filter_add - Receive IGMP messages of a type on the mroute socket
+ * @type: IGMP message type, e.g. %IGMP_V2_MEMBERSHIP_REPORT
+ *
+ * By default only kernel upcalls reach the IPv4 multicast routing
+ * socket, a feature that needs IGMP messages must ask for them.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute4_filter_add(uint8_t type)
+{
+	if (mroute_filter_type(mroute4_types, &mroute4_num_types, type))
+		return -1;
+
+	if (mroute4_socket < 0)
+		return 0;
+
+	return mroute_filter(mroute4_socket, 1, mroute4_types, mroute4_num_types);
+}
+
 /**
  * mroute4_enable - Initialise IPv4 multicast routing
  *
@@ -94,7 +267,6 @@ static int mroute6_add_mif(struct iface *iface);
 int mroute4_enable(void)
 {
 	int arg = 1;
-	unsigned int i;
 	struct iface *iface;
 
 	mroute4_socket = create_socket(AF_INET, SOCK_RAW, IPPROTO_IGMP);
@@ -122,18 +294,20 @@ int mroute4_enable(void)
 		return -1;
 	}
 
+	if (mroute_filter(mroute4_socket, 1, mroute4_types, mroute4_num_types))
+		smclog(LOG_DEBUG, "Failed setting IPv4 multicast routing socket filter, continuing anyway");
+
 	/* Initialize virtual interface table */
 	memset(&vif_list, 0, sizeof(vif_list));
 
 	/* Create virtual interfaces (VIFs) for all non-loopback interfaces supporting multicast */
-	for (i = 0; do_vifs && (iface = iface_find_by_index(i)); i++) {
+	for (iface = iface_iterator(1); do_vifs && iface; iface = iface_iterator(0)) {
 		/* No point in continuing the loop when out of VIF's */
 		if (mroute4_add_vif(iface))
 			break;
 	}
 
 	LIST_INIT(&mroute4_conf_list);
-	LIST_INIT(&mroute4_dyn_list);
 
 	return 0;
 }
@@ -146,6 +320,7 @@ int mroute4_enable(void)
 void mroute4_disable(void)
 {
 	struct mroute4 *entry;
+	size_t i;
 
 	if (mroute4_socket < 0)
 		return;
@@ -158,42 +333,99 @@ void mroute4_disable(void)
 	mroute4_socket = -1;
 
 	/* Free list of (*,G) routes on SIGHUP */
+	for (i = 0; i < NELEMS(mroute4_conf_trie); i++)
+		trie_flush(&mroute4_conf_trie[i], mroute4_rules_free);
 	while (!LIST_EMPTY(&mroute4_conf_list)) {
 		entry = LIST_FIRST(&mroute4_conf_list);
 		LIST_REMOVE(entry, link);
+		trie_flush(&entry->except, NULL);
 		free(entry);
 	}
-	while (!LIST_EMPTY(&mroute4_dyn_list)) {
-		entry = LIST_FIRST(&mroute4_dyn_list);
-		LIST_REMOVE(entry, link);
-		free(entry);
+	htab_exit(&mroute4_dyn_tab, mroute4_dyn_release);
+	htab_exit(&mroute4_static_tab, free);
+	LIST_INIT(&mroute4_drop_list);
+	htab_exit(&mroute4_drop_tab, mroute4_dyn_release);
+}
+
+
+/* VIF pinned to @name, or -1 */
+static int vif_pinned(struct vif *list, size_t num, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (list[i].pinned && !strcmp(list[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Find a free VIF for @iface: pinned, used before, never used, any */
+static int vif_alloc(struct vif *list, size_t num, struct iface *iface)
+{
+	size_t i;
+	int vif;
+
+	vif = vif_pinned(list, num, iface->name);
+	if (vif >= 0) {
+		if (!list[vif].iface)
+			return vif;
+
+		smclog(LOG_WARNING, "Pinned VIF %d of %s busy with %s", vif, iface->name, list[vif].iface->name);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!list[i].iface && !list[i].pinned && !strcmp(list[i].name, iface->name))
+			return i;
+	}
+	for (i = 0; i < num; i++) {
+		if (!list[i].iface && !list[i].pinned && !list[i].refcnt && !list[i].name[0])
+			return i;
+	}
+	for (i = 0; i < num; i++) {
+		if (!list[i].iface && !list[i].pinned && !list[i].refcnt)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Count a rule or route as user of its inbound and outbound VIFs, with
+ * @delta 1, or no longer, with @delta -1. */
+static void vif_ref(struct vif *list, size_t num, int inbound, const uint8_t *ttl, int delta)
+{
+	size_t i;
+
+	if (inbound >= 0 && (size_t)inbound < num)
+		list[inbound].refcnt += delta;
+	for (i = 0; i < num; i++) {
+		if (ttl[i])
+			list[i].refcnt += delta;
 	}
 }
 
+static void vif_set(struct vif *vif, struct iface *iface)
+{
+	vif->iface = iface;
+	snprintf(vif->name, sizeof(vif->name), "%s", iface->name);
+}
 
 /* Create a virtual interface from @iface so it can be used for IPv4 multicast routing. */
 static int mroute4_add_vif(struct iface *iface)
 {
 	struct vifctl vc;
-	int vif = -1;
-	size_t i;
+	int vif;
 
 	if ((iface->flags & (IFF_LOOPBACK | IFF_MULTICAST)) != IFF_MULTICAST) {
 		smclog(LOG_INFO, "Interface %s is not multicast capable, skipping VIF.", iface->name);
-		iface->vif = -1;
+		iface_set_vif(iface, -1);
 		return 0;
 	}
 
-	/* find a free vif */
-	for (i = 0; i < NELEMS(vif_list); i++) {
-		if (!vif_list[i].iface) {
-			vif = i;
-			break;
-		}
-	}
-
-	/* no more space */
+	vif = vif_alloc(vif_list, NELEMS(vif_list), iface);
 	if (vif == -1) {
+		/* no more space */
 		errno = ENOMEM;
 		smclog(LOG_WARNING, "Kernel MAXVIFS (%d) too small for number of interfaces: %s", MAXVIFS, strerror(errno));
 		return 1;
@@ -217,9 +449,11 @@ static int mroute4_add_vif(struct iface *iface)
 
 	if (setsockopt(mroute4_socket, IPPROTO_IP, MRT_ADD_VIF, (void *)&vc, sizeof(vc)))
 		smclog(LOG_ERR, "Failed adding VIF for iface %s: %s", iface->name, strerror(errno));
+	else
+		watch_vif("add", iface->name, AF_INET, vif);
 
-	iface->vif = vif;
-	vif_list[vif].iface = iface;
+	iface_set_vif(iface, vif);
+	vif_set(&vif_list[vif], iface);
 
 	return 0;
 }
@@ -240,14 +474,31 @@ static int mroute4_del_vif(struct iface *iface)
 #else
 	ret = setsockopt(mroute4_socket, IPPROTO_IP, MRT_DEL_VIF, (void *)&vif, sizeof(vif));
 #endif
-	if (ret)
+	if (ret) {
 		smclog(LOG_ERR, "Failed deleting VIF for iface %s: %s", iface->name, strerror(errno));
-	else
-		iface->vif = -1;
+	} else {
+		watch_vif("del", iface->name, AF_INET, vif);
+		vif_list[vif].iface = NULL;
+		iface_set_vif(iface, -1);
+	}
 
 	return 0;
 }
 
+/* Remove VIFs set up on demand that are no longer used by any route */
+static void mroute4_vif_reclaim(void)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(vif_list); i++) {
+		if (!vif_list[i].lazy || vif_list[i].refcnt || !vif_list[i].iface)
+			continue;
+
+		mroute4_del_vif(vif_list[i].iface);
+		vif_list[i].lazy = 0;
+	}
+}
+
 /* Actually set in kernel - called by mroute4_add() and mroute4_check_add() */
 static int __mroute4_add(struct mroute4 *route)
 {
@@ -276,6 +527,8 @@ static int __mroute4_add(struct mroute4 *route)
 	if (setsockopt(mroute4_socket, IPPROTO_IP, MRT_ADD_MFC, (void *)&mc, sizeof(mc))) {
 		result = errno;
 		smclog(LOG_WARNING, "Failed adding IPv4 multicast route: %s", strerror(errno));
+	} else {
+		watch_mroute4("route add", route);
 	}
 
 	return result;
@@ -299,247 +552,952 @@ static int __mroute4_del(struct mroute4 *route)
 	if (setsockopt(mroute4_socket, IPPROTO_IP, MRT_DEL_MFC, (void *)&mc, sizeof(mc))) {
 		result = errno;
 		smclog(LOG_WARNING, "Failed removing IPv4 multicast route: %s", strerror(errno));
+	} else {
+		watch_mroute4("route del", route);
 	}
 
 	return result;
 }
 
-/*
- * Used for (*,G) matches
- *
- * The incoming candidate is compared to the configured rule, e.g.
- * does 225.1.2.3 fall inside 225.0.0.0/8?  => Yes
- * does 225.1.2.3 fall inside 225.0.0.0/15? => Yes
- * does 225.1.2.3 fall inside 225.0.0.0/16? => No
- */
-static int __mroute4_match(struct mroute4 *rule, struct mroute4 *cand)
+static uint32_t mroute4_dyn_hash(const void *entry)
 {
-	uint32_t g1, g2, mask;
-
-	if (rule->inbound != cand->inbound)
-		return 0;
+	const struct mroute4 *route = entry;
+	uint32_t key[3];
 
-	/* This handles len == 0 => 255.255.255.255 */
-	mask = htonl(0xFFFFFFFFu << (32 - rule->len));
-	g1 = rule->group.s_addr & mask;
-	g2 = cand->group.s_addr & mask;
+	key[0] = route->sender.s_addr;
+	key[1] = route->group.s_addr;
+	key[2] = route->inbound;
 
-	return g1 == g2;
+	return htab_hash(key, sizeof(key));
 }
 
-/**
- * mroute4_dyn_add - Add route to kernel if it matches a known (*,G) route.
- * @route: Pointer to candidate struct mroute4 IPv4 multicast route
- *
- * Returns:
- * POSIX OK(0) on success, non-zero on error with @errno set.
- */
-int mroute4_dyn_add(struct mroute4 *route)
+static int mroute4_dyn_cmp(const void *a, const void *b)
 {
-	struct mroute4 *entry;
+	const struct mroute4 *r1 = a, *r2 = b;
 
-	LIST_FOREACH(entry, &mroute4_conf_list, link) {
-		/* Find matching (*,G) ... and interface. */
-		if (__mroute4_match(entry, route)) {
-			/* Use configured template (*,G) outbound interfaces. */
-			memcpy(route->ttl, entry->ttl, NELEMS(route->ttl) * sizeof(route->ttl[0]));
-
-			/* Add to list of dynamically added routes. Necessary if the user
-			 * removes the (*,G) using the command line interface rather than
-			 * updating the conf file and SIGHUP. Note: if we fail to alloc()
-			 * memory we don't do anything, just add kernel route silently. */
-			entry = malloc(sizeof(struct mroute4));
-			if (entry) {
-				memcpy(entry, route, sizeof(struct mroute4));
-				LIST_INSERT_HEAD(&mroute4_dyn_list, entry, link);
-			}
+	return r1->sender.s_addr != r2->sender.s_addr ||
+		r1->group.s_addr != r2->group.s_addr ||
+		r1->inbound != r2->inbound;
+}
 
-			return __mroute4_add(route);
-		}
-	}
+static uint32_t mroute4_static_hash(const void *entry)
+{
+	const struct mroute4 *route = entry;
+	uint32_t key[2];
 
-	errno = ENOENT;
-	return -1;
+	key[0] = route->sender.s_addr;
+	key[1] = route->group.s_addr;
+
+	return htab_hash(key, sizeof(key));
 }
 
-/**
- * mroute4_dyn_flush - Flush dynamically added (*,G) routes
- *
- * This function flushes all (*,G) routes.  It is currently only called
- * on cache-timeout, a command line option, but could also be called on
- * topology changes (e.g. VRRP fail-over) or similar.
- */
-void mroute4_dyn_flush(void)
+static int mroute4_static_cmp(const void *a, const void *b)
 {
-	if (LIST_EMPTY(&mroute4_dyn_list))
-		return;
+	const struct mroute4 *r1 = a, *r2 = b;
 
-	while (mroute4_dyn_list.lh_first) {
-		__mroute4_del((struct mroute4 *)mroute4_dyn_list.lh_first);
-		LIST_REMOVE(mroute4_dyn_list.lh_first, link);
-		free(mroute4_dyn_list.lh_first);
-	}
+	return r1->sender.s_addr != r2->sender.s_addr ||
+		r1->group.s_addr != r2->group.s_addr;
 }
 
-/**
- * mroute4_add - Add route to kernel, or save a wildcard route for later use
- * @route: Pointer to struct mroute4 IPv4 multicast route to add
- *
- * Adds the given multicast @route to the kernel multicast routing table
- * unless the source IP is %INADDR_ANY, i.e., a (*,G) route.  Those we
- * save for and check against at runtime when the kernel signals us.
- *
- * Returns:
- * POSIX OK(0) on success, non-zero on error with @errno set.
- */
-int mroute4_add(struct mroute4 *route)
+/* Stop idle timer of dynamic route and free it, callback for htab_exit() */
+static void mroute4_dyn_release(void *entry)
 {
-	/* For (*,G) we save to a linked list to be added on-demand
-	 * when the kernel sends IGMPMSG_NOCACHE. */
-	if (route->sender.s_addr == INADDR_ANY) {
-		struct mroute4 *entry = malloc(sizeof(struct mroute4));
+	struct mroute4 *route = entry;
 
-		if (!entry) {
-			smclog(LOG_WARNING, "Failed adding (*,G) multicast route: %s", strerror(errno));
-			return errno;
-		}
+	timer_stop(&route->timer);
+	free(route);
+}
 
-		memcpy(entry, route, sizeof(struct mroute4));
-		LIST_INSERT_HEAD(&mroute4_conf_list, entry, link);
+/* Tell the -e script, in batch mode, that a dynamic route is gone */
+static void mroute4_dyn_notify(struct mroute4 *route)
+{
+	struct mroute mrt;
 
-		return 0;
-	}
+	if (!script_exec)
+		return;
 
-	return __mroute4_add(route);
+	mrt.version = 4;
+	mrt.u.mroute4 = *route;
+	run_script("remove", &mrt);
 }
 
-/**
- * mroute4_del - Remove route from kernel, or all matching routes if wildcard
- * @route: Pointer to struct mroute4 IPv4 multicast route to remove
- *
- * Removes the given multicast @route from the kernel multicast routing
- * table, or if the @route is a wildcard, then all matching kernel
- * routes are removed, as well as the wildcard.
- *
- * Returns:
- * POSIX OK(0) on success, non-zero on error with @errno set.
- */
-int mroute4_del(struct mroute4 *route)
+/* Remove dynamic route from kernel and free it, callback for htab_exit() */
+static void mroute4_dyn_free(void *entry)
 {
-	struct mroute4 *entry, *set;
+	__mroute4_del(entry);
+	mroute4_dyn_notify(entry);
+	mroute4_dyn_release(entry);
+}
 
-	/* For (*,G) we have saved all dynamically added kernel routes
-	 * to a linked list which we need to traverse again and remove
-	 * all matches. From kernel dyn list before we remove the conf
-	 * entry. */
-	if (route->sender.s_addr != INADDR_ANY)
-		return __mroute4_del(route);
+/* Idle timer callback, keep dynamic route only if the kernel has
+ * forwarded any packets for it since the last time we checked.  The
+ * kernel also counts packets arriving on the wrong inbound VIF, those
+ * are not counted here, so a flow that has moved to another VIF ages
+ * out. */
+static void mroute4_dyn_expire(void *arg)
+{
+	struct mroute4 *route = arg;
+	struct sioc_sg_req sg_req;
+	char origin[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN];
 
-	if (LIST_EMPTY(&mroute4_conf_list))
-		return 0;
+	memset(&sg_req, 0, sizeof(sg_req));
+	sg_req.src = route->sender;
+	sg_req.grp = route->group;
+	if (!ioctl(mroute4_socket, SIOCGETSGCNT, &sg_req) && sg_req.pktcnt - sg_req.wrong_if != route->pktcnt) {
+		route->pktcnt = sg_req.pktcnt - sg_req.wrong_if;
+		timer_start(&route->timer, cache_tmo);
+		return;
+	}
 
-	entry = LIST_FIRST(&mroute4_conf_list);
-	while (entry) {
-		/* Find matching (*,G) ... and interface .. and prefix length. */
-		if (__mroute4_match(entry, route) && entry->len == route->len) {
-			if (LIST_EMPTY(&mroute4_dyn_list))
-				goto empty;
-
-			set = LIST_FIRST(&mroute4_dyn_list);
-			while (set) {
-				if (__mroute4_match(entry, set) && entry->len == route->len) {
-					__mroute4_del(set);
-					LIST_REMOVE(set, link);
-					free(set);
-
-					set = LIST_FIRST(&mroute4_dyn_list);
-					continue;
-				}
-
-				set = LIST_NEXT(set, link);
-			}
+	smclog(LOG_INFO, "Idle timeout, removing IPv4 route %s -> %s",
+	       inet_ntop(AF_INET, &route->sender, origin, sizeof(origin)),
+	       inet_ntop(AF_INET, &route->group, group, sizeof(group)));
 
-		empty:
-			LIST_REMOVE(entry, link);
-			free(entry);
+	htab_remove(&mroute4_dyn_tab, route);
+	LIST_REMOVE(route, link);
+	mroute4_dyn_free(route);
+}
 
-			entry = LIST_FIRST(&mroute4_conf_list);
-			continue;
-		}
+/* Prefix length of a (*,G) rule, where len 0 means a single group */
+static int mroute4_prefix_len(struct mroute4 *rule)
+{
+	if (rule->len <= 0 || rule->len > 32)
+		return 32;
 
-		entry = LIST_NEXT(entry, link);
-	}
+	return rule->len;
+}
 
-	return 0;
+/* Source prefix length of a (*,G) rule, 0 for any source, where
+ * src_len 0 means a single source */
+static int mroute4_src_len(struct mroute4 *rule)
+{
+	if (rule->sender.s_addr == INADDR_ANY)
+		return 0;
+	if (rule->src_len <= 0 || rule->src_len > 32)
+		return 32;
+
+	return rule->src_len;
 }
 
-#ifdef HAVE_IPV6_MULTICAST_ROUTING
-#ifdef __linux__
-#define IPV6_ALL_MC_FORWARD "/proc/sys/net/ipv6/conf/all/mc_forwarding"
+/* Matched on demand as a (*,G) rule, or an (S,G) route for the kernel */
+static int mroute4_is_rule(struct mroute4 *route)
+{
+	return route->sender.s_addr == INADDR_ANY || route->len > 0 || route->src_len > 0;
+}
 
-static int proc_set_val(char *file, int val)
+/* Trie of the rules for @group/@len on @vif, keyed on source prefix */
+static struct trie *mroute4_rules(int vif, struct in_addr *group, int len, int create)
 {
-	int fd, result = 0;
+	struct trie *rules;
 
-	fd = open(file, O_WRONLY);
-	if (fd < 0)
-		return 1;
+	rules = trie_find(&mroute4_conf_trie[vif], group, len);
+	if (rules || !create)
+		return rules;
 
-	if (-1 == write(fd, "1", val))
-		result = 1;
+	rules = calloc(1, sizeof(struct trie));
+	if (!rules)
+		return NULL;
 
-	close(fd);
+	if (trie_insert(&mroute4_conf_trie[vif], group, len, rules)) {
+		free(rules);
+		return NULL;
+	}
 
-	return result;
+	return rules;
 }
-#endif /* Linux only */
-#endif /* HAVE_IPV6_MULTICAST_ROUTING */
 
-/**
- * mroute6_enable - Initialise IPv6 multicast routing
- *
- * Setup the kernel IPv6 multicast routing API and lock the multicast
- * routing socket to this program (only!).
+/* Release a trie of rules, callback for trie_flush(), the rules are
+ * freed from the mroute4_conf_list */
+static void mroute4_rules_free(void *rules)
+{
+	trie_flush(rules, NULL);
+	free(rules);
+}
+
+/*
+ * Single group (*,G) rules can be set as (*,G) routes in kernels that
+ * support them, e.g. Linux ipmr, sparing us an upcall and a round-trip
+ * to userspace for every new source.  The kernel only checks the (*,G)
+ * route of a group if the packet arrives on a VIF in its TTL vector, so
+ * the inbound VIF is added to that as well.  The kernel never forwards
+ * back to the inbound VIF of a (*,G) route.
  *
- * Returns:
- * POSIX OK(0) on success, non-zero on error with @errno set.
+ * The kernel has room for only one (*,G) route per group, so if rules
+ * for the same group exist on several inbound VIFs we fall back to
+ * setting (S,G) routes on demand for all of them.
  */
-int mroute6_enable(void)
+static int mroute4_wildcard_add(struct mroute4 *rule)
 {
-#ifndef HAVE_IPV6_MULTICAST_ROUTING
-	return -1;
-#else
-	int arg = 1;
-	unsigned int i;
-	struct iface *iface;
+	struct mroute4 route;
 
-	if ((mroute6_socket = create_socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
-		if (ENOPROTOOPT == errno)
-			smclog(LOG_WARNING, "Kernel does not support IPv6 multicast routing, skipping ...");
+	memcpy(&route, rule, sizeof(route));
+	if (!route.ttl[route.inbound])
+		route.ttl[route.inbound] = DEFAULT_THRESHOLD;
 
-		return -1;
-	}
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_INIT, (void *)&arg, sizeof(arg))) {
-		switch (errno) {
-		case EADDRINUSE:
-			smclog(LOG_INIT, "IPv6 multicast routing API already in use: %s", strerror(errno));
-			break;
+	return __mroute4_add(&route);
+}
 
-		default:
-			smclog(LOG_INIT, "Failed initializing IPv6 multicast routing API: %s", strerror(errno));
-			break;
-		}
+static void mroute4_wildcard(struct in_addr group)
+{
+	struct in_addr any = { .s_addr = INADDR_ANY };
+	struct mroute4 *rule, *found = NULL;
+	struct trie *rules;
+	size_t vif, num = 0;
 
-		close(mroute6_socket);
-		mroute6_socket = -1;
+	if (!do_wildcard)
+		return;
 
-		return -1;
+	/* Only a lone rule for any source, without exceptions, forwards
+	 * every source of the group the same way. */
+	for (vif = 0; vif < NELEMS(mroute4_conf_trie); vif++) {
+		rules = mroute4_rules(vif, &group, 32, 0);
+		if (!rules)
+			continue;
+
+		num++;
+		rule = trie_find(rules, &any, 0);
+		if (rule && rules->count == 1 && !rule->except.count)
+			found = rule;
 	}
+	if (num > 1)
+		found = NULL;
 
-	/* Initialize virtual interface table */
-	memset(&mif_list, 0, sizeof(mif_list));
+	for (vif = 0; vif < NELEMS(mroute4_conf_trie); vif++) {
+		rules = mroute4_rules(vif, &group, 32, 0);
+		if (!rules)
+			continue;
 
-#ifdef __linux__
+		rule = trie_find(rules, &any, 0);
+		if (rule && rule->wildcard && rule != found) {
+			__mroute4_del(rule);
+			rule->wildcard = 0;
+		}
+	}
+
+	if (found && !found->wildcard && !mroute4_wildcard_add(found))
+		found->wildcard = 1;
+}
+
+/* Find the most specific (*,G) rule matching @cand on its inbound VIF,
+ * the group prefix first, then the source prefix.  A rule excluding
+ * the source is skipped, the next less specific rule is tried instead. */
+static struct mroute4 *mroute4_match(struct mroute4 *cand)
+{
+	void *groups[33], *rules[33];
+	int i, j;
+
+	if (cand->inbound < 0 || cand->inbound >= MAXVIFS)
+		return NULL;
+
+	i = trie_match(&mroute4_conf_trie[cand->inbound], &cand->group, 32, groups, NELEMS(groups));
+	while (i-- > 0) {
+		j = trie_match(groups[i], &cand->sender, 32, rules, NELEMS(rules));
+		while (j-- > 0) {
+			struct mroute4 *rule = rules[j];
+
+			if (rule->except.count && trie_lookup(&rule->except, &cand->sender, 32))
+				continue;
+
+			return rule;
+		}
+	}
+
+	return NULL;
+}
+
+/* Find a (*,G) rule matching the (S,G) of @route on any inbound VIF.
+ * The kernel keys its routes on (S,G) only, a blackhole route set for
+ * one VIF would also drop the (S,G) on all other VIFs. */
+static struct mroute4 *mroute4_match_any(struct mroute4 *route)
+{
+	struct mroute4 cand, *rule;
+	int vif;
+
+	memcpy(&cand, route, sizeof(cand));
+	for (vif = 0; vif < MAXVIFS; vif++) {
+		if (!mroute4_conf_trie[vif].count)
+			continue;
+
+		cand.inbound = vif;
+		rule = mroute4_match(&cand);
+		if (rule)
+			return rule;
+	}
+
+	return NULL;
+}
+
+/* Remove blackhole route from kernel and free it, callback for htab_exit() */
+static void mroute4_drop_free(void *entry)
+{
+	__mroute4_del(entry);
+	mroute4_dyn_release(entry);
+}
+
+/* Idle timer callback, remove blackhole route when no more packets
+ * for it have arrived since the last time we checked.  Packets for the
+ * same (S,G) on other VIFs are counted by the kernel as wrong VIF, and
+ * do not keep the blackhole route. */
+static void mroute4_drop_expire(void *arg)
+{
+	struct mroute4 *route = arg;
+	struct sioc_sg_req sg_req;
+	char origin[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN];
+
+	memset(&sg_req, 0, sizeof(sg_req));
+	sg_req.src = route->sender;
+	sg_req.grp = route->group;
+	if (!ioctl(mroute4_socket, SIOCGETSGCNT, &sg_req) && sg_req.pktcnt - sg_req.wrong_if != route->pktcnt) {
+		route->pktcnt = sg_req.pktcnt - sg_req.wrong_if;
+		timer_start(&route->timer, blackhole_tmo);
+		return;
+	}
+
+	smclog(LOG_INFO, "Idle timeout, removing IPv4 blackhole route %s -> %s",
+	       inet_ntop(AF_INET, &route->sender, origin, sizeof(origin)),
+	       inet_ntop(AF_INET, &route->group, group, sizeof(group)));
+
+	htab_remove(&mroute4_drop_tab, route);
+	LIST_REMOVE(route, link);
+	upcall_forget4(route);
+	mroute4_drop_free(route);
+}
+
+/*
+ * Set a blackhole route, without outbound VIFs, for an upcall that does
+ * not match any (*,G) rule.  The kernel then drops the flow in its fast
+ * path, instead of queueing packets and sending us a new upcall every
+ * time its unresolved entry times out.  Not if the (S,G) is routed from
+ * another VIF, see mroute4_match_any().
+ */
+static void mroute4_drop_add(struct mroute4 *route)
+{
+	struct mroute4 *entry;
+
+	if (!blackhole_tmo || mroute4_drop_tab.count >= MROUTE_DROP_MAX)
+		return;
+	if (htab_find(&mroute4_static_tab, route) || htab_find(&mroute4_drop_tab, route))
+		return;
+	if (mroute4_match_any(route))
+		return;
+
+	entry = malloc(sizeof(struct mroute4));
+	if (!entry)
+		return;
+
+	memcpy(entry, route, sizeof(struct mroute4));
+	memset(entry->ttl, 0, sizeof(entry->ttl));
+	entry->rule   = NULL;
+	entry->pktcnt = 0;
+	if (htab_insert(&mroute4_drop_tab, entry)) {
+		free(entry);
+		return;
+	}
+
+	if (__mroute4_add(entry)) {
+		htab_remove(&mroute4_drop_tab, entry);
+		free(entry);
+		return;
+	}
+
+	LIST_INSERT_HEAD(&mroute4_drop_list, entry, link);
+	timer_init(&entry->timer, mroute4_drop_expire, entry);
+	timer_start(&entry->timer, blackhole_tmo);
+}
+
+/* Forget blackhole route for (S,G), replaced in the kernel by a route */
+static void mroute4_drop_forget(struct mroute4 *route)
+{
+	struct mroute4 *entry;
+
+	entry = htab_remove(&mroute4_drop_tab, route);
+	if (!entry)
+		return;
+
+	LIST_REMOVE(entry, link);
+	mroute4_dyn_release(entry);
+}
+
+/* A (*,G) rule has been added, or changed, remove the blackhole routes
+ * matching a rule now, on any inbound VIF, so the next packet is sent
+ * up to us and routed. */
+static void mroute4_drop_rematch(void)
+{
+	struct mroute4 *entry, *tmp;
+
+	LIST_FOREACH_SAFE(entry, &mroute4_drop_list, link, tmp) {
+		if (!mroute4_match_any(entry))
+			continue;
+
+		htab_remove(&mroute4_drop_tab, entry);
+		LIST_REMOVE(entry, link);
+		mroute4_drop_free(entry);
+	}
+}
+
+/**
+ * mroute4_dyn_add - Add route to kernel if it matches a known (*,G) route.
+ * @route: Pointer to candidate struct mroute4 IPv4 multicast route
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute4_dyn_add(struct mroute4 *route)
+{
+	struct mroute4 *entry, *dyn;
+
+	/* Find most specific (*,G) ... on this interface. */
+	entry = mroute4_match(route);
+	if (!entry) {
+		mroute4_drop_add(route);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Use configured template (*,G) outbound interfaces. */
+	memcpy(route->ttl, entry->ttl, NELEMS(route->ttl) * sizeof(route->ttl[0]));
+
+	/* Add to list of dynamically added routes. Necessary if the user
+	 * removes the (*,G) using the command line interface rather than
+	 * updating the conf file and SIGHUP. Note: if we fail to alloc()
+	 * memory we don't do anything, just add kernel route silently.
+	 * A duplicate upcall means the kernel has lost the route, so we
+	 * only refresh the entry we already have before setting it. */
+	dyn = htab_find(&mroute4_dyn_tab, route);
+	if (dyn) {
+		LIST_REMOVE(dyn, link);
+	} else {
+		dyn = malloc(sizeof(struct mroute4));
+		if (!dyn)
+			return __mroute4_add(route);
+
+		memcpy(dyn, route, sizeof(struct mroute4));
+		if (htab_insert(&mroute4_dyn_tab, dyn)) {
+			free(dyn);
+			return __mroute4_add(route);
+		}
+		timer_init(&dyn->timer, mroute4_dyn_expire, dyn);
+	}
+
+	memcpy(dyn->ttl, route->ttl, sizeof(dyn->ttl));
+	dyn->rule = entry;
+	LIST_INSERT_HEAD(&entry->dyn_list, dyn, link);
+
+	/* Kernel starts counting from zero for a new route */
+	dyn->pktcnt = 0;
+	if (cache_tmo)
+		timer_start(&dyn->timer, cache_tmo);
+
+	return __mroute4_add(route);
+}
+
+/**
+ * mroute4_dyn_flush - Flush dynamically added (*,G) routes
+ *
+ * This function flushes all (*,G) routes, and blackhole routes.  It is
+ * currently only called by the flush IPC command, but could also be
+ * called on topology changes (e.g. VRRP fail-over) or similar.  Idle
+ * routes are instead removed one by one, see mroute4_dyn_expire().
+ */
+void mroute4_dyn_flush(void)
+{
+	struct mroute4 *entry;
+
+	if (!mroute4_dyn_tab.count && !mroute4_drop_tab.count)
+		return;
+
+	LIST_FOREACH(entry, &mroute4_conf_list, link)
+		LIST_INIT(&entry->dyn_list);
+
+	htab_exit(&mroute4_dyn_tab, mroute4_dyn_free);
+	LIST_INIT(&mroute4_drop_list);
+	htab_exit(&mroute4_drop_tab, mroute4_drop_free);
+	upcall_flush4();
+}
+
+/* Flush the dynamic and blackhole routes using @vif, inbound or
+ * outbound, before the VIF is moved.  Other routes are kept. */
+static void mroute4_dyn_flush_vif(int vif)
+{
+	LIST_HEAD(, mroute4) list = LIST_HEAD_INITIALIZER();
+	struct mroute4 *entry, *tmp;
+	size_t pos = 0;
+
+	while ((entry = htab_next(&mroute4_dyn_tab, &pos))) {
+		if (entry->inbound != vif && !entry->ttl[vif])
+			continue;
+
+		LIST_REMOVE(entry, link);
+		LIST_INSERT_HEAD(&list, entry, link);
+	}
+	LIST_FOREACH_SAFE(entry, &list, link, tmp) {
+		htab_remove(&mroute4_dyn_tab, entry);
+		upcall_forget4(entry);
+		mroute4_dyn_free(entry);
+	}
+
+	LIST_FOREACH_SAFE(entry, &mroute4_drop_list, link, tmp) {
+		if (entry->inbound != vif)
+			continue;
+
+		htab_remove(&mroute4_drop_tab, entry);
+		LIST_REMOVE(entry, link);
+		upcall_forget4(entry);
+		mroute4_drop_free(entry);
+	}
+}
+
+/* Outbound VIFs of a (*,G) rule have changed, update its dynamic routes */
+static void mroute4_rule_update(struct mroute4 *rule)
+{
+	struct mroute4 *dyn;
+
+	LIST_FOREACH(dyn, &rule->dyn_list, link) {
+		memcpy(dyn->ttl, rule->ttl, sizeof(dyn->ttl));
+		__mroute4_add(dyn);
+	}
+}
+
+/*
+ * Dynamic routes stay with the rule they were set from, but after a
+ * reload a more specific rule may have been added.  Move them to the
+ * rule they would get now, if the outbound VIFs differ the kernel route
+ * is updated in place, without disturbing the flow.
+ */
+static void mroute4_dyn_rematch(void)
+{
+	struct mroute4 *dyn, *rule;
+	size_t pos = 0;
+
+	while ((dyn = htab_next(&mroute4_dyn_tab, &pos))) {
+		rule = mroute4_match(dyn);
+		if (!rule || rule == dyn->rule)
+			continue;
+
+		LIST_REMOVE(dyn, link);
+		dyn->rule = rule;
+		LIST_INSERT_HEAD(&rule->dyn_list, dyn, link);
+
+		if (memcmp(dyn->ttl, rule->ttl, sizeof(dyn->ttl))) {
+			memcpy(dyn->ttl, rule->ttl, sizeof(dyn->ttl));
+			__mroute4_add(dyn);
+		}
+	}
+}
+
+/* Set (S,G) route in kernel, unless already set exactly like this */
+static int mroute4_static_add(struct mroute4 *route)
+{
+	struct mroute4 *entry;
+	int rc;
+
+	/* Replaces any blackhole route in the kernel */
+	mroute4_drop_forget(route);
+
+	entry = htab_find(&mroute4_static_tab, route);
+	if (entry) {
+		entry->stale = 0;
+		if (entry->inbound == route->inbound && !memcmp(entry->ttl, route->ttl, sizeof(entry->ttl)))
+			return 0;
+
+		vif_ref(vif_list, NELEMS(vif_list), route->inbound, route->ttl, 1);
+		vif_ref(vif_list, NELEMS(vif_list), entry->inbound, entry->ttl, -1);
+		entry->inbound = route->inbound;
+		memcpy(entry->ttl, route->ttl, sizeof(entry->ttl));
+	} else {
+		/* If we fail to track it, just set the kernel route */
+		entry = malloc(sizeof(struct mroute4));
+		if (entry) {
+			memcpy(entry, route, sizeof(struct mroute4));
+			entry->stale = 0;
+			if (htab_insert(&mroute4_static_tab, entry))
+				free(entry);
+			else
+				vif_ref(vif_list, NELEMS(vif_list), entry->inbound, entry->ttl, 1);
+		}
+	}
+
+	rc = __mroute4_add(route);
+	mroute4_vif_reclaim();
+
+	return rc;
+}
+
+/*
+ * Sources excluded from a rule have changed.  Routes for sources now
+ * excluded are removed, the next upcall finds them a less specific
+ * rule, and routes for sources no longer excluded are moved here.
+ */
+static void mroute4_except_update(struct mroute4 *rule)
+{
+	struct mroute4 *dyn, *tmp;
+
+	LIST_FOREACH_SAFE(dyn, &rule->dyn_list, link, tmp) {
+		if (!trie_lookup(&rule->except, &dyn->sender, 32))
+			continue;
+
+		htab_remove(&mroute4_dyn_tab, dyn);
+		LIST_REMOVE(dyn, link);
+		mroute4_dyn_free(dyn);
+	}
+	mroute4_dyn_rematch();
+
+	mroute4_drop_rematch();
+	upcall_invalidate();
+	if (mroute4_prefix_len(rule) == 32)
+		mroute4_wildcard(rule->group);
+}
+
+/**
+ * mroute4_except - Exclude a source prefix from a (*,G) rule
+ * @route: Rule to be passed to mroute4_add()
+ * @source: Source prefix, in network byte order
+ * @len: Source prefix length
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute4_except(struct mroute4 *route, struct in_addr source, int len)
+{
+	if (len < 0 || len > 32) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Only the prefix matters, any non-NULL data will do */
+	if (trie_insert(&route->except, &source, len, route) && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * mroute4_add - Add route to kernel, or save a wildcard route for later use
+ * @route: Pointer to struct mroute4 IPv4 multicast route to add
+ *
+ * Adds the given multicast @route to the kernel multicast routing table
+ * unless it is a rule, i.e., the source IP is %INADDR_ANY, or the source
+ * or group is a prefix.  Those we save for and check against at runtime
+ * when the kernel signals us.  Any sources excluded from a rule, see
+ * mroute4_except(), are taken over by the rule, or released.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute4_add(struct mroute4 *route)
+{
+	/* For (*,G) we save to a linked list to be added on-demand
+	 * when the kernel sends IGMPMSG_NOCACHE. */
+	if (mroute4_is_rule(route)) {
+		struct mroute4 *entry;
+		struct trie *rules;
+		int len, slen, err;
+
+		if (route->inbound < 0 || route->inbound >= MAXVIFS) {
+			errno = EINVAL;
+			goto fail;
+		}
+
+		/* Same group and source prefix on same VIF replaces
+		 * outbound VIFs, and excluded sources. */
+		len   = mroute4_prefix_len(route);
+		slen  = mroute4_src_len(route);
+		rules = mroute4_rules(route->inbound, &route->group, len, 1);
+		if (!rules)
+			goto fail;
+
+		entry = trie_find(rules, &route->sender, slen);
+		if (entry) {
+			entry->stale = 0;
+			if (!trie_equal(&entry->except, &route->except)) {
+				trie_flush(&entry->except, NULL);
+				entry->except = route->except;
+				memset(&route->except, 0, sizeof(route->except));
+				mroute4_except_update(entry);
+			}
+			trie_flush(&route->except, NULL);
+
+			if (!memcmp(entry->ttl, route->ttl, sizeof(entry->ttl)))
+				return 0;
+
+			vif_ref(vif_list, NELEMS(vif_list), -1, route->ttl, 1);
+			vif_ref(vif_list, NELEMS(vif_list), -1, entry->ttl, -1);
+			memcpy(entry->ttl, route->ttl, sizeof(entry->ttl));
+			if (entry->wildcard)
+				mroute4_wildcard_add(entry);
+			mroute4_rule_update(entry);
+			mroute4_vif_reclaim();
+			return 0;
+		}
+
+		entry = malloc(sizeof(struct mroute4));
+		if (!entry)
+			goto prune;
+
+		memcpy(entry, route, sizeof(struct mroute4));
+		entry->wildcard = 0;
+		entry->stale = 0;
+		LIST_INIT(&entry->dyn_list);
+		if (trie_insert(rules, &entry->sender, slen, entry)) {
+			free(entry);
+			goto prune;
+		}
+		memset(&route->except, 0, sizeof(route->except));
+
+		LIST_INSERT_HEAD(&mroute4_conf_list, entry, link);
+		mroute4_drop_rematch();
+		upcall_invalidate();
+		vif_ref(vif_list, NELEMS(vif_list), entry->inbound, entry->ttl, 1);
+
+		if (len == 32)
+			mroute4_wildcard(entry->group);
+
+		return 0;
+	prune:
+		if (!rules->count) {
+			trie_remove(&mroute4_conf_trie[route->inbound], &route->group, len);
+			free(rules);
+		}
+	fail:
+		err = errno;
+		trie_flush(&route->except, NULL);
+		mroute4_vif_reclaim();
+		smclog(LOG_WARNING, "Failed adding (*,G) multicast route: %s", strerror(err));
+		return err;
+	}
+
+	return mroute4_static_add(route);
+}
+
+/**
+ * mroute4_del - Remove route from kernel, or all matching routes if wildcard
+ * @route: Pointer to struct mroute4 IPv4 multicast route to remove
+ *
+ * Removes the given multicast @route from the kernel multicast routing
+ * table, or if the @route is a wildcard, then all matching kernel
+ * routes are removed, as well as the wildcard.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute4_del(struct mroute4 *route)
+{
+	struct mroute4 *entry, *set, *tmp;
+	struct trie *rules;
+	int rc;
+
+	/* A dynamically set (S,G) may also be removed, forget about it. */
+	if (!mroute4_is_rule(route)) {
+		set = htab_remove(&mroute4_dyn_tab, route);
+		if (set) {
+			LIST_REMOVE(set, link);
+			mroute4_dyn_notify(set);
+			mroute4_dyn_release(set);
+		}
+		mroute4_drop_forget(route);
+		entry = htab_remove(&mroute4_static_tab, route);
+		if (entry) {
+			vif_ref(vif_list, NELEMS(vif_list), entry->inbound, entry->ttl, -1);
+			free(entry);
+		}
+
+		rc = __mroute4_del(route);
+		mroute4_vif_reclaim();
+
+		return rc;
+	}
+
+	if (route->inbound < 0 || route->inbound >= MAXVIFS)
+		return 0;
+
+	/* Find exact (*,G) ... and interface .. and prefix lengths. */
+	rules = mroute4_rules(route->inbound, &route->group, mroute4_prefix_len(route), 0);
+	if (!rules)
+		return 0;
+	entry = trie_find(rules, &route->sender, mroute4_src_len(route));
+	if (!entry)
+		return 0;
+
+	/* For (*,G) we have saved all dynamically added kernel routes
+	 * in the dyn_list of the rule, remove them before the rule. */
+	LIST_FOREACH_SAFE(set, &entry->dyn_list, link, tmp) {
+		htab_remove(&mroute4_dyn_tab, set);
+		mroute4_dyn_free(set);
+	}
+
+	trie_remove(rules, &entry->sender, mroute4_src_len(entry));
+	if (!rules->count) {
+		trie_remove(&mroute4_conf_trie[entry->inbound], &entry->group, mroute4_prefix_len(entry));
+		free(rules);
+	}
+	LIST_REMOVE(entry, link);
+	if (entry->wildcard)
+		__mroute4_del(entry);
+	if (mroute4_prefix_len(entry) == 32)
+		mroute4_wildcard(entry->group);
+	vif_ref(vif_list, NELEMS(vif_list), entry->inbound, entry->ttl, -1);
+	trie_flush(&entry->except, NULL);
+	free(entry);
+	mroute4_vif_reclaim();
+
+	return 0;
+}
+
+/* Mark all (*,G) rules and (S,G) routes, see mroute_mark() */
+static void mroute4_mark(void)
+{
+	struct mroute4 *entry;
+	size_t pos = 0;
+
+	LIST_FOREACH(entry, &mroute4_conf_list, link)
+		entry->stale = 1;
+	while ((entry = htab_next(&mroute4_static_tab, &pos)))
+		entry->stale = 1;
+}
+
+/* Remove all rules and routes still marked, see mroute_sweep() */
+static void mroute4_sweep(void)
+{
+	LIST_HEAD(, mroute4) list = LIST_HEAD_INITIALIZER();
+	struct mroute4 *entry, *tmp, route;
+	size_t pos = 0;
+
+	LIST_FOREACH_SAFE(entry, &mroute4_conf_list, link, tmp) {
+		if (!entry->stale)
+			continue;
+
+		route = *entry;
+		mroute4_del(&route);
+	}
+
+	/* The table must not change while iterating, collect first */
+	while ((entry = htab_next(&mroute4_static_tab, &pos))) {
+		if (entry->stale)
+			LIST_INSERT_HEAD(&list, entry, link);
+	}
+	LIST_FOREACH_SAFE(entry, &list, link, tmp) {
+		route = *entry;
+		mroute4_del(&route);
+	}
+
+	mroute4_dyn_rematch();
+}
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+#ifdef __linux__
+#define IPV6_ALL_MC_FORWARD "/proc/sys/net/ipv6/conf/all/mc_forwarding"
+
+static int proc_set_val(char *file, int val)
+{
+	int fd, result = 0;
+
+	fd = open(file, O_WRONLY);
+	if (fd < 0)
+		return 1;
+
+	if (-1 == write(fd, "1", val))
+		result = 1;
+
+	close(fd);
+
+	return result;
+}
+#endif /* Linux only */
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+/* Socket filter, and ICMPv6 filter for systems without socket filters */
+static int mroute6_filter(void)
+{
+#ifdef ICMP6_FILTER
+	struct icmp6_filter filter;
+	size_t i;
+
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	for (i = 0; i < mroute6_num_types; i++)
+		ICMP6_FILTER_SETPASS(mroute6_types[i], &filter);
+
+	if (setsockopt(mroute6_socket, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)))
+		return -1;
+#endif
+
+	return mroute_filter(mroute6_socket, 0, mroute6_types, mroute6_num_types);
+}
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+
+/**
+ * mroute6_filter_add - Receive MLD messages of a type on the mroute socket
+ * @type: ICMPv6 message type, e.g. %MLD_LISTENER_REPORT
+ *
+ * IPv6 counterpart of mroute4_filter_add().
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute6_filter_add(uint8_t type)
+{
+#ifndef HAVE_IPV6_MULTICAST_ROUTING
+	(void)type;
+	errno = EPROTONOSUPPORT;
+	return -1;
+#else
+	if (mroute_filter_type(mroute6_types, &mroute6_num_types, type))
+		return -1;
+
+	if (mroute6_socket < 0)
+		return 0;
+
+	return mroute6_filter();
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+}
+
+/**
+ * mroute6_enable - Initialise IPv6 multicast routing
+ *
+ * Setup the kernel IPv6 multicast routing API and lock the multicast
+ * routing socket to this program (only!).
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute6_enable(void)
+{
+#ifndef HAVE_IPV6_MULTICAST_ROUTING
+	return -1;
+#else
+	int arg = 1;
+	struct iface *iface;
+
+	if ((mroute6_socket = create_socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
+		if (ENOPROTOOPT == errno)
+			smclog(LOG_WARNING, "Kernel does not support IPv6 multicast routing, skipping ...");
+
+		return -1;
+	}
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_INIT, (void *)&arg, sizeof(arg))) {
+		switch (errno) {
+		case EADDRINUSE:
+			smclog(LOG_INIT, "IPv6 multicast routing API already in use: %s", strerror(errno));
+			break;
+
+		default:
+			smclog(LOG_INIT, "Failed initializing IPv6 multicast routing API: %s", strerror(errno));
+			break;
+		}
+
+		close(mroute6_socket);
+		mroute6_socket = -1;
+
+		return -1;
+	}
+
+	if (mroute6_filter())
+		smclog(LOG_DEBUG, "Failed setting IPv6 multicast routing socket filter, continuing anyway");
+
+	/* Initialize virtual interface table */
+	memset(&mif_list, 0, sizeof(mif_list));
+
+#ifdef __linux__
 	/* On Linux pre 2.6.29 kernels net.ipv6.conf.all.mc_forwarding
 	 * is not set on MRT6_INIT so we have to do this manually */
 	if (proc_set_val(IPV6_ALL_MC_FORWARD, 1)) {
@@ -548,104 +1506,763 @@ int mroute6_enable(void)
 			exit(255);
 		}
 	}
-#endif
-	/* Create virtual interfaces, IPv6 MIFs, for all non-loopback interfaces */
-	for (i = 0; do_vifs && (iface = iface_find_by_index(i)); i++) {
-		/* No point in continuing the loop when out of MIF's */
-		if (mroute6_add_mif(iface))
-			break;
+#endif
+	/* Create virtual interfaces, IPv6 MIFs, for all non-loopback interfaces */
+	for (iface = iface_iterator(1); do_vifs && iface; iface = iface_iterator(0)) {
+		/* No point in continuing the loop when out of MIF's */
+		if (mroute6_add_mif(iface))
+			break;
+	}
+
+	return 0;
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+}
+
+/**
+ * mroute6_disable - Disable IPv6 multicast routing
+ *
+ * Disable IPv6 multicast routing and release kernel routing socket.
+ */
+void mroute6_disable(void)
+{
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	struct mroute6 *entry;
+	size_t i;
+
+	if (mroute6_socket < 0)
+		return;
+
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DONE, NULL, 0))
+		smclog(LOG_WARNING, "Failed shutting down IPv6 multicast routing socket: %s", strerror(errno));
+
+	close(mroute6_socket);
+	mroute6_socket = -1;
+
+	/* Free list of (*,G) routes on SIGHUP */
+	for (i = 0; i < NELEMS(mroute6_conf_trie); i++)
+		trie_flush(&mroute6_conf_trie[i], mroute6_rules_free);
+	while (!LIST_EMPTY(&mroute6_conf_list)) {
+		entry = LIST_FIRST(&mroute6_conf_list);
+		LIST_REMOVE(entry, link);
+		trie_flush(&entry->except, NULL);
+		free(entry);
+	}
+	htab_exit(&mroute6_dyn_tab, mroute6_dyn_release);
+	htab_exit(&mroute6_static_tab, free);
+	LIST_INIT(&mroute6_drop_list);
+	htab_exit(&mroute6_drop_tab, mroute6_dyn_release);
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+}
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+/* Create a virtual interface from @iface so it can be used for IPv6 multicast routing. */
+static int mroute6_add_mif(struct iface *iface)
+{
+	struct mif6ctl mc;
+	int mif;
+
+	if ((iface->flags & (IFF_LOOPBACK | IFF_MULTICAST)) != IFF_MULTICAST) {
+		smclog(LOG_INFO, "Interface %s is not multicast capable, skipping MIF.", iface->name);
+		iface_set_mif(iface, -1);
+		return 0;
+	}
+
+	mif = vif_alloc(mif_list, NELEMS(mif_list), iface);
+	if (mif == -1) {
+		/* no more space */
+		errno = ENOMEM;
+		smclog(LOG_WARNING, "Kernel MAXMIFS (%d) too small for number of interfaces: %s", MAXMIFS, strerror(errno));
+		return 1;
+	}
+
+	memset(&mc, 0, sizeof(mc));
+	mc.mif6c_mifi = mif;
+	mc.mif6c_flags = 0;	/* no register */
+#ifdef HAVE_MIF6CTL_VIFC_THRESHOLD
+	mc.vifc_threshold = iface->threshold;
+#endif
+	mc.mif6c_pifi = iface->ifindex;	/* physical interface index */
+#ifdef HAVE_MIF6CTL_VIFC_RATE_LIMIT
+	mc.vifc_rate_limit = 0;	/* hopefully no limit */
+#endif
+
+	smclog(LOG_DEBUG, "Map iface %-16s => MIF %-2d ifindex %2d flags 0x%04x TTL threshold %u",
+	       iface->name, mc.mif6c_mifi, mc.mif6c_pifi, mc.mif6c_flags, iface->threshold);
+
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_ADD_MIF, (void *)&mc, sizeof(mc))) {
+		smclog(LOG_ERR, "Failed adding MIF for iface %s: %s", iface->name, strerror(errno));
+		iface_set_mif(iface, -1);
+	} else {
+		iface_set_mif(iface, mif);
+		vif_set(&mif_list[mif], iface);
+		watch_vif("add", iface->name, AF_INET6, mif);
+	}
+
+	return 0;
+}
+
+static int mroute6_del_mif(struct iface *iface)
+{
+	int16_t mif = iface->mif;
+
+	if (-1 == mif)
+		return 0;	/* No MIF setup for iface, skip */
+
+	smclog(LOG_DEBUG, "Removing  %-16s => MIF %-2d", iface->name, mif);
+
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DEL_MIF, (void *)&mif, sizeof(mif))) {
+		smclog(LOG_ERR, "Failed deleting MIF for iface %s: %s", iface->name, strerror(errno));
+	} else {
+		watch_vif("del", iface->name, AF_INET6, mif);
+		mif_list[mif].iface = NULL;
+		iface_set_mif(iface, -1);
+	}
+
+	return 0;
+}
+
+/* Remove MIFs set up on demand that are no longer used by any route */
+static void mroute6_vif_reclaim(void)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(mif_list); i++) {
+		if (!mif_list[i].lazy || mif_list[i].refcnt || !mif_list[i].iface)
+			continue;
+
+		mroute6_del_mif(mif_list[i].iface);
+		mif_list[i].lazy = 0;
+	}
+}
+
+/* Actually set in kernel - called by mroute6_add() and mroute6_dyn_add() */
+static int __mroute6_add(struct mroute6 *route)
+{
+	int result = 0;
+	size_t i;
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+	struct mf6cctl mc;
+
+	memset(&mc, 0, sizeof(mc));
+	mc.mf6cc_origin   = route->sender;
+	mc.mf6cc_mcastgrp = route->group;
+	mc.mf6cc_parent   = route->inbound;
+
+	/* copy the outgoing MIFs */
+	for (i = 0; i < NELEMS(route->ttl); i++) {
+		if (route->ttl[i] > 0)
+			IF_SET(i, &mc.mf6cc_ifset);
+	}
+
+	smclog(LOG_DEBUG, "Add %s -> %s from MIF %d",
+	       inet_ntop(AF_INET6, &mc.mf6cc_origin.sin6_addr, origin, INET6_ADDRSTRLEN),
+	       inet_ntop(AF_INET6, &mc.mf6cc_mcastgrp.sin6_addr, group, INET6_ADDRSTRLEN),
+	       mc.mf6cc_parent);
+
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_ADD_MFC, (void *)&mc, sizeof(mc))) {
+		result = errno;
+		smclog(LOG_WARNING, "Failed adding IPv6 multicast route: %s", strerror(errno));
+	} else {
+		watch_mroute6("route add", route);
+	}
+
+	return result;
+}
+
+/* Actually remove from kernel - called by mroute6_del() */
+static int __mroute6_del(struct mroute6 *route)
+{
+	int result = 0;
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+	struct mf6cctl mc;
+
+	memset(&mc, 0, sizeof(mc));
+	mc.mf6cc_origin = route->sender;
+	mc.mf6cc_mcastgrp = route->group;
+
+	smclog(LOG_DEBUG, "Del %s -> %s",
+	       inet_ntop(AF_INET6, &mc.mf6cc_origin.sin6_addr, origin, INET6_ADDRSTRLEN),
+	       inet_ntop(AF_INET6, &mc.mf6cc_mcastgrp.sin6_addr, group, INET6_ADDRSTRLEN));
+
+	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DEL_MFC, (void *)&mc, sizeof(mc))) {
+		result = errno;
+		smclog(LOG_WARNING, "Failed removing IPv6 multicast route: %s", strerror(errno));
+	} else {
+		watch_mroute6("route del", route);
+	}
+
+	return result;
+}
+
+static uint32_t mroute6_dyn_hash(const void *entry)
+{
+	const struct mroute6 *route = entry;
+	uint8_t key[2 * sizeof(struct in6_addr) + sizeof(short)];
+
+	memcpy(key, &route->sender.sin6_addr, sizeof(struct in6_addr));
+	memcpy(&key[sizeof(struct in6_addr)], &route->group.sin6_addr, sizeof(struct in6_addr));
+	memcpy(&key[2 * sizeof(struct in6_addr)], &route->inbound, sizeof(short));
+
+	return htab_hash(key, sizeof(key));
+}
+
+static int mroute6_dyn_cmp(const void *a, const void *b)
+{
+	const struct mroute6 *r1 = a, *r2 = b;
+
+	return !IN6_ARE_ADDR_EQUAL(&r1->sender.sin6_addr, &r2->sender.sin6_addr) ||
+		!IN6_ARE_ADDR_EQUAL(&r1->group.sin6_addr, &r2->group.sin6_addr) ||
+		r1->inbound != r2->inbound;
+}
+
+static uint32_t mroute6_static_hash(const void *entry)
+{
+	const struct mroute6 *route = entry;
+	uint8_t key[2 * sizeof(struct in6_addr)];
+
+	memcpy(key, &route->sender.sin6_addr, sizeof(struct in6_addr));
+	memcpy(&key[sizeof(struct in6_addr)], &route->group.sin6_addr, sizeof(struct in6_addr));
+
+	return htab_hash(key, sizeof(key));
+}
+
+static int mroute6_static_cmp(const void *a, const void *b)
+{
+	const struct mroute6 *r1 = a, *r2 = b;
+
+	return !IN6_ARE_ADDR_EQUAL(&r1->sender.sin6_addr, &r2->sender.sin6_addr) ||
+		!IN6_ARE_ADDR_EQUAL(&r1->group.sin6_addr, &r2->group.sin6_addr);
+}
+
+/* Stop idle timer of dynamic route and free it, callback for htab_exit() */
+static void mroute6_dyn_release(void *entry)
+{
+	struct mroute6 *route = entry;
+
+	timer_stop(&route->timer);
+	free(route);
+}
+
+/* Tell the -e script, in batch mode, that a dynamic route is gone */
+static void mroute6_dyn_notify(struct mroute6 *route)
+{
+	struct mroute mrt;
+
+	if (!script_exec)
+		return;
+
+	mrt.version = 6;
+	mrt.u.mroute6 = *route;
+	run_script("remove", &mrt);
+}
+
+/* Remove dynamic route from kernel and free it, callback for htab_exit() */
+static void mroute6_dyn_free(void *entry)
+{
+	__mroute6_del(entry);
+	mroute6_dyn_notify(entry);
+	mroute6_dyn_release(entry);
+}
+
+/* Idle timer callback, keep dynamic route only if the kernel has
+ * forwarded any packets for it since the last time we checked. */
+static void mroute6_dyn_expire(void *arg)
+{
+	struct mroute6 *route = arg;
+	struct sioc_sg_req6 sg_req;
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+
+	memset(&sg_req, 0, sizeof(sg_req));
+	sg_req.src = route->sender;
+	sg_req.grp = route->group;
+	if (!ioctl(mroute6_socket, SIOCGETSGCNT_IN6, &sg_req) && sg_req.pktcnt - sg_req.wrong_if != route->pktcnt) {
+		route->pktcnt = sg_req.pktcnt - sg_req.wrong_if;
+		timer_start(&route->timer, cache_tmo);
+		return;
+	}
+
+	smclog(LOG_INFO, "Idle timeout, removing IPv6 route %s -> %s",
+	       inet_ntop(AF_INET6, &route->sender.sin6_addr, origin, sizeof(origin)),
+	       inet_ntop(AF_INET6, &route->group.sin6_addr, group, sizeof(group)));
+
+	htab_remove(&mroute6_dyn_tab, route);
+	LIST_REMOVE(route, link);
+	mroute6_dyn_free(route);
+}
+
+/* Prefix length of a (*,G) rule, where len 0 means a single group */
+static int mroute6_prefix_len(struct mroute6 *rule)
+{
+	if (rule->len <= 0 || rule->len > 128)
+		return 128;
+
+	return rule->len;
+}
+
+/* Same as mroute4_wildcard_add(), but for IPv6 */
+static int mroute6_wildcard_add(struct mroute6 *rule)
+{
+	struct mroute6 route;
+
+	memcpy(&route, rule, sizeof(route));
+	if (!route.ttl[route.inbound])
+		route.ttl[route.inbound] = DEFAULT_THRESHOLD;
+
+	return __mroute6_add(&route);
+}
+
+/* Same as mroute4_src_len(), but for IPv6 */
+static int mroute6_src_len(struct mroute6 *rule)
+{
+	if (IN6_IS_ADDR_UNSPECIFIED(&rule->sender.sin6_addr))
+		return 0;
+	if (rule->src_len <= 0 || rule->src_len > 128)
+		return 128;
+
+	return rule->src_len;
+}
+
+/* Same as mroute4_is_rule(), but for IPv6 */
+static int mroute6_is_rule(struct mroute6 *route)
+{
+	return IN6_IS_ADDR_UNSPECIFIED(&route->sender.sin6_addr) || route->len > 0 || route->src_len > 0;
+}
+
+/* Same as mroute4_rules(), but for IPv6 */
+static struct trie *mroute6_rules(int mif, struct in6_addr *group, int len, int create)
+{
+	struct trie *rules;
+
+	rules = trie_find(&mroute6_conf_trie[mif], group, len);
+	if (rules || !create)
+		return rules;
+
+	rules = calloc(1, sizeof(struct trie));
+	if (!rules)
+		return NULL;
+
+	if (trie_insert(&mroute6_conf_trie[mif], group, len, rules)) {
+		free(rules);
+		return NULL;
+	}
+
+	return rules;
+}
+
+/* Same as mroute4_rules_free(), but for IPv6 */
+static void mroute6_rules_free(void *rules)
+{
+	trie_flush(rules, NULL);
+	free(rules);
+}
+
+/* Same as mroute4_wildcard(), but for IPv6 */
+static void mroute6_wildcard(struct in6_addr *group)
+{
+	struct mroute6 *rule, *found = NULL;
+	struct trie *rules;
+	size_t mif, num = 0;
+
+	if (!do_wildcard)
+		return;
+
+	for (mif = 0; mif < NELEMS(mroute6_conf_trie); mif++) {
+		rules = mroute6_rules(mif, group, 128, 0);
+		if (!rules)
+			continue;
+
+		num++;
+		rule = trie_find(rules, &in6addr_any, 0);
+		if (rule && rules->count == 1 && !rule->except.count)
+			found = rule;
+	}
+	if (num > 1)
+		found = NULL;
+
+	for (mif = 0; mif < NELEMS(mroute6_conf_trie); mif++) {
+		rules = mroute6_rules(mif, group, 128, 0);
+		if (!rules)
+			continue;
+
+		rule = trie_find(rules, &in6addr_any, 0);
+		if (rule && rule->wildcard && rule != found) {
+			__mroute6_del(rule);
+			rule->wildcard = 0;
+		}
+	}
+
+	if (found && !found->wildcard && !mroute6_wildcard_add(found))
+		found->wildcard = 1;
+}
+
+/* Same as mroute4_match(), but for IPv6 */
+static struct mroute6 *mroute6_match(struct mroute6 *cand)
+{
+	void *groups[129], *rules[129];
+	int i, j;
+
+	if (cand->inbound < 0 || cand->inbound >= MAXMIFS)
+		return NULL;
+
+	i = trie_match(&mroute6_conf_trie[cand->inbound], &cand->group.sin6_addr, 128, groups, NELEMS(groups));
+	while (i-- > 0) {
+		j = trie_match(groups[i], &cand->sender.sin6_addr, 128, rules, NELEMS(rules));
+		while (j-- > 0) {
+			struct mroute6 *rule = rules[j];
+
+			if (rule->except.count && trie_lookup(&rule->except, &cand->sender.sin6_addr, 128))
+				continue;
+
+			return rule;
+		}
 	}
 
-	return 0;
-#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+	return NULL;
+}
+
+/* Same as mroute4_match_any(), but for IPv6 */
+static struct mroute6 *mroute6_match_any(struct mroute6 *route)
+{
+	struct mroute6 cand, *rule;
+	int mif;
+
+	memcpy(&cand, route, sizeof(cand));
+	for (mif = 0; mif < MAXMIFS; mif++) {
+		if (!mroute6_conf_trie[mif].count)
+			continue;
+
+		cand.inbound = mif;
+		rule = mroute6_match(&cand);
+		if (rule)
+			return rule;
+	}
+
+	return NULL;
+}
+
+/* Remove blackhole route from kernel and free it, callback for htab_exit() */
+static void mroute6_drop_free(void *entry)
+{
+	__mroute6_del(entry);
+	mroute6_dyn_release(entry);
+}
+
+/* Idle timer callback, remove blackhole route when no more packets
+ * for it have arrived since the last time we checked. */
+static void mroute6_drop_expire(void *arg)
+{
+	struct mroute6 *route = arg;
+	struct sioc_sg_req6 sg_req;
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+
+	memset(&sg_req, 0, sizeof(sg_req));
+	sg_req.src = route->sender;
+	sg_req.grp = route->group;
+	if (!ioctl(mroute6_socket, SIOCGETSGCNT_IN6, &sg_req) && sg_req.pktcnt - sg_req.wrong_if != route->pktcnt) {
+		route->pktcnt = sg_req.pktcnt - sg_req.wrong_if;
+		timer_start(&route->timer, blackhole_tmo);
+		return;
+	}
+
+	smclog(LOG_INFO, "Idle timeout, removing IPv6 blackhole route %s -> %s",
+	       inet_ntop(AF_INET6, &route->sender.sin6_addr, origin, sizeof(origin)),
+	       inet_ntop(AF_INET6, &route->group.sin6_addr, group, sizeof(group)));
+
+	htab_remove(&mroute6_drop_tab, route);
+	LIST_REMOVE(route, link);
+	upcall_forget6(route);
+	mroute6_drop_free(route);
+}
+
+/*
+ * Set a blackhole route, without outbound MIFs, for an upcall that does
+ * not match any (*,G) rule.  The kernel then drops the flow in its fast
+ * path, instead of queueing packets and sending us a new upcall every
+ * time its unresolved entry times out.
+ */
+static void mroute6_drop_add(struct mroute6 *route)
+{
+	struct mroute6 *entry;
+
+	if (!blackhole_tmo || mroute6_drop_tab.count >= MROUTE_DROP_MAX)
+		return;
+	if (htab_find(&mroute6_static_tab, route) || htab_find(&mroute6_drop_tab, route))
+		return;
+	if (mroute6_match_any(route))
+		return;
+
+	entry = malloc(sizeof(struct mroute6));
+	if (!entry)
+		return;
+
+	memcpy(entry, route, sizeof(struct mroute6));
+	memset(entry->ttl, 0, sizeof(entry->ttl));
+	entry->rule   = NULL;
+	entry->pktcnt = 0;
+	if (htab_insert(&mroute6_drop_tab, entry)) {
+		free(entry);
+		return;
+	}
+
+	if (__mroute6_add(entry)) {
+		htab_remove(&mroute6_drop_tab, entry);
+		free(entry);
+		return;
+	}
+
+	LIST_INSERT_HEAD(&mroute6_drop_list, entry, link);
+	timer_init(&entry->timer, mroute6_drop_expire, entry);
+	timer_start(&entry->timer, blackhole_tmo);
+}
+
+/* Forget blackhole route for (S,G), replaced in the kernel by a route */
+static void mroute6_drop_forget(struct mroute6 *route)
+{
+	struct mroute6 *entry;
+
+	entry = htab_remove(&mroute6_drop_tab, route);
+	if (!entry)
+		return;
+
+	LIST_REMOVE(entry, link);
+	mroute6_dyn_release(entry);
+}
+
+/* A (*,G) rule has been added, or changed, remove the blackhole routes
+ * matching a rule now, on any inbound MIF, so the next packet is sent
+ * up to us and routed. */
+static void mroute6_drop_rematch(void)
+{
+	struct mroute6 *entry, *tmp;
+
+	LIST_FOREACH_SAFE(entry, &mroute6_drop_list, link, tmp) {
+		if (!mroute6_match_any(entry))
+			continue;
+
+		htab_remove(&mroute6_drop_tab, entry);
+		LIST_REMOVE(entry, link);
+		mroute6_drop_free(entry);
+	}
 }
 
 /**
- * mroute6_disable - Disable IPv6 multicast routing
+ * mroute6_dyn_add - Add route to kernel if it matches a known (*,G) route.
+ * @route: Pointer to candidate struct mroute6 IPv6 multicast route
  *
- * Disable IPv6 multicast routing and release kernel routing socket.
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
  */
-void mroute6_disable(void)
+int mroute6_dyn_add(struct mroute6 *route)
+{
+	struct mroute6 *entry, *dyn;
+
+	/* Find most specific (*,G) ... on this interface. */
+	entry = mroute6_match(route);
+	if (!entry) {
+		mroute6_drop_add(route);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Use configured template (*,G) outbound interfaces. */
+	memcpy(route->ttl, entry->ttl, NELEMS(route->ttl) * sizeof(route->ttl[0]));
+
+	/* Track the route, see mroute4_dyn_add() for details. */
+	dyn = htab_find(&mroute6_dyn_tab, route);
+	if (dyn) {
+		LIST_REMOVE(dyn, link);
+	} else {
+		dyn = malloc(sizeof(struct mroute6));
+		if (!dyn)
+			return __mroute6_add(route);
+
+		memcpy(dyn, route, sizeof(struct mroute6));
+		if (htab_insert(&mroute6_dyn_tab, dyn)) {
+			free(dyn);
+			return __mroute6_add(route);
+		}
+		timer_init(&dyn->timer, mroute6_dyn_expire, dyn);
+	}
+
+	memcpy(dyn->ttl, route->ttl, sizeof(dyn->ttl));
+	dyn->rule = entry;
+	LIST_INSERT_HEAD(&entry->dyn_list, dyn, link);
+
+	/* Kernel starts counting from zero for a new route */
+	dyn->pktcnt = 0;
+	if (cache_tmo)
+		timer_start(&dyn->timer, cache_tmo);
+
+	return __mroute6_add(route);
+}
+#endif /* HAVE_IPV6_MULTICAST_ROUTING */
+
+/**
+ * mroute6_dyn_flush - Flush dynamically added (*,G) routes
+ *
+ * IPv6 counterpart of mroute4_dyn_flush().
+ */
+void mroute6_dyn_flush(void)
 {
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
-	if (mroute6_socket < 0)
+	struct mroute6 *entry;
+
+	if (!mroute6_dyn_tab.count && !mroute6_drop_tab.count)
 		return;
 
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DONE, NULL, 0))
-		smclog(LOG_WARNING, "Failed shutting down IPv6 multicast routing socket: %s", strerror(errno));
+	LIST_FOREACH(entry, &mroute6_conf_list, link)
+		LIST_INIT(&entry->dyn_list);
 
-	close(mroute6_socket);
-	mroute6_socket = -1;
+	htab_exit(&mroute6_dyn_tab, mroute6_dyn_free);
+	LIST_INIT(&mroute6_drop_list);
+	htab_exit(&mroute6_drop_tab, mroute6_drop_free);
+	upcall_flush6();
 #endif /* HAVE_IPV6_MULTICAST_ROUTING */
 }
 
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
-/* Create a virtual interface from @iface so it can be used for IPv6 multicast routing. */
-static int mroute6_add_mif(struct iface *iface)
+/* Same as mroute4_dyn_flush_vif(), but for IPv6 */
+static void mroute6_dyn_flush_mif(int mif)
 {
-	struct mif6ctl mc;
-	int mif = -1;
-	size_t i;
+	LIST_HEAD(, mroute6) list = LIST_HEAD_INITIALIZER();
+	struct mroute6 *entry, *tmp;
+	size_t pos = 0;
 
-	if ((iface->flags & (IFF_LOOPBACK | IFF_MULTICAST)) != IFF_MULTICAST) {
-		smclog(LOG_INFO, "Interface %s is not multicast capable, skipping MIF.", iface->name);
-		iface->mif = -1;
-		return 0;
+	while ((entry = htab_next(&mroute6_dyn_tab, &pos))) {
+		if (entry->inbound != mif && !entry->ttl[mif])
+			continue;
+
+		LIST_REMOVE(entry, link);
+		LIST_INSERT_HEAD(&list, entry, link);
+	}
+	LIST_FOREACH_SAFE(entry, &list, link, tmp) {
+		htab_remove(&mroute6_dyn_tab, entry);
+		upcall_forget6(entry);
+		mroute6_dyn_free(entry);
 	}
 
-	/* find a free mif */
-	for (i = 0; i < NELEMS(mif_list); i++) {
-		if (!mif_list[i].iface) {
-			mif = i;
-			break;
-		}
+	LIST_FOREACH_SAFE(entry, &mroute6_drop_list, link, tmp) {
+		if (entry->inbound != mif)
+			continue;
+
+		htab_remove(&mroute6_drop_tab, entry);
+		LIST_REMOVE(entry, link);
+		upcall_forget6(entry);
+		mroute6_drop_free(entry);
 	}
+}
 
-	/* no more space */
-	if (mif == -1) {
-		errno = ENOMEM;
-		smclog(LOG_WARNING, "Kernel MAXMIFS (%d) too small for number of interfaces: %s", MAXMIFS, strerror(errno));
-		return 1;
+/* Outbound MIFs of a (*,G) rule have changed, update its dynamic routes */
+static void mroute6_rule_update(struct mroute6 *rule)
+{
+	struct mroute6 *dyn;
+
+	LIST_FOREACH(dyn, &rule->dyn_list, link) {
+		memcpy(dyn->ttl, rule->ttl, sizeof(dyn->ttl));
+		__mroute6_add(dyn);
 	}
+}
 
-	memset(&mc, 0, sizeof(mc));
-	mc.mif6c_mifi = mif;
-	mc.mif6c_flags = 0;	/* no register */
-#ifdef HAVE_MIF6CTL_VIFC_THRESHOLD
-	mc.vifc_threshold = iface->threshold;
-#endif
-	mc.mif6c_pifi = iface->ifindex;	/* physical interface index */
-#ifdef HAVE_MIF6CTL_VIFC_RATE_LIMIT
-	mc.vifc_rate_limit = 0;	/* hopefully no limit */
-#endif
+/* Move dynamic routes to a more specific rule, see mroute4_dyn_rematch() */
+static void mroute6_dyn_rematch(void)
+{
+	struct mroute6 *dyn, *rule;
+	size_t pos = 0;
 
-	smclog(LOG_DEBUG, "Map iface %-16s => MIF %-2d ifindex %2d flags 0x%04x TTL threshold %u",
-	       iface->name, mc.mif6c_mifi, mc.mif6c_pifi, mc.mif6c_flags, iface->threshold);
+	while ((dyn = htab_next(&mroute6_dyn_tab, &pos))) {
+		rule = mroute6_match(dyn);
+		if (!rule || rule == dyn->rule)
+			continue;
 
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_ADD_MIF, (void *)&mc, sizeof(mc))) {
-		smclog(LOG_ERR, "Failed adding MIF for iface %s: %s", iface->name, strerror(errno));
-		iface->mif = -1;
+		LIST_REMOVE(dyn, link);
+		dyn->rule = rule;
+		LIST_INSERT_HEAD(&rule->dyn_list, dyn, link);
+
+		if (memcmp(dyn->ttl, rule->ttl, sizeof(dyn->ttl))) {
+			memcpy(dyn->ttl, rule->ttl, sizeof(dyn->ttl));
+			__mroute6_add(dyn);
+		}
+	}
+}
+
+/* Set (S,G) route in kernel, unless already set exactly like this */
+static int mroute6_static_add(struct mroute6 *route)
+{
+	struct mroute6 *entry;
+	int rc;
+
+	/* Replaces any blackhole route in the kernel */
+	mroute6_drop_forget(route);
+
+	entry = htab_find(&mroute6_static_tab, route);
+	if (entry) {
+		entry->stale = 0;
+		if (entry->inbound == route->inbound && !memcmp(entry->ttl, route->ttl, sizeof(entry->ttl)))
+			return 0;
+
+		vif_ref(mif_list, NELEMS(mif_list), route->inbound, route->ttl, 1);
+		vif_ref(mif_list, NELEMS(mif_list), entry->inbound, entry->ttl, -1);
+		entry->inbound = route->inbound;
+		memcpy(entry->ttl, route->ttl, sizeof(entry->ttl));
 	} else {
-		iface->mif = mif;
-		mif_list[mif].iface = iface;
+		entry = malloc(sizeof(struct mroute6));
+		if (entry) {
+			memcpy(entry, route, sizeof(struct mroute6));
+			entry->stale = 0;
+			if (htab_insert(&mroute6_static_tab, entry))
+				free(entry);
+			else
+				vif_ref(mif_list, NELEMS(mif_list), entry->inbound, entry->ttl, 1);
+		}
 	}
 
-	return 0;
+	rc = __mroute6_add(route);
+	mroute6_vif_reclaim();
+
+	return rc;
 }
 
-static int mroute6_del_mif(struct iface *iface)
+/* Same as mroute4_except_update(), but for IPv6 */
+static void mroute6_except_update(struct mroute6 *rule)
 {
-	int16_t mif = iface->mif;
+	struct mroute6 *dyn, *tmp;
 
-	if (-1 == mif)
-		return 0;	/* No MIF setup for iface, skip */
+	LIST_FOREACH_SAFE(dyn, &rule->dyn_list, link, tmp) {
+		if (!trie_lookup(&rule->except, &dyn->sender.sin6_addr, 128))
+			continue;
 
-	smclog(LOG_DEBUG, "Removing  %-16s => MIF %-2d", iface->name, mif);
+		htab_remove(&mroute6_dyn_tab, dyn);
+		LIST_REMOVE(dyn, link);
+		mroute6_dyn_free(dyn);
+	}
+	mroute6_dyn_rematch();
 
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DEL_MIF, (void *)&mif, sizeof(mif)))
-		smclog(LOG_ERR, "Failed deleting MIF for iface %s: %s", iface->name, strerror(errno));
-	else
-		iface->mif = -1;
+	mroute6_drop_rematch();
+	upcall_invalidate();
+	if (mroute6_prefix_len(rule) == 128)
+		mroute6_wildcard(&rule->group.sin6_addr);
+}
+
+/**
+ * mroute6_except - Exclude a source prefix from a (*,G) rule
+ * @route: Rule to be passed to mroute6_add()
+ * @source: Source prefix
+ * @len: Source prefix length
+ *
+ * IPv6 counterpart of mroute4_except().
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int mroute6_except(struct mroute6 *route, struct in6_addr *source, int len)
+{
+	if (len < 0 || len > 128) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (trie_insert(&route->except, source, len, route) && errno != EEXIST)
+		return -1;
 
 	return 0;
 }
@@ -654,90 +2271,389 @@ static int mroute6_del_mif(struct iface *iface)
  * mroute6_add - Add route to kernel, or save a wildcard route for later use
  * @route: Pointer to struct mroute6 IPv6 multicast route to add
  *
- * Adds the given multicast @route to the kernel multicast routing table.
+ * Adds the given multicast @route to the kernel multicast routing table
+ * unless it is a rule, i.e., the source IP is unspecified, or the source
+ * or group is a prefix.  Those we save for and check against at runtime
+ * when the kernel signals us.  Any sources excluded from a rule, see
+ * mroute6_except(), are taken over by the rule, or released.
  *
  * Returns:
  * POSIX OK(0) on success, non-zero on error with @errno set.
  */
 int mroute6_add(struct mroute6 *route)
 {
-	int result = 0;
-	size_t i;
-	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
-	struct mf6cctl mc;
+	/* For (*,G) we save to a linked list to be added on-demand
+	 * when the kernel sends MRT6MSG_NOCACHE. */
+	if (mroute6_is_rule(route)) {
+		struct mroute6 *entry;
+		struct trie *rules;
+		int len, slen, err;
+
+		if (route->inbound < 0 || route->inbound >= MAXMIFS) {
+			errno = EINVAL;
+			goto fail;
+		}
 
-	memset(&mc, 0, sizeof(mc));
-	mc.mf6cc_origin   = route->sender;
-	mc.mf6cc_mcastgrp = route->group;
-	mc.mf6cc_parent   = route->inbound;
+		/* Same group and source prefix on same MIF replaces
+		 * outbound MIFs, and excluded sources. */
+		len   = mroute6_prefix_len(route);
+		slen  = mroute6_src_len(route);
+		rules = mroute6_rules(route->inbound, &route->group.sin6_addr, len, 1);
+		if (!rules)
+			goto fail;
+
+		entry = trie_find(rules, &route->sender.sin6_addr, slen);
+		if (entry) {
+			entry->stale = 0;
+			if (!trie_equal(&entry->except, &route->except)) {
+				trie_flush(&entry->except, NULL);
+				entry->except = route->except;
+				memset(&route->except, 0, sizeof(route->except));
+				mroute6_except_update(entry);
+			}
+			trie_flush(&route->except, NULL);
+
+			if (!memcmp(entry->ttl, route->ttl, sizeof(entry->ttl)))
+				return 0;
+
+			vif_ref(mif_list, NELEMS(mif_list), -1, route->ttl, 1);
+			vif_ref(mif_list, NELEMS(mif_list), -1, entry->ttl, -1);
+			memcpy(entry->ttl, route->ttl, sizeof(entry->ttl));
+			if (entry->wildcard)
+				mroute6_wildcard_add(entry);
+			mroute6_rule_update(entry);
+			mroute6_vif_reclaim();
+			return 0;
+		}
 
-	/* copy the outgoing MIFs */
-	for (i = 0; i < NELEMS(route->ttl); i++) {
-		if (route->ttl[i] > 0)
-			IF_SET(i, &mc.mf6cc_ifset);
-	}
+		entry = malloc(sizeof(struct mroute6));
+		if (!entry)
+			goto prune;
 
-	smclog(LOG_DEBUG, "Add %s -> %s from MIF %d",
-	       inet_ntop(AF_INET6, &mc.mf6cc_origin.sin6_addr, origin, INET6_ADDRSTRLEN),
-	       inet_ntop(AF_INET6, &mc.mf6cc_mcastgrp.sin6_addr, group, INET6_ADDRSTRLEN),
-	       mc.mf6cc_parent);
+		memcpy(entry, route, sizeof(struct mroute6));
+		entry->wildcard = 0;
+		entry->stale = 0;
+		LIST_INIT(&entry->dyn_list);
+		if (trie_insert(rules, &entry->sender.sin6_addr, slen, entry)) {
+			free(entry);
+			goto prune;
+		}
+		memset(&route->except, 0, sizeof(route->except));
 
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_ADD_MFC, (void *)&mc, sizeof(mc))) {
-		result = errno;
-		smclog(LOG_WARNING, "Failed adding IPv6 multicast route: %s", strerror(errno));
+		LIST_INSERT_HEAD(&mroute6_conf_list, entry, link);
+		mroute6_drop_rematch();
+		upcall_invalidate();
+		vif_ref(mif_list, NELEMS(mif_list), entry->inbound, entry->ttl, 1);
+
+		if (len == 128)
+			mroute6_wildcard(&entry->group.sin6_addr);
+
+		return 0;
+	prune:
+		if (!rules->count) {
+			trie_remove(&mroute6_conf_trie[route->inbound], &route->group.sin6_addr, len);
+			free(rules);
+		}
+	fail:
+		err = errno;
+		trie_flush(&route->except, NULL);
+		mroute6_vif_reclaim();
+		smclog(LOG_WARNING, "Failed adding IPv6 (*,G) multicast route: %s", strerror(err));
+		return err;
 	}
 
-	return result;
+	return mroute6_static_add(route);
 }
 
 /**
- * mroute6_del - Remove route from kernel
+ * mroute6_del - Remove route from kernel, or all matching routes if wildcard
  * @route: Pointer to struct mroute6 IPv6 multicast route to remove
  *
  * Removes the given multicast @route from the kernel multicast routing
- * table.
+ * table, or if the @route is a wildcard, then all kernel routes set
+ * from it are removed, as well as the wildcard.
  *
  * Returns:
  * POSIX OK(0) on success, non-zero on error with @errno set.
  */
 int mroute6_del(struct mroute6 *route)
 {
-	int result = 0;
-	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
-	struct mf6cctl mc;
+	struct mroute6 *entry, *set, *tmp;
+	struct trie *rules;
+	int rc;
+
+	/* A dynamically set (S,G) may also be removed, forget about it. */
+	if (!mroute6_is_rule(route)) {
+		set = htab_remove(&mroute6_dyn_tab, route);
+		if (set) {
+			LIST_REMOVE(set, link);
+			mroute6_dyn_notify(set);
+			mroute6_dyn_release(set);
+		}
+		mroute6_drop_forget(route);
+		entry = htab_remove(&mroute6_static_tab, route);
+		if (entry) {
+			vif_ref(mif_list, NELEMS(mif_list), entry->inbound, entry->ttl, -1);
+			free(entry);
+		}
 
-	memset(&mc, 0, sizeof(mc));
-	mc.mf6cc_origin = route->sender;
-	mc.mf6cc_mcastgrp = route->group;
+		rc = __mroute6_del(route);
+		mroute6_vif_reclaim();
 
-	smclog(LOG_DEBUG, "Del %s -> %s",
-	       inet_ntop(AF_INET6, &mc.mf6cc_origin.sin6_addr, origin, INET6_ADDRSTRLEN),
-	       inet_ntop(AF_INET6, &mc.mf6cc_mcastgrp.sin6_addr, group, INET6_ADDRSTRLEN));
+		return rc;
+	}
 
-	if (setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DEL_MFC, (void *)&mc, sizeof(mc))) {
-		result = errno;
-		smclog(LOG_WARNING, "Failed removing IPv6 multicast route: %s", strerror(errno));
+	if (route->inbound < 0 || route->inbound >= MAXMIFS)
+		return 0;
+
+	/* Find exact (*,G) ... and interface .. and prefix lengths. */
+	rules = mroute6_rules(route->inbound, &route->group.sin6_addr, mroute6_prefix_len(route), 0);
+	if (!rules)
+		return 0;
+	entry = trie_find(rules, &route->sender.sin6_addr, mroute6_src_len(route));
+	if (!entry)
+		return 0;
+
+	LIST_FOREACH_SAFE(set, &entry->dyn_list, link, tmp) {
+		htab_remove(&mroute6_dyn_tab, set);
+		mroute6_dyn_free(set);
 	}
 
-	return result;
+	trie_remove(rules, &entry->sender.sin6_addr, mroute6_src_len(entry));
+	if (!rules->count) {
+		trie_remove(&mroute6_conf_trie[entry->inbound], &entry->group.sin6_addr, mroute6_prefix_len(entry));
+		free(rules);
+	}
+	LIST_REMOVE(entry, link);
+	if (entry->wildcard)
+		__mroute6_del(entry);
+	if (mroute6_prefix_len(entry) == 128)
+		mroute6_wildcard(&entry->group.sin6_addr);
+	vif_ref(mif_list, NELEMS(mif_list), entry->inbound, entry->ttl, -1);
+	trie_flush(&entry->except, NULL);
+	free(entry);
+	mroute6_vif_reclaim();
+
+	return 0;
+}
+
+static void mroute6_mark(void)
+{
+	struct mroute6 *entry;
+	size_t pos = 0;
+
+	LIST_FOREACH(entry, &mroute6_conf_list, link)
+		entry->stale = 1;
+	while ((entry = htab_next(&mroute6_static_tab, &pos)))
+		entry->stale = 1;
+}
+
+static void mroute6_sweep(void)
+{
+	LIST_HEAD(, mroute6) list = LIST_HEAD_INITIALIZER();
+	struct mroute6 *entry, *tmp, route;
+	size_t pos = 0;
+
+	LIST_FOREACH_SAFE(entry, &mroute6_conf_list, link, tmp) {
+		if (!entry->stale)
+			continue;
+
+		route = *entry;
+		mroute6_del(&route);
+	}
+
+	while ((entry = htab_next(&mroute6_static_tab, &pos))) {
+		if (entry->stale)
+			LIST_INSERT_HEAD(&list, entry, link);
+	}
+	LIST_FOREACH_SAFE(entry, &list, link, tmp) {
+		route = *entry;
+		mroute6_del(&route);
+	}
+
+	mroute6_dyn_rematch();
 }
 #endif /* HAVE_IPV6_MULTICAST_ROUTING */
 
-/* Used by file parser to add VIFs/MIFs after setup */
-int mroute_add_vif(char *ifname, uint8_t threshold)
+/**
+ * mroute_mark - Mark all (*,G) rules and (S,G) routes before a reload
+ *
+ * Adding a rule or route that already exists, exactly as before, clears
+ * its mark without touching the kernel.  What is still marked after the
+ * .conf file has been read is removed by mroute_sweep().
+ */
+void mroute_mark(void)
+{
+	size_t i;
+
+	mroute4_mark();
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	mroute6_mark();
+#endif
+
+	/* VIFs of interfaces no longer enabled are removed when unused */
+	if (!lazy_vifs)
+		return;
+
+	for (i = 0; i < NELEMS(vif_list); i++)
+		vif_list[i].lazy = 1;
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	for (i = 0; i < NELEMS(mif_list); i++)
+		mif_list[i].lazy = 1;
+#endif
+}
+
+/**
+ * mroute_sweep - Remove all rules and routes not set again since mroute_mark()
+ */
+void mroute_sweep(void)
+{
+	mroute4_sweep();
+	mroute4_vif_reclaim();
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	mroute6_sweep();
+	mroute6_vif_reclaim();
+#endif
+}
+
+/**
+ * mroute_vif_gone - Release VIF/MIF of an interface removed from the system
+ * @iface: Interface about to be removed
+ *
+ * The kernel removes the VIF/MIF of an interface that is removed, so
+ * deleting it here may fail.  Routes using the VIF/MIF are kept, the
+ * interface gets the same VIF/MIF back if it returns.
+ */
+void mroute_vif_gone(struct iface *iface)
+{
+	if (iface->vif != -1) {
+		vifi_t vif = iface->vif;
+
+		smclog(LOG_DEBUG, "Interface %s gone, removing VIF %d", iface->name, vif);
+#ifdef __linux__
+		struct vifctl vc = { .vifc_vifi = vif };
+		setsockopt(mroute4_socket, IPPROTO_IP, MRT_DEL_VIF, (void *)&vc, sizeof(vc));
+#else
+		setsockopt(mroute4_socket, IPPROTO_IP, MRT_DEL_VIF, (void *)&vif, sizeof(vif));
+#endif
+		watch_vif("del", iface->name, AF_INET, vif);
+		vif_list[vif].iface = NULL;
+		iface_set_vif(iface, -1);
+	}
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	if (iface->mif != -1) {
+		mifi_t mif = iface->mif;
+
+		smclog(LOG_DEBUG, "Interface %s gone, removing MIF %d", iface->name, mif);
+		setsockopt(mroute6_socket, IPPROTO_IPV6, MRT6_DEL_MIF, (void *)&mif, sizeof(mif));
+		watch_vif("del", iface->name, AF_INET6, mif);
+		mif_list[mif].iface = NULL;
+		iface_set_mif(iface, -1);
+	}
+#endif
+}
+
+/* Forget about all pinned VIFs/MIFs, the .conf file is to be re-read */
+void mroute_unpin_vifs(void)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(vif_list); i++)
+		vif_list[i].pinned = 0;
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	for (i = 0; i < NELEMS(mif_list); i++)
+		mif_list[i].pinned = 0;
+#endif
+}
+
+/* Reserve @vif, or @mif, for @ifname.  Any other interface using it is
+ * moved to another VIF/MIF when mroute_add_vif() is called for it. */
+static int pin_vif(struct vif *list, size_t num, const char *ifname, int vif)
+{
+	if (vif < 0)
+		return 0;
+	if ((size_t)vif >= num) {
+		smclog(LOG_WARNING, "Cannot pin %s to VIF %d, max %zu", ifname, vif, num - 1);
+		return 1;
+	}
+	if (list[vif].pinned && strcmp(list[vif].name, ifname)) {
+		smclog(LOG_WARNING, "Cannot pin %s to VIF %d, already pinned to %s", ifname, vif, list[vif].name);
+		return 1;
+	}
+
+	snprintf(list[vif].name, sizeof(list[vif].name), "%s", ifname);
+	list[vif].pinned = 1;
+
+	return 0;
+}
+
+/* Used by file parser to pin VIFs/MIFs, -1 for no pin */
+int mroute_pin_vif(char *ifname, int vif, int mif)
 {
+	struct iface *iface;
 	int ret;
+
+	ret = pin_vif(vif_list, NELEMS(vif_list), ifname, vif);
+	if (!ret && vif >= 0 && (iface = vif_list[vif].iface) && strcmp(iface->name, ifname))
+		mroute4_del_vif(iface);
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	ret += pin_vif(mif_list, NELEMS(mif_list), ifname, mif);
+	if (!ret && mif >= 0 && (iface = mif_list[mif].iface) && strcmp(iface->name, ifname))
+		mroute6_del_mif(iface);
+#else
+	(void)mif;
+#endif
+
+	return ret;
+}
+
+/* Used by file parser to add VIFs/MIFs after setup, a changed TTL
+ * threshold, or pinned VIF/MIF, means the VIF/MIF must be recreated.
+ * Dynamic routes are then learned again, on the new VIF/MIF. */
+int mroute_add_vif(char *ifname, uint8_t threshold)
+{
+	int ret = 0, vif;
 	struct iface *iface;
 
-	smclog(LOG_DEBUG, "Adding %s to list of multicast routing interfaces", ifname);
 	iface = iface_find_by_name(ifname);
 	if (!iface)
 		return 1;
 
-	iface->threshold = threshold;
-	ret = mroute4_add_vif(iface);
+	if (iface->threshold != threshold) {
+		mroute4_del_vif(iface);
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+		mroute6_del_mif(iface);
+#endif
+		iface->threshold = threshold;
+	}
+
+	vif = vif_pinned(vif_list, NELEMS(vif_list), ifname);
+	if (iface->vif != -1 && vif >= 0 && iface->vif != vif) {
+		mroute4_dyn_flush_vif(iface->vif);
+		mroute4_del_vif(iface);
+	}
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	vif = vif_pinned(mif_list, NELEMS(mif_list), ifname);
+	if (iface->mif != -1 && vif >= 0 && iface->mif != vif) {
+		mroute6_dyn_flush_mif(iface->mif);
+		mroute6_del_mif(iface);
+	}
+#endif
+
+	if (iface->vif == -1) {
+		smclog(LOG_DEBUG, "Adding %s to list of IPv4 multicast routing interfaces", ifname);
+		ret += mroute4_add_vif(iface);
+	}
+	if (iface->vif != -1)
+		vif_list[iface->vif].lazy = 0;
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
-	ret += mroute6_add_mif(iface);
+	if (iface->mif == -1) {
+		smclog(LOG_DEBUG, "Adding %s to list of IPv6 multicast routing interfaces", ifname);
+		ret += mroute6_add_mif(iface);
+	}
+	if (iface->mif != -1)
+		mif_list[iface->mif].lazy = 0;
 #endif
 
 	return ret;
@@ -749,10 +2665,13 @@ int mroute_del_vif(char *ifname)
 	int ret;
 	struct iface *iface;
 
-	smclog(LOG_DEBUG, "Pruning %s from list of multicast routing interfaces", ifname);
 	iface = iface_find_by_name(ifname);
 	if (!iface)
 		return 1;
+	if (iface->vif == -1 && iface->mif == -1)
+		return 0;
+
+	smclog(LOG_DEBUG, "Pruning %s from list of multicast routing interfaces", ifname);
 
 	ret = mroute4_del_vif(iface);
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
@@ -762,6 +2681,126 @@ int mroute_del_vif(char *ifname)
 	return ret;
 }
 
+/**
+ * mroute_reclaim_vifs - Remove VIFs and MIFs set up on demand, but unused
+ *
+ * In lazy mode, -z, call when a route could not be added after its
+ * VIFs were looked up with mroute_get_vif_by_name().
+ */
+void mroute_reclaim_vifs(void)
+{
+	mroute4_vif_reclaim();
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	mroute6_vif_reclaim();
+#endif
+}
+
+/**
+ * mroute_find_vif_by_name - Find VIF of interface
+ * @ifname: Interface name
+ *
+ * Unlike mroute_get_vif_by_name() a VIF is never set up, use this to
+ * look up a route to remove.
+ *
+ * Returns:
+ * The VIF, or -1 if the interface does not have one.
+ */
+int mroute_find_vif_by_name(const char *ifname)
+{
+	struct iface *iface;
+
+	iface = iface_find_by_name(ifname);
+	if (!iface)
+		return -1;
+
+	return iface->vif;
+}
+
+/**
+ * mroute_find_mif_by_name - Find MIF of interface
+ * @ifname: Interface name
+ *
+ * IPv6 version of mroute_find_vif_by_name().
+ *
+ * Returns:
+ * The MIF, or -1 if the interface does not have one.
+ */
+int mroute_find_mif_by_name(const char *ifname)
+{
+#ifndef HAVE_IPV6_MULTICAST_ROUTING
+	(void)ifname;
+	return -1;
+#else
+	struct iface *iface;
+
+	iface = iface_find_by_name(ifname);
+	if (!iface)
+		return -1;
+
+	return iface->mif;
+#endif
+}
+
+/**
+ * mroute_get_vif_by_name - Get VIF of interface, to use in a route
+ * @ifname: Interface name
+ *
+ * In lazy mode, -z, a VIF is set up for the interface if it does not
+ * have one already, unless disabled with a phyint line.  The VIF is
+ * removed again when it is no longer used by any rule or route, see
+ * mroute_reclaim_vifs() for when the route is never added.
+ *
+ * Returns:
+ * The VIF, or -1 if the interface does not have one.
+ */
+int mroute_get_vif_by_name(const char *ifname)
+{
+	struct iface *iface;
+
+	iface = iface_find_by_name(ifname);
+	if (!iface)
+		return -1;
+
+	if (iface->vif == -1 && lazy_vifs && !iface->disabled) {
+		smclog(LOG_DEBUG, "Adding %s to list of IPv4 multicast routing interfaces, on demand", ifname);
+		if (!mroute4_add_vif(iface) && iface->vif != -1)
+			vif_list[iface->vif].lazy = 1;
+	}
+
+	return iface->vif;
+}
+
+/**
+ * mroute_get_mif_by_name - Get MIF of interface, to use in a route
+ * @ifname: Interface name
+ *
+ * IPv6 version of mroute_get_vif_by_name().
+ *
+ * Returns:
+ * The MIF, or -1 if the interface does not have one.
+ */
+int mroute_get_mif_by_name(const char *ifname)
+{
+#ifndef HAVE_IPV6_MULTICAST_ROUTING
+	(void)ifname;
+	return -1;
+#else
+	struct iface *iface;
+
+	iface = iface_find_by_name(ifname);
+	if (!iface)
+		return -1;
+
+	if (iface->mif == -1 && lazy_vifs && !iface->disabled) {
+		smclog(LOG_DEBUG, "Adding %s to list of IPv6 multicast routing interfaces, on demand", ifname);
+		if (!mroute6_add_mif(iface) && iface->mif != -1)
+			mif_list[iface->mif].lazy = 1;
+	}
+
+	return iface->mif;
+#endif
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -35,42 +35,64 @@
  *  | 32 | 'j' | 3 | "eth0\01.1.1.1\0239.1.1.1\0\0"             |
  *  +----+-----+---+--------------------------------------------+
  */
+/* Split the '\0' separated argument strings of @msg into @argv[] */
+static size_t msg_args(struct ipc_msg *msg, char *argv[], size_t num)
+{
+	char *arg = (char *)msg->argv;
+	size_t i;
+
+	for (i = 0; i < msg->count && i < num; i++) {
+		argv[i] = arg;
+		arg += strlen(arg) + 1;
+	}
+
+	return i;
+}
+
 char *msg_to_mgroup4(struct ipc_msg *msg, struct in_addr *src, struct in_addr *grp)
 {
+	char *argv[3];
 	int ret = 0;
 
+	if (msg_args(msg, argv, NELEMS(argv)) < 2)
+		return NULL;
+
 	if (msg->count == 3) {
-		ret += inet_pton(AF_INET, msg->argv[1], src);
-		ret += inet_pton(AF_INET, msg->argv[2], grp);
+		ret += inet_pton(AF_INET, argv[1], src);
+		ret += inet_pton(AF_INET, argv[2], grp);
 	} else {
 		src->s_addr = 0;
 		ret  = 1;
-		ret += inet_pton(AF_INET, msg->argv[1], grp);
+		ret += inet_pton(AF_INET, argv[1], grp);
 	}
 
 	if (ret < 2)
 		return NULL;
 
-	return msg->argv[0];
+	return argv[0];
 }
 
 char *msg_to_mgroup6(struct ipc_msg *msg, struct in6_addr *src, struct in6_addr *grp)
 {
+	char *argv[3];
 	int ret = 0;
 
+	if (msg_args(msg, argv, NELEMS(argv)) < 2)
+		return NULL;
+
 	if (msg->count == 3) {
-		ret += inet_pton(AF_INET6, msg->argv[1], src);
-		ret += inet_pton(AF_INET6, msg->argv[2], grp);
+		ret += inet_pton(AF_INET6, argv[1], src);
+		ret += inet_pton(AF_INET6, argv[2], grp);
 	} else {
 		memset(src, 0, sizeof(*src));
 		ret = 1;
-		ret += inet_pton(AF_INET6, msg->argv[1], grp);
+		ret += inet_pton(AF_INET6, argv[1], grp);
 	}
 
 	if (ret < 2)
 		return NULL;
 
-	return msg->argv[0];
+	return argv[0];
 }
 
 /**
@@ -150,24 +172,39 @@ const char *msg_to_mroute4(struct mroute4 *mroute, const struct ipc_msg *msg)
 	 *  +-----cmd------+
 	 */
 
-	/* get input interface index */
-	if (!*arg || (mroute->inbound = iface_get_vif_by_name(arg)) < 0)
+	/* get input interface index, only set up a VIF to add a route */
+	if (msg->cmd == 'a')
+		mroute->inbound = mroute_get_vif_by_name(arg);
+	else
+		mroute->inbound = mroute_find_vif_by_name(arg);
+	if (!*arg || mroute->inbound < 0)
 		return "Invalid input interface";
 
-	/* get origin */
+	/* get origin with optional prefix length, /0 is any source */
 	arg += strlen(arg) + 1;
+	ptr = strchr(arg, '/');
+	if (ptr) {
+		*ptr++ = 0;
+		mroute->src_len = atoi(ptr);
+		if (mroute->src_len < 0 || mroute->src_len > 32)
+			return "Invalid source prefix length (/LEN), must be 0-32";
+	}
 	if (!*arg || (inet_pton(AF_INET, arg, &mroute->sender) <= 0))
 		return "Invalid origin IPv4 address";
+	if (ptr) {
+		if (!mroute->src_len)
+			mroute->sender.s_addr = INADDR_ANY;
+		if (mroute->src_len == 32)
+			mroute->src_len = 0;
+		arg = ptr;
+	}
 
 	/* get multicast group with optional prefix length */
 	arg += strlen(arg) + 1;
 
-	/* check for prefix length, only applicable for (*,G) routes */
+	/* check for prefix length, a GROUP/LEN route is a (*,G) rule */
 	ptr = strchr(arg, '/');
 	if (ptr) {
-		if (mroute->sender.s_addr != INADDR_ANY)
-			return "GROUP/LEN not yet supported for source specific multicast.";
-
 		*ptr++ = 0;
 		mroute->len = atoi(ptr);
 		if (mroute->len < 0 || mroute->len > 32)
@@ -189,7 +226,7 @@ const char *msg_to_mroute4(struct mroute4 *mroute, const struct ipc_msg *msg)
 		for (arg += strlen(arg) + 1; *arg; arg += strlen(arg) + 1) {
 			int vif;
 
-			if ((vif = iface_get_vif_by_name(arg)) < 0)
+			if ((vif = mroute_get_vif_by_name(arg)) < 0)
 				return "Invalid output interface";
 
 			if (vif == mroute->inbound)
@@ -204,26 +241,58 @@ const char *msg_to_mroute4(struct mroute4 *mroute, const struct ipc_msg *msg)
 
 const char *msg_to_mroute6(struct mroute6 *mroute, const struct ipc_msg *msg)
 {
-	const char *arg = (const char *)(msg + 1);
+	char *ptr;
+	char *arg = (char *)(msg + 1);
 
 	memset(mroute, 0, sizeof(*mroute));
 
-	/* get input interface index */
-	if (!*arg || (mroute->inbound = iface_get_mif_by_name(arg)) < 0)
+	/* get input interface index, only set up a MIF to add a route */
+	if (msg->cmd == 'a')
+		mroute->inbound = mroute_get_mif_by_name(arg);
+	else
+		mroute->inbound = mroute_find_mif_by_name(arg);
+	if (!*arg || mroute->inbound < 0)
 		return "Invalid input interface";
 
-	/* get origin */
+	/* get origin with optional prefix length, /0 is any source */
 	arg += strlen(arg) + 1;
+	ptr = strchr(arg, '/');
+	if (ptr) {
+		*ptr++ = 0;
+		mroute->src_len = atoi(ptr);
+		if (mroute->src_len < 0 || mroute->src_len > 128)
+			return "Invalid source prefix length (/LEN), must be 0-128";
+	}
 	if (!*arg || (inet_pton(AF_INET6, arg, &mroute->sender.sin6_addr) <= 0))
 		return "Invalid origin IPv6 address";
+	if (ptr) {
+		if (!mroute->src_len)
+			mroute->sender.sin6_addr = in6addr_any;
+		if (mroute->src_len == 128)
+			mroute->src_len = 0;
+		arg = ptr;
+	}
 
-	/* get multicast group */
+	/* get multicast group with optional prefix length */
 	arg += strlen(arg) + 1;
 
+	/* check for prefix length, a GROUP/LEN route is a (*,G) rule */
+	ptr = strchr(arg, '/');
+	if (ptr) {
+		*ptr++ = 0;
+		mroute->len = atoi(ptr);
+		if (mroute->len < 0 || mroute->len > 128)
+			return "Invalid prefix length (/LEN), must be 0-128";
+	}
+
 	if (!*arg || (inet_pton(AF_INET6, arg, &mroute->group.sin6_addr) <= 0)
 	    || !IN6_IS_ADDR_MULTICAST(&mroute->group.sin6_addr))
 		return "Invalid multicast group";
 
+	/* adjust arg if we just parsed a GROUP/LEN argument */
+	if (ptr)
+		arg = ptr;
+
 	/*
 	 * Scan output interfaces for the 'add' command only, just ignore it
 	 * for the 'remove' command to be compatible to the first release.
@@ -232,7 +301,7 @@ const char *msg_to_mroute6(struct mroute6 *mroute, const struct ipc_msg *msg)
 		for (arg += strlen(arg) + 1; *arg; arg += strlen(arg) + 1) {
 			int mif;
 
-			if ((mif = iface_get_mif_by_name(arg)) < 0)
+			if ((mif = mroute_get_mif_by_name(arg)) < 0)
 				return "Invalid output interface";
 
 			if (mif == mroute->inbound)
@@ -10,7 +10,7 @@
 
 struct ipc_msg {
 	size_t   len;		/* total size of packet including cmd header */
-	uint16_t cmd;		/* 'a'=Add,'r'=Remove,'j'=Join,'l'=Leave,'k'=Kill */
+	uint16_t cmd;		/* 'a'=Add,'r'=Remove,'j'=Join,'l'=Leave,'k'=Kill,'w'=Watch */
 	uint16_t count;		/* command argument count */
 	char    *argv[0]; 	/* 'count' * '\0' terminated strings + '\0' */
 };
@@ -0,0 +1,315 @@
+/* Linux rtnetlink interface monitor
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The interface list is loaded with one RTM_GETLINK and one RTM_GETADDR
+ * dump, and then kept up to date with RTNLGRP_LINK and RTNLGRP_IPV4_IFADDR
+ * notifications.  Interfaces that are added, renamed, or removed, links
+ * going up or down, and new IPv6 addresses, from RTNLGRP_IPV6_IFADDR,
+ * are reported to the daemon after NETLINK_SETTLE msec, so a burst of
+ * changes, e.g., hundreds of VLAN interfaces set up by a script, is
+ * handled in one go.
+ */
+
+#include "mclab.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "event.h"
+#include "ifvc.h"
+
+#define NETLINK_BUFSIZ 32768
+#define NETLINK_SETTLE 100	/* msec */
+
+static int    nl_sd    = -1;
+static int    nl_timer = -1;
+static void (*nl_cb)(void);
+static uint32_t nl_seq;
+
+static int parse_link(struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *rta;
+	const char *ifname = NULL;
+	int len;
+
+	if (nlh->nlmsg_type == RTM_DELLINK)
+		return iface_remove(ifi->ifi_index);
+
+	len = IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			ifname = RTA_DATA(rta);
+	}
+	if (!ifname)
+		return 0;
+
+	return iface_update(ifi->ifi_index, ifname, ifi->ifi_flags);
+}
+
+/* Returns 1 for a new IPv6 address, joins and MIFs may now succeed */
+static int parse_addr(struct nlmsghdr *nlh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+	struct in_addr *addr = NULL;
+	struct rtattr *rta;
+	int len;
+
+	if (ifa->ifa_family == AF_INET6)
+		return nlh->nlmsg_type == RTM_NEWADDR;
+	if (ifa->ifa_family != AF_INET)
+		return 0;
+
+	len = IFA_PAYLOAD(nlh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		/* Local address, or peer address on point-to-point links */
+		if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !addr))
+			addr = RTA_DATA(rta);
+	}
+	if (!addr)
+		return 0;
+
+	iface_update_addr(ifa->ifa_index, *addr, nlh->nlmsg_type == RTM_NEWADDR);
+
+	return 0;
+}
+
+/* Returns 1 if an interface was added, renamed, removed, or changed */
+static int parse(struct nlmsghdr *nlh)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		return parse_link(nlh);
+
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		return parse_addr(nlh);
+	}
+
+	return 0;
+}
+
+static int request(int sd, int type, int family)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg gen;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.gen));
+	req.nlh.nlmsg_type  = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq   = ++nl_seq;
+	req.gen.rtgen_family = family;
+
+	if (send(sd, &req, req.nlh.nlmsg_len, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Read reply to request(), until done */
+static int reply(int sd, char *buf, size_t len)
+{
+	while (1) {
+		struct nlmsghdr *nlh;
+		ssize_t num;
+
+		num = recv(sd, buf, len, 0);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!num) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, num); nlh = NLMSG_NEXT(nlh, num)) {
+			if (nlh->nlmsg_seq != nl_seq)
+				continue;
+
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				errno = -err->error;
+				return -1;
+			}
+
+			parse(nlh);
+		}
+	}
+}
+
+/**
+ * netlink_dump - Load all interfaces and their IPv4 addresses
+ *
+ * Called by iface_init() to (re)load the interface list.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int netlink_dump(void)
+{
+	char *buf;
+	int sd, rc = -1;
+
+	buf = malloc(NETLINK_BUFSIZ);
+	if (!buf)
+		return -1;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd < 0)
+		goto done;
+
+	if (request(sd, RTM_GETLINK, AF_UNSPEC) || reply(sd, buf, NETLINK_BUFSIZ))
+		goto done;
+	if (request(sd, RTM_GETADDR, AF_INET) || reply(sd, buf, NETLINK_BUFSIZ))
+		goto done;
+	rc = 0;
+done:
+	if (sd >= 0) {
+		int tmp = errno;
+
+		close(sd);
+		errno = tmp;
+	}
+	free(buf);
+
+	return rc;
+}
+
+/* Interfaces have settled, tell the daemon */
+static void settle(int id, void *arg)
+{
+	(void)id;
+	(void)arg;
+
+	if (nl_cb)
+		nl_cb();
+}
+
+static void netlink_read(int sd, void *arg)
+{
+	static char buf[NETLINK_BUFSIZ];
+	int changed = 0;
+
+	(void)arg;
+
+	while (1) {
+		struct nlmsghdr *nlh;
+		ssize_t num;
+
+		num = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOBUFS)
+				break;
+
+			/* Events lost, start over */
+			smclog(LOG_WARNING, "Lost netlink events, reloading interfaces");
+			iface_init();
+			changed = 1;
+			continue;
+		}
+		if (!num)
+			break;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, num); nlh = NLMSG_NEXT(nlh, num))
+			changed |= parse(nlh);
+	}
+
+	if (changed)
+		event_timer_set(nl_timer, NETLINK_SETTLE, 0);
+}
+
+/**
+ * netlink_init - Monitor interfaces being added, renamed, removed, or going up/down
+ * @cb: Called when interfaces have changed
+ *
+ * Must be called before iface_init(), so no event is lost in between.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int netlink_init(void (*cb)(void))
+{
+	struct sockaddr_nl sa;
+
+	nl_sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (nl_sd < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	sa.nl_groups |= RTMGRP_IPV6_IFADDR;
+#endif
+	if (bind(nl_sd, (struct sockaddr *)&sa, sizeof(sa)))
+		goto fail;
+
+	nl_timer = event_timer_add(settle, NULL);
+	if (nl_timer < 0)
+		goto fail;
+
+	if (event_add(nl_sd, netlink_read, NULL))
+		goto fail;
+	nl_cb = cb;
+
+	return 0;
+fail:
+	netlink_exit();
+	return -1;
+}
+
+/**
+ * netlink_exit - Stop monitoring interfaces
+ */
+void netlink_exit(void)
+{
+	if (nl_timer >= 0)
+		event_timer_del(nl_timer);
+	nl_timer = -1;
+
+	if (nl_sd >= 0) {
+		event_del(nl_sd);
+		close(nl_sd);
+	}
+	nl_sd = -1;
+	nl_cb = NULL;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
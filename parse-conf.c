@@ -19,63 +19,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 
 #include "ifvc.h"
 #include "mclab.h"
 
-#define MAX_LINE_LEN 512
+#define MAX_LINE_LEN 2048
 #define WARN(fmt, args...)			\
-	smclog(LOG_WARNING, 0, "%02d: " fmt, lineno, ##args)
-
-extern char *script_exec;
-
-
-int run_script(struct mroute *mroute)
-{
-	int status;
-	pid_t pid;
-
-	char *argv[] = {
-		script_exec,
-		"reload",
-		NULL,
-	};
-
-	if (!script_exec)
-		return 0;
-
-	if (mroute) {
-		char source[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
-
-		if (mroute->version == 4) {
-			inet_ntop(AF_INET, &mroute->u.mroute4.sender.s_addr, source, INET_ADDRSTRLEN);
-			inet_ntop(AF_INET, &mroute->u.mroute4.group.s_addr, group, INET_ADDRSTRLEN);
-		} else {
-			inet_ntop(AF_INET6, &mroute->u.mroute6.sender.sin6_addr, source, INET_ADDRSTRLEN);
-			inet_ntop(AF_INET6, &mroute->u.mroute6.group.sin6_addr, group, INET_ADDRSTRLEN);
-		}
-
-		setenv("source", source, 1);
-		setenv("group", group, 1);
-		argv[1] = "install";
-	} else {
-		unsetenv("source");
-		unsetenv("group");
-	}
-
-	pid = fork();
-	if (-1 == pid)
-		return -1;
-	if (0 == pid)
-		_exit(execv(argv[0], argv));
-	waitpid(pid, &status, 0);
-
-	if (WIFEXITED(status))
-		return 0;
-
-	return WEXITSTATUS(status);
-}
+	smclog(LOG_WARNING, "%02d: " fmt, lineno, ##args)
+
+/* One line of the .conf file, all tokens point into buf[] */
+struct conf {
+	TAILQ_ENTRY(conf) link;
+
+	int   lineno;
+	int   op;		/* 1: mgroup, 2: mroute, 3: phyint */
+	int   enable;
+	int   threshold;
+	int   vif;		/* Pinned VIF/MIF, or -1 */
+	int   mif;
+	char *ifname;
+	char *source;
+	int   exclude;	/* source is excluded, mgroup */
+	char *group;
+	char *except[32];	/* sources excluded, mroute */
+	int   num_except;
+	char *dest[32];
+	int   num;
+
+	char  buf[MAX_LINE_LEN];
+};
+
+TAILQ_HEAD(conf_list, conf);
+
+/* The .conf file last read, for parse_conf_reapply() */
+static struct conf_list conf_list = TAILQ_HEAD_INITIALIZER(conf_list);
 
 static char *pop_token(char **line)
 {
@@ -118,7 +95,7 @@ static int match(char *keyword, char *token)
 	return !strncmp(keyword, token, len);
 }
 
-static int join_mgroup(int lineno, char *ifname, char *source, char *group)
+static int join_mgroup(int lineno, char *ifname, char *source, int exclude, char *group)
 {
 	int result;
 
@@ -132,23 +109,30 @@ static int join_mgroup(int lineno, char *ifname, char *source, char *group)
 		WARN("Ignored, IPv6 disabled.");
 		result = 0;
 #else
+		struct in6_addr src;
 		struct in6_addr grp;
 
-		if (source)
-			WARN("IPv6 is not (yet) supported for Source Specific Multicast.");
+		if (!source) {
+			src = in6addr_any;
+		} else if (inet_pton(AF_INET6, source, &src) <= 0) {
+			WARN("Invalid IPv6 multicast source: %s", source);
+			return 1;
+		}
 
 		if (inet_pton(AF_INET6, group, &grp) <= 0 || !IN6_IS_ADDR_MULTICAST(&grp)) {
 			WARN("Invalid IPv6 multicast group: %s", group);
 			return 1;
 		}
 
-		result = mcgroup6_join(ifname, grp);
+		result = mcgroup6_join(ifname, src, grp, exclude, 1);
 #endif
 	} else {
 		struct in_addr src;
 		struct in_addr grp;
 
-		if ((inet_pton(AF_INET, source, &src) <= 0)) {
+		if (!source) {
+			src.s_addr = INADDR_ANY;
+		} else if (inet_pton(AF_INET, source, &src) <= 0) {
 			WARN("Invalid IPv4 multicast source: %s", source);
 			return 1;
 		}
@@ -158,23 +142,44 @@ static int join_mgroup(int lineno, char *ifname, char *source, char *group)
 			return 1;
 		}
 
-		result = mcgroup4_join(ifname, src, grp);
+		result = mcgroup4_join(ifname, src, grp, exclude, 1);
 	}
 
 	return result;
 }
 
-static int add_mroute(int lineno, char *ifname, char *group, char *source, char *outbound[], int num)
+/* Split ADDR/LEN in place, returns LEN, or @max if there is none */
+static int prefix_len(char *addr, int max)
 {
-	int i, total, ret;
 	char *ptr;
+
+	ptr = strchr(addr, '/');
+	if (!ptr)
+		return max;
+
+	*ptr++ = 0;
+	if (!isdigit(*ptr))
+		return -1;
+
+	return atoi(ptr);
+}
+
+static int add_mroute(int lineno, char *ifname, char *prefix, char *source, char *except[], int num_except,
+		      char *outbound[], int num)
+{
+	int i, total, ret, len;
+	char *ptr, group[INET6_ADDRSTRLEN + 5], origin[INET6_ADDRSTRLEN + 5], addr[INET6_ADDRSTRLEN + 5];
 	struct mroute4 mroute;
 
-	if (!ifname || !group || !outbound || !num) {
+	if (!ifname || !prefix || !outbound || !num) {
 		errno = EINVAL;
 		return 1;
 	}
 
+	/* Split GROUP/LEN and SOURCE/LEN in a copy, the line is kept for reapply */
+	snprintf(group, sizeof(group), "%s", prefix);
+	snprintf(origin, sizeof(origin), "%s", source ? source : "");
+
 	if (strchr(group, ':')) {
 #if !defined(HAVE_IPV6_MULTICAST_HOST) || !defined(HAVE_IPV6_MULTICAST_ROUTING)
 		WARN("Ignored, IPv6 disabled.");
@@ -183,14 +188,37 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 		struct mroute6 mroute;
 
 		memset(&mroute, 0, sizeof(mroute));
-		mroute.inbound = iface_get_mif_by_name(ifname);
+		mroute.inbound = mroute_get_mif_by_name(ifname);
 		if (mroute.inbound < 0) {
 			WARN("Invalid inbound IPv6 interface: %s", ifname);
 			return 1;
 		}
-		if (!source || inet_pton(AF_INET6, source, &mroute.sender.sin6_addr) <= 0) {
-			WARN("Invalid source IPv6 address: %s", source ?: "NONE");
-			return 1;
+		if (source) {
+			len = prefix_len(origin, 128);
+			if (len < 0 || len > 128) {
+				WARN("Invalid source prefix length: %s", source);
+				return 1;
+			}
+			if (inet_pton(AF_INET6, origin, &mroute.sender.sin6_addr) <= 0) {
+				WARN("Invalid source IPv6 address: %s", source);
+				return 1;
+			}
+
+			/* SOURCE/0 is any source */
+			if (!len)
+				mroute.sender.sin6_addr = in6addr_any;
+			else if (len < 128)
+				mroute.src_len = len;
+		}
+
+		ptr = strchr(group, '/');
+		if (ptr) {
+			*ptr++ = 0;
+			mroute.len = atoi(ptr);
+			if (mroute.len < 0 || mroute.len > 128) {
+				WARN("Invalid prefix length, %s/%d", group, mroute.len);
+				return 1;
+			}
 		}
 
 		if (inet_pton(AF_INET6, group, &mroute.group.sin6_addr) <= 0 || !IN6_IS_ADDR_MULTICAST(&mroute.group.sin6_addr)) {
@@ -203,7 +231,7 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 			struct iface *iface;
 
 			iface = iface_find_by_name(outbound[i]);
-			if (!iface || iface->mif == -1) {
+			if (!iface || mroute_get_mif_by_name(iface->name) == -1) {
 				total--;
 				WARN("Invalid outbound IPv6 interface: %s", outbound[i]);
 				continue; /* Try next, if any. */
@@ -221,12 +249,32 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 			return 1;
 		}
 
+		if (num_except && !IN6_IS_ADDR_UNSPECIFIED(&mroute.sender.sin6_addr) && !mroute.len && !mroute.src_len) {
+			WARN("Cannot exclude sources from (S,G) route, skipping multicast route.");
+			return 1;
+		}
+
+		/* Last, the rule owns the excluded sources from here on */
+		for (i = 0; i < num_except; i++) {
+			struct in6_addr src;
+
+			snprintf(addr, sizeof(addr), "%s", except[i]);
+			len = prefix_len(addr, 128);
+			if (len < 0 || len > 128 || inet_pton(AF_INET6, addr, &src) <= 0) {
+				WARN("Invalid IPv6 source to exclude: %s", except[i]);
+				continue;
+			}
+
+			if (mroute6_except(&mroute, &src, len))
+				WARN("Failed excluding source %s: %s", except[i], strerror(errno));
+		}
+
 		return mroute6_add(&mroute);
 #endif
 	}
 
 	memset(&mroute, 0, sizeof(mroute));
-	mroute.inbound = iface_get_vif_by_name(ifname);
+	mroute.inbound = mroute_get_vif_by_name(ifname);
 	if (mroute.inbound < 0) {
 		WARN("Invalid inbound IPv4 interface: %s", ifname);
 		return 1;
@@ -234,18 +282,26 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 
 	if (!source) {
 		mroute.sender.s_addr = INADDR_ANY;
-	} else if (inet_pton(AF_INET, source, &mroute.sender) <= 0) {
-		WARN("Invalid source IPv4 address: %s", source);
-		return 1;
+	} else {
+		len = prefix_len(origin, 32);
+		if (len < 0 || len > 32) {
+			WARN("Invalid source prefix length: %s", source);
+			return 1;
+		}
+		if (inet_pton(AF_INET, origin, &mroute.sender) <= 0) {
+			WARN("Invalid source IPv4 address: %s", source);
+			return 1;
+		}
+
+		/* SOURCE/0 is any source */
+		if (!len)
+			mroute.sender.s_addr = INADDR_ANY;
+		else if (len < 32)
+			mroute.src_len = len;
 	}
 
 	ptr = strchr(group, '/');
 	if (ptr) {
-		if (mroute.sender.s_addr != INADDR_ANY) {
-			WARN("GROUP/LEN not yet supported for source specific multicast.");
-			return 1;
-		}
-
 		*ptr++ = 0;
 		mroute.len = atoi(ptr);
 		if (mroute.len < 0 || mroute.len > 32) {
@@ -265,7 +321,7 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 		struct iface *iface;
 
 		iface = iface_find_by_name(outbound[i]);
-		if (!iface || iface->vif == -1) {
+		if (!iface || mroute_get_vif_by_name(iface->name) == -1) {
 			total--;
 			WARN("Invalid outbound IPv4 interface: %s", outbound[i]);
 			continue; /* Try next, if any. */
@@ -283,68 +339,79 @@ static int add_mroute(int lineno, char *ifname, char *group, char *source, char
 		return 1;
 	}
 
+	if (num_except && mroute.sender.s_addr != INADDR_ANY && !mroute.len && !mroute.src_len) {
+		WARN("Cannot exclude sources from (S,G) route, skipping multicast route.");
+		return 1;
+	}
+
+	/* Last, the rule owns the excluded sources from here on */
+	for (i = 0; i < num_except; i++) {
+		struct in_addr src;
+
+		snprintf(addr, sizeof(addr), "%s", except[i]);
+		len = prefix_len(addr, 32);
+		if (len < 0 || len > 32 || inet_pton(AF_INET, addr, &src) <= 0) {
+			WARN("Invalid IPv4 source to exclude: %s", except[i]);
+			continue;
+		}
+
+		if (mroute4_except(&mroute, src, len))
+			WARN("Failed excluding source %s: %s", except[i], strerror(errno));
+	}
+
 	return mroute4_add(&mroute);
 }
 
-/**
- * parse_conf_file - Parse smcroute.conf
- * @file: File name to parse
- *
- * This function parses the given @file according to the below format rules.
- * Joins multicast groups and creates multicast routes accordingly in the
- * kernel.
- *
- * Format:
- *    phyint IFNAME <enable|disable> [threshold <1-255>]
- *    mgroup from IFNAME group MCGROUP
- *    ssmgroup from IFNAME group MCGROUP source SOURCE
- *    mroute from IFNAME source ADDRESS group MCGROUP to IFNAME [IFNAME ...]
- */
-int parse_conf_file(const char *file)
+/* Read all lines of the .conf file to @list, the new desired state */
+static int conf_read(FILE *fp, struct conf_list *list)
 {
 	int lineno = 1;
-	char *linebuf, *line;
-	FILE *fp = fopen(file, "r");
-
-	if (!fp)
-		return 1;
-
-	linebuf = malloc(MAX_LINE_LEN * sizeof(char));
-	if (!linebuf) {
-		int tmp = errno;
+	struct conf *conf = NULL;
+	char *line;
 
-		fclose(fp);
-		errno = tmp;
+	while (1) {
+		char *token;
 
-		return 1;
-	}
+		if (!conf) {
+			conf = malloc(sizeof(*conf));
+			if (!conf)
+				return 1;
+		}
 
-	while ((line = fgets(linebuf, MAX_LINE_LEN, fp))) {
-		int   op = 0, num = 0;
-		int   enable = do_vifs, threshold = DEFAULT_THRESHOLD;
-		char *token;
-		char *ifname = NULL;
-		char *source = NULL;
-		char *group  = NULL;
-		char *dest[32];
+		line = fgets(conf->buf, sizeof(conf->buf), fp);
+		if (!line)
+			break;
+
+		conf->lineno    = lineno;
+		conf->op        = 0;
+		conf->num       = 0;
+		conf->enable    = do_vifs;
+		conf->threshold = DEFAULT_THRESHOLD;
+		conf->vif       = -1;
+		conf->mif       = -1;
+		conf->ifname    = NULL;
+		conf->source    = NULL;
+		conf->exclude   = 0;
+		conf->group     = NULL;
+		conf->num_except = 0;
 
 		while ((token = pop_token(&line))) {
 			/* Strip comments. */
 			if (match("#", token))
 				break;
 
-			if (!op) {
+			if (!conf->op) {
 				if (match("mgroup", token)) {
-					op = 1;
+					conf->op = 1;
 				} else if (match("mroute", token)) {
-					op = 2;
+					conf->op = 2;
 				} else if (match("phyint", token)) {
-					op = 3;
-					ifname = pop_token(&line);
-					if (!ifname)
-						op = 0;
+					conf->op = 3;
+					conf->ifname = pop_token(&line);
+					if (!conf->ifname)
+						conf->op = 0;
 				} else if (match("ssmgroup", token)) {
-					op = 1; /* Compat */
+					conf->op = 1; /* Compat */
 				} else {
 					WARN("Unknown command %s, skipping.", token);
 					continue;
@@ -352,54 +419,197 @@ int parse_conf_file(const char *file)
 			}
 
 			if (match("from", token)) {
-				ifname = pop_token(&line);
+				conf->ifname = pop_token(&line);
 			} else if (match("source", token)) {
-				source = pop_token(&line);
+				conf->source = pop_token(&line);
+			} else if (match("exclude", token) && conf->op == 1) {
+				conf->source  = pop_token(&line);
+				conf->exclude = conf->source != NULL;
+			} else if (match("except", token) && conf->op == 2) {
+				if (conf->num_except >= (int)NELEMS(conf->except)) {
+					WARN("Too many except, max %zu, skipping multicast route.", NELEMS(conf->except));
+					conf->op = 0;
+					break;
+				}
+				if ((conf->except[conf->num_except] = pop_token(&line)))
+					conf->num_except++;
 			} else if (match("group", token)) {
-				group = pop_token(&line);
+				conf->group = pop_token(&line);
 			} else if (match("to", token)) {
-				while ((dest[num] = pop_token(&line)))
-					num++;
+				while (conf->num < (int)NELEMS(conf->dest) && (conf->dest[conf->num] = pop_token(&line)))
+					conf->num++;
 			} else if (match("enable", token)) {
-				enable = 1;
+				conf->enable = 1;
 			} else if (match("disable", token)) {
-				enable = 0;
+				conf->enable = 0;
 			} else if (match("ttl-threshold", token)) {
 				token = pop_token(&line);
 				if (token) {
 					int num = atoi(token);
 
 					if (num >= 1 || num <= 255)
-						threshold = num;
+						conf->threshold = num;
 				}
+			} else if (match("vif", token)) {
+				token = pop_token(&line);
+				if (token)
+					conf->vif = atoi(token);
+			} else if (match("mif", token)) {
+				token = pop_token(&line);
+				if (token)
+					conf->mif = atoi(token);
 			}
 		}
 
-		if (op == 1) {
-			join_mgroup(lineno, ifname, source, group);
-		} else if (op == 2) {
-			add_mroute(lineno, ifname, group, source, dest, num);
-		} else if (op == 3) {
-			if (enable)
-				mroute_add_vif(ifname, threshold);
-			else
-				mroute_del_vif(ifname);
+		/* Keep, or reuse for next line */
+		if (conf->op) {
+			TAILQ_INSERT_TAIL(list, conf, link);
+			conf = NULL;
 		}
-
 		lineno++;
 	}
+	free(conf);
+
+	return 0;
+}
+
+static void conf_free(struct conf_list *list)
+{
+	struct conf *conf;
+
+	while ((conf = TAILQ_FIRST(list))) {
+		TAILQ_REMOVE(list, conf, link);
+		free(conf);
+	}
+}
+
+/*
+ * With do_vifs all interfaces should have a VIF/MIF, unless disabled
+ * with a phyint line, otherwise only those enabled with a phyint line.
+ * Interfaces already set up like that are left as-is.  Pinned VIFs/MIFs
+ * are reserved first, also for interfaces not (yet) available.
+ */
+static void conf_vifs(struct conf_list *list)
+{
+	struct iface *iface;
+	struct conf *conf;
+
+	mroute_unpin_vifs();
+	TAILQ_FOREACH(conf, list, link) {
+		if (conf->op != 3 || !conf->enable)
+			continue;
+
+		mroute_pin_vif(conf->ifname, conf->vif, conf->mif);
+	}
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		int enable = do_vifs, threshold = DEFAULT_THRESHOLD, phyint = 0;
+
+		TAILQ_FOREACH(conf, list, link) {
+			if (conf->op != 3 || strcmp(conf->ifname, iface->name))
+				continue;
+
+			enable    = conf->enable;
+			threshold = conf->threshold;
+			phyint    = 1;
+		}
+
+		/* In lazy mode VIFs not enabled are set up on demand */
+		iface->disabled = phyint && !enable;
+		if (enable)
+			mroute_add_vif(iface->name, threshold);
+		else if (!lazy_vifs || iface->disabled)
+			mroute_del_vif(iface->name);
+	}
+}
 
-	free(linebuf);
+/* Set up VIFs, then join groups and add routes, as read to @list */
+static void conf_apply(struct conf_list *list)
+{
+	struct conf *conf;
+
+	conf_vifs(list);
+	TAILQ_FOREACH(conf, list, link) {
+		if (conf->op == 1)
+			join_mgroup(conf->lineno, conf->ifname, conf->source, conf->exclude, conf->group);
+		else if (conf->op == 2)
+			add_mroute(conf->lineno, conf->ifname, conf->group, conf->source,
+				   conf->except, conf->num_except, conf->dest, conf->num);
+	}
+
+	/* VIFs set up on demand for lines that failed */
+	mroute_reclaim_vifs();
+}
+
+/**
+ * parse_conf_file - Parse smcroute.conf
+ * @file: File name to parse
+ *
+ * This function parses the given @file according to the below format rules.
+ * Joins multicast groups and creates multicast routes accordingly in the
+ * kernel.
+ *
+ * The file is read in full before anything is changed, and is also used
+ * on reload.  Only the VIFs, routes and group memberships that differ
+ * from the current state are changed, so flows that are not affected by
+ * the change of the file are not disturbed at all.
+ *
+ * Format:
+ *    phyint IFNAME <enable|disable> [ttl-threshold <1-255>] [vif NUM] [mif NUM]
+ *    mgroup from IFNAME [source ADDRESS | exclude ADDRESS] group MCGROUP
+ *    ssmgroup from IFNAME group MCGROUP source SOURCE
+ *    mroute from IFNAME [source ADDRESS[/LEN]] [except ADDRESS[/LEN] ...] group MCGROUP[/LEN] to IFNAME [IFNAME ...]
+ */
+int parse_conf_file(const char *file)
+{
+	struct conf_list list = TAILQ_HEAD_INITIALIZER(list);
+	FILE *fp;
+	int rc;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return 1;
+
+	rc = conf_read(fp, &list);
 	fclose(fp);
+	if (rc) {
+		int tmp = errno;
+
+		conf_free(&list);
+		errno = tmp;
 
-	if (script_exec) {
-		if (run_script(NULL))
-			smclog(LOG_WARNING, 0, "Failed calling %s after (re)load of configuraion file.", script_exec);
+		return 1;
 	}
 
+	conf_free(&conf_list);
+	TAILQ_CONCAT(&conf_list, &list, link);
+
+	mroute_mark();
+	mcgroup_mark();
+	conf_apply(&conf_list);
+	mroute_sweep();
+	mcgroup_sweep();
+
+	if (run_script("reload", NULL))
+		smclog(LOG_WARNING, "Failed calling %s after (re)load of configuraion file.", script_exec);
+
 	return 0;
 }
 
+/**
+ * parse_conf_reapply - Apply the .conf file last read again
+ *
+ * Called when interfaces have been added or removed.  New interfaces
+ * get their VIF/MIF, and the group joins and routes using them are set
+ * up.  Routes added over IPC are kept, unlike on reload.
+ */
+void parse_conf_reapply(void)
+{
+	mcgroup_mark();
+	conf_apply(&conf_list);
+	mcgroup_sweep();
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
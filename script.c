@@ -0,0 +1,342 @@
+/* Asynchronous execution of the -e script
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The script is started with posix_spawn() and never waited for, the
+ * exit status is collected when SIGCHLD arrives in the event loop.  At
+ * most SCRIPT_MAX_RUNNING instances run at the same time, events that
+ * arrive while busy are queued, up to SCRIPT_MAX_QUEUED, and started
+ * in order as running instances exit.  So a slow script never stalls
+ * route installs or IPC.
+ *
+ * In batch mode, -b MSEC, route events are instead collected in a
+ * temporary file for MSEC milliseconds, starting with the first event.
+ * Then the script is called once, with all the events on stdin.  So a
+ * burst of hundreds of new routes only costs a single script call.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "event.h"
+#include "mclab.h"
+
+#define SCRIPT_MAX_RUNNING 4
+#define SCRIPT_MAX_QUEUED  256
+
+struct job {
+	TAILQ_ENTRY(job) link;
+
+	pid_t pid;
+	const char *action;	/* "install", "reload", or "batch" */
+	char  source[INET6_ADDRSTRLEN];
+	char  group[INET6_ADDRSTRLEN];
+	FILE *fp;		/* Events, for batch calls */
+};
+
+extern char **environ;
+
+static TAILQ_HEAD(, job) queued  = TAILQ_HEAD_INITIALIZER(queued);
+static TAILQ_HEAD(, job) running = TAILQ_HEAD_INITIALIZER(running);
+static size_t num_queued;
+static size_t num_running;
+static size_t num_dropped;
+
+int           script_batch = 0;
+static int    batch_timer  = -1;
+static FILE  *batch_fp;
+
+static void job_free(struct job *job)
+{
+	if (job->fp)
+		fclose(job->fp);
+	free(job);
+}
+
+static int spawn(struct job *job)
+{
+	char *argv[] = { script_exec, (char *)job->action, NULL };
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	int rc;
+
+	if (job->source[0]) {
+		setenv("source", job->source, 1);
+		setenv("group", job->group, 1);
+	} else {
+		unsetenv("source");
+		unsetenv("group");
+	}
+
+	/* Signals handled by the event loop are blocked, unblock */
+	sigemptyset(&mask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	/* Batch calls get the events on stdin */
+	posix_spawn_file_actions_init(&fa);
+	if (job->fp)
+		posix_spawn_file_actions_adddup2(&fa, fileno(job->fp), STDIN_FILENO);
+
+	rc = posix_spawn(&job->pid, script_exec, &fa, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if (job->fp) {
+		fclose(job->fp);
+		job->fp = NULL;
+	}
+	if (rc) {
+		smclog(LOG_WARNING, "Failed starting external script %s: %s", script_exec, strerror(rc));
+		return -1;
+	}
+
+	smclog(LOG_DEBUG, "Started %s %s, PID %d", script_exec, job->action, job->pid);
+
+	return 0;
+}
+
+/* Start queued jobs, in order, while below the limit */
+static void schedule(void)
+{
+	struct job *job;
+
+	while (num_running < SCRIPT_MAX_RUNNING && (job = TAILQ_FIRST(&queued))) {
+		TAILQ_REMOVE(&queued, job, link);
+		num_queued--;
+
+		if (spawn(job)) {
+			job_free(job);
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&running, job, link);
+		num_running++;
+	}
+
+	if (!num_queued && num_dropped) {
+		smclog(LOG_WARNING, "External script %s too slow, %zu events dropped.", script_exec, num_dropped);
+		num_dropped = 0;
+	}
+}
+
+/* Collect exit status of all exited scripts */
+static void reap(int signo, void *arg)
+{
+	struct job *job;
+	pid_t pid;
+	int status;
+
+	(void)signo;
+	(void)arg;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		TAILQ_FOREACH(job, &running, link) {
+			if (job->pid == pid)
+				break;
+		}
+		if (!job)
+			continue;
+
+		if (WIFEXITED(status) && WEXITSTATUS(status))
+			smclog(LOG_WARNING, "External script %s %s returned error code: %d",
+			       script_exec, job->action, WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+			smclog(LOG_WARNING, "External script %s %s killed by signal %d",
+			       script_exec, job->action, WTERMSIG(status));
+		else
+			smclog(LOG_DEBUG, "External script %s %s, PID %d, done.", script_exec, job->action, pid);
+
+		TAILQ_REMOVE(&running, job, link);
+		num_running--;
+		free(job);
+	}
+
+	schedule();
+}
+
+static int enqueue(struct job *job)
+{
+	if (num_queued >= SCRIPT_MAX_QUEUED) {
+		num_dropped++;
+		job_free(job);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	TAILQ_INSERT_TAIL(&queued, job, link);
+	num_queued++;
+	schedule();
+
+	return 0;
+}
+
+/* End of batch window, call script with all events collected */
+static void batch_run(int id, void *arg)
+{
+	struct job *job;
+
+	(void)id;
+	(void)arg;
+
+	if (!batch_fp)
+		return;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		smclog(LOG_WARNING, "Failed calling %s, dropping batch: %s", script_exec, strerror(errno));
+		fclose(batch_fp);
+		batch_fp = NULL;
+		return;
+	}
+
+	fflush(batch_fp);
+	rewind(batch_fp);
+	job->action = "batch";
+	job->fp     = batch_fp;
+	batch_fp    = NULL;
+
+	enqueue(job);
+}
+
+/* Add event to the current batch, starting a new window if needed */
+static int batch_add(const char *action, const char *source, const char *group)
+{
+	if (!batch_fp) {
+		batch_fp = tmpfile();
+		if (!batch_fp)
+			return -1;
+
+		/* Only the batch script should get it, as stdin */
+		fcntl(fileno(batch_fp), F_SETFD, FD_CLOEXEC);
+		event_timer_set(batch_timer, script_batch, 0);
+	}
+
+	if (source[0])
+		fprintf(batch_fp, "%s %s %s\n", action, source, group);
+	else
+		fprintf(batch_fp, "%s\n", action);
+
+	return 0;
+}
+
+/**
+ * script_init - Set up asynchronous script execution
+ *
+ * If the batch timer cannot be set up, batch mode is disabled and the
+ * script is called once per event instead.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int script_init(void)
+{
+	if (script_batch) {
+		batch_timer = event_timer_add(batch_run, NULL);
+		if (batch_timer < 0) {
+			smclog(LOG_WARNING, "Failed setting up batch timer, calling script per event: %s", strerror(errno));
+			script_batch = 0;
+		}
+	}
+
+	return event_signal(SIGCHLD, reap, NULL);
+}
+
+/**
+ * script_exit - Forget about queued and running scripts
+ *
+ * Running scripts are not waited for.
+ */
+void script_exit(void)
+{
+	struct job *job;
+
+	while ((job = TAILQ_FIRST(&queued))) {
+		TAILQ_REMOVE(&queued, job, link);
+		job_free(job);
+	}
+	while ((job = TAILQ_FIRST(&running))) {
+		TAILQ_REMOVE(&running, job, link);
+		job_free(job);
+	}
+	num_queued = num_running = 0;
+
+	if (batch_fp)
+		fclose(batch_fp);
+	batch_fp = NULL;
+}
+
+/**
+ * run_script - Call the -e script, without waiting for it
+ * @action: One of "install", "remove", or "reload"
+ * @mroute: Route installed or removed, %NULL for reload
+ *
+ * The script is called with @action and the route in the environment
+ * variables "source" and "group".  Route removals are only passed to
+ * the script in batch mode, see script_batch.
+ *
+ * In batch mode the script is called with "batch", and one line per
+ * event on stdin: the action, followed by source and group, if any.
+ *
+ * Returns:
+ * POSIX OK(0) if the script was started or queued, non-zero otherwise.
+ */
+int run_script(const char *action, struct mroute *mroute)
+{
+	struct job *job;
+
+	if (!script_exec)
+		return 0;
+	if (!script_batch && !strcmp(action, "remove"))
+		return 0;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+
+	job->action = action;
+	if (mroute) {
+		if (mroute->version == 4) {
+			inet_ntop(AF_INET, &mroute->u.mroute4.sender, job->source, sizeof(job->source));
+			inet_ntop(AF_INET, &mroute->u.mroute4.group, job->group, sizeof(job->group));
+		} else {
+			inet_ntop(AF_INET6, &mroute->u.mroute6.sender.sin6_addr, job->source, sizeof(job->source));
+			inet_ntop(AF_INET6, &mroute->u.mroute6.group.sin6_addr, job->group, sizeof(job->group));
+		}
+	}
+
+	if (script_batch) {
+		int rc = batch_add(action, job->source, job->group);
+
+		free(job);
+		return rc;
+	}
+
+	return enqueue(job);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
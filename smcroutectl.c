@@ -45,6 +45,7 @@ struct arg {
 	{ "remove",  3, 'r', NULL, NULL }, /* Alias for 'del' */
 	{ "join",    2, 'j', "Join multicast group on an interface", "eth0 225.1.2.3" },
 	{ "leave",   2, 'l', "Leave joined multicast group",         "eth0 225.1.2.3" },
+	{ "watch",   0, 'w', "Show route, VIF, and group events as they happen", NULL },
 	{ NULL, 0, 0, NULL, NULL }
 };
 
@@ -141,13 +142,22 @@ static int ipc_command(uint16_t cmd, char *argv[], size_t count)
 		goto error;
 	}
 
-	if (rlen != 1 || *buf != '\0') {
+	if (rlen < 1 || *buf != '\0' || (rlen != 1 && cmd != 'w')) {
 		buf[MX_CMDPKT_SZ] = 0;
 		warnx("Daemon error: %s", buf);
 		result = 1;
 		goto error;
 	}
 
+	/* Events follow the reply until the daemon exits, or we are killed */
+	if (cmd == 'w') {
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		do {
+			fwrite(buf + 1, 1, rlen - 1, stdout);
+			rlen = ipc_receive(buf + 1, MX_CMDPKT_SZ) + 1;
+		} while (rlen > 1);
+	}
+
 error:
 	ipc_exit();
 	free(msg);
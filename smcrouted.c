@@ -24,7 +24,6 @@
 #include "config.h"
 #include <stdio.h>
 #include <getopt.h>
-#include <sys/time.h>		/* gettimeofday() */
 #include <netinet/ip.h>
 
 #ifdef HAVE_LIBCAP
@@ -39,6 +38,7 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include "event.h"
 #include "ipc.h"
 #include "msg.h"
 #include "ifvc.h"
@@ -46,11 +46,17 @@
 
 #define SMCROUTE_SYSTEM_CONF "/etc/smcroute.conf"
 
-int running    = 1;
+#define UPCALL_SIZE   128	/* Upcalls are small, MLD/IGMP is truncated */
+#define UPCALL_BATCH  64	/* Messages per read_batch() */
+#define UPCALL_BUDGET 256	/* Messages per event loop round */
+
 int background = 1;
 int do_vifs    = 1;
+int lazy_vifs  = 0;
+int do_wildcard = 0;
 int do_syslog  = 1;
 int cache_tmo  = 0;
+int blackhole_tmo = 0;
 int startup_delay = 0;
 
 uid_t uid      = 0;
@@ -58,7 +64,7 @@ gid_t gid      = 0;
 
 char *prognm   = PACKAGE_NAME;
 
-const        char *script_exec  = NULL;
+char              *script_exec  = NULL;
 static const char *conf_file    = SMCROUTE_SYSTEM_CONF;
 static const char *username;
 static const char version_info[] = PACKAGE_NAME " v" PACKAGE_VERSION;
@@ -88,127 +94,287 @@ static void clean(void)
 	mcgroup4_disable();
 	mcgroup6_disable();
 #ifdef ENABLE_CLIENT
+	watch_exit();
 	ipc_exit();
 #endif
+	netlink_exit();
 	iface_exit();
+	script_exit();
+	upcall_exit();
+	event_exit();
 	smclog(LOG_NOTICE, "Exiting.");
 }
 
-static void restart(void)
+/*
+ * Read up to @num messages from @sd, without blocking, each truncated to
+ * UPCALL_SIZE bytes.  With recvmmsg() a whole batch is a single syscall.
+ * Returns the number of messages read, or -1 with errno set.
+ */
+static int read_batch(int sd, char buf[][UPCALL_SIZE], int *len, int num)
 {
-	mroute4_disable();
-	mroute6_disable();
-	mcgroup4_disable();
-	mcgroup6_disable();
-	/* No need to close the IPC, only at cleanup. */
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msg[UPCALL_BATCH];
+	struct iovec iov[UPCALL_BATCH];
+	int i;
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len  = UPCALL_SIZE;
+		msg[i].msg_hdr.msg_iov    = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	/* Update list of interfaces and create new virtual interface mappings in kernel. */
-	iface_init();
-	mroute4_enable();
-	mroute6_enable();
+	num = recvmmsg(sd, msg, num, MSG_DONTWAIT, NULL);
+	for (i = 0; i < num; i++)
+		len[i] = msg[i].msg_len;
+
+	return num;
+#else
+	int i;
+
+	for (i = 0; i < num; i++) {
+		len[i] = recv(sd, buf[i], UPCALL_SIZE, MSG_DONTWAIT);
+		if (len[i] < 0)
+			return i ? i : -1;
+	}
+
+	return num;
+#endif
 }
 
 /* Check for kernel IGMPMSG_NOCACHE for (*,G) hits. I.e., source-less routes. */
-static void read_mroute4_socket(void)
+static int decode_mroute4(char *buf, int len, struct mroute4 *mroute)
 {
-	int result;
-	char tmp[128];
 	struct ip *ip;
 	struct igmpmsg *igmpctl;
 
-	memset(tmp, 0, sizeof(tmp));
-	result = read(mroute4_socket, tmp, sizeof(tmp));
-	if (result < 0) {
-		smclog(LOG_WARNING, "Failed reading IGMP message from kernel: %s", strerror(errno));
-		return;
-	}
+	if (len < (int)sizeof(*igmpctl))
+		return -1;
 
 	/* packets sent up from kernel to daemon have ip->ip_p = 0 */
-	ip = (struct ip *)tmp;
-	igmpctl = (struct igmpmsg *)tmp;
-
-	/* Check for IGMPMSG_NOCACHE to do (*,G) based routing. */
-	if (ip->ip_p == 0 && igmpctl->im_msgtype == IGMPMSG_NOCACHE) {
-		struct iface *iface;
-		struct mroute4 mroute;
-		char origin[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN];
-
-		mroute.group.s_addr  = igmpctl->im_dst.s_addr;
-		mroute.sender.s_addr = igmpctl->im_src.s_addr;
-		mroute.inbound       = igmpctl->im_vif;
-
-		inet_ntop(AF_INET, &mroute.group,  group,  INET_ADDRSTRLEN);
-		inet_ntop(AF_INET, &mroute.sender, origin, INET_ADDRSTRLEN);
-		smclog(LOG_DEBUG, "New multicast data from %s to group %s on VIF %d", origin, group, mroute.inbound);
-
-		iface = iface_find_by_vif(mroute.inbound);
-		if (!iface) {
-			/* TODO: Add support for dynamically re-enumerating VIFs at runtime! */
-			smclog(LOG_WARNING, "No matching interface for VIF %d, cannot add mroute.", mroute.inbound);
-			return;
-		}
+	ip = (struct ip *)buf;
+	igmpctl = (struct igmpmsg *)buf;
+	if (ip->ip_p != 0 || igmpctl->im_msgtype != IGMPMSG_NOCACHE)
+		return -1;
 
-		/* Find any matching route for this group on that iif. */
-		result = mroute4_dyn_add(&mroute);
-		if (result) {
-			/* This is a common error, the router receives streams it is not
-			 * set up to route -- we ignore these by default, but if the user
-			 * sets a more permissive log level we help out by showing what
-			 * is going on. */
-			if (ENOENT == errno)
-				smclog(LOG_INFO, "Multicast from %s, group %s, VIF %d does not match any (*,G) rule",
-				       origin, group, mroute.inbound);
-			return;
+	memset(mroute, 0, sizeof(*mroute));
+	mroute->group.s_addr  = igmpctl->im_dst.s_addr;
+	mroute->sender.s_addr = igmpctl->im_src.s_addr;
+	mroute->inbound       = igmpctl->im_vif;
+
+	return 0;
+}
+
+static int handle_mroute4(struct mroute4 *mroute)
+{
+	int result;
+	struct iface *iface;
+	char origin[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &mroute->group,  group,  INET_ADDRSTRLEN);
+	inet_ntop(AF_INET, &mroute->sender, origin, INET_ADDRSTRLEN);
+	smclog(LOG_DEBUG, "New multicast data from %s to group %s on VIF %d", origin, group, mroute->inbound);
+
+	iface = iface_find_by_vif(mroute->inbound);
+	if (!iface) {
+		/* TODO: Add support for dynamically re-enumerating VIFs at runtime! */
+		smclog(LOG_WARNING, "No matching interface for VIF %d, cannot add mroute.", mroute->inbound);
+		return -1;
+	}
+
+	/* Find any matching route for this group on that iif. */
+	result = mroute4_dyn_add(mroute);
+	if (result) {
+		/* This is a common error, the router receives streams it is not
+		 * set up to route -- we ignore these by default, but if the user
+		 * sets a more permissive log level we help out by showing what
+		 * is going on. */
+		if (ENOENT == errno) {
+			smclog(LOG_INFO, "Multicast from %s, group %s, VIF %d does not match any (*,G) rule",
+			       origin, group, mroute->inbound);
+			watch_mroute4("miss", mroute);
+			return ENOENT;
 		}
+		return -1;
+	}
 
-		if (script_exec) {
-			int status;
-			struct mroute mrt;
+	if (script_exec) {
+		struct mroute mrt;
 
-			mrt.version = 4;
-			mrt.u.mroute4 = mroute;
-			status = run_script(&mrt);
-			if (status) {
-				if (status < 0)
-					smclog(LOG_WARNING, "Failed starting external script %s: %s", script_exec, strerror(errno));
-				else
-					smclog(LOG_WARNING, "External script %s returned error code: %d", script_exec, status);
-			}
+		/* Exit status is logged when the script is done */
+		mrt.version = 4;
+		mrt.u.mroute4 = *mroute;
+		run_script("install", &mrt);
+	}
+
+	return 0;
+}
+
+/*
+ * Drain the IGMP socket in batches, at most UPCALL_BUDGET messages per
+ * call so IPC and other events are not starved when a new feed with
+ * thousands of sources comes up.  Whatever is left is read on the next
+ * round of the event loop.
+ */
+static void read_mroute4_socket(int sd, void *arg)
+{
+	static char buf[UPCALL_BATCH][UPCALL_SIZE];
+	struct mroute4 mroute[UPCALL_BATCH];
+	int len[UPCALL_BATCH];
+	int budget = UPCALL_BUDGET;
+
+	(void)arg;
+	while (budget > 0) {
+		int i, num, cnt = 0;
+
+		num = read_batch(sd, buf, len, MIN(budget, UPCALL_BATCH));
+		if (num < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				smclog(LOG_WARNING, "Failed reading IGMP message from kernel: %s", strerror(errno));
+			break;
+		}
+
+		/* Drop duplicates, and shed upcalls above the rate of
+		 * their port, before doing any work on them */
+		for (i = 0; i < num; i++) {
+			if (!decode_mroute4(buf[i], len[i], &mroute[cnt]) && upcall_filter4(&mroute[cnt]))
+				cnt++;
 		}
+
+		for (i = 0; i < cnt; i++)
+			upcall_done4(&mroute[i], handle_mroute4(&mroute[i]));
+
+		budget -= num;
+		if (num < UPCALL_BATCH)
+			break;
 	}
 }
 
-/* Receive and drop ICMPv6 stuff. This is either MLD packets or upcall messages sent up from the kernel. */
+/*
+ * Receive ICMPv6 stuff.  The socket filter only lets upcall messages
+ * from the kernel through, but on systems without one this may also
+ * be MLD packets, which we drop.  Check for MRT6MSG_NOCACHE for (*,G)
+ * hits, i.e., source-less routes.
+ */
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
-static void read_mroute6_socket(void)
+static int decode_mroute6(char *buf, int len, struct mroute6 *mroute)
+{
+	struct mrt6msg *mrt6msg;
+
+	/* packets sent up from kernel to daemon have im6_mbz = 0,
+	 * which is never a valid ICMPv6 type */
+	mrt6msg = (struct mrt6msg *)buf;
+	if (len < (int)sizeof(*mrt6msg) || mrt6msg->im6_mbz != 0)
+		return -1;
+
+	if (mrt6msg->im6_msgtype != MRT6MSG_NOCACHE)
+		return -1;
+
+	memset(mroute, 0, sizeof(*mroute));
+	mroute->group.sin6_family  = AF_INET6;
+	mroute->group.sin6_addr    = mrt6msg->im6_dst;
+	mroute->sender.sin6_family = AF_INET6;
+	mroute->sender.sin6_addr   = mrt6msg->im6_src;
+	mroute->inbound            = mrt6msg->im6_mif;
+
+	return 0;
+}
+
+static int handle_mroute6(struct mroute6 *mroute)
 {
 	int result;
-	char tmp[128];
+	struct iface *iface;
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
 
-	if (mroute6_socket < 0)
-		return;
+	inet_ntop(AF_INET6, &mroute->group.sin6_addr,  group,  INET6_ADDRSTRLEN);
+	inet_ntop(AF_INET6, &mroute->sender.sin6_addr, origin, INET6_ADDRSTRLEN);
+	smclog(LOG_DEBUG, "New multicast data from %s to group %s on MIF %d", origin, group, mroute->inbound);
+
+	iface = iface_find_by_mif(mroute->inbound);
+	if (!iface) {
+		smclog(LOG_WARNING, "No matching interface for MIF %d, cannot add mroute.", mroute->inbound);
+		return -1;
+	}
+
+	/* Find any matching route for this group on that iif. */
+	result = mroute6_dyn_add(mroute);
+	if (result) {
+		if (ENOENT == errno) {
+			smclog(LOG_INFO, "Multicast from %s, group %s, MIF %d does not match any (*,G) rule",
+			       origin, group, mroute->inbound);
+			watch_mroute6("miss", mroute);
+			return ENOENT;
+		}
+		return -1;
+	}
+
+	if (script_exec) {
+		struct mroute mrt;
+
+		/* Exit status is logged when the script is done */
+		mrt.version = 6;
+		mrt.u.mroute6 = *mroute;
+		run_script("install", &mrt);
+	}
+
+	return 0;
+}
 
-	result = read(mroute6_socket, tmp, sizeof(tmp));
-	if (result < 0)
-		smclog(LOG_INFO, "Failed clearing MLD message from kernel: %s", strerror(errno));
+/* Same as read_mroute4_socket(), but for the ICMPv6 socket */
+static void read_mroute6_socket(int sd, void *arg)
+{
+	static char buf[UPCALL_BATCH][UPCALL_SIZE];
+	struct mroute6 mroute[UPCALL_BATCH];
+	int len[UPCALL_BATCH];
+	int budget = UPCALL_BUDGET;
+
+	(void)arg;
+	while (budget > 0) {
+		int i, num, cnt = 0;
+
+		num = read_batch(sd, buf, len, MIN(budget, UPCALL_BATCH));
+		if (num < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				smclog(LOG_INFO, "Failed clearing MLD message from kernel: %s", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < num; i++) {
+			if (!decode_mroute6(buf[i], len[i], &mroute[cnt]) && upcall_filter6(&mroute[cnt]))
+				cnt++;
+		}
+
+		for (i = 0; i < cnt; i++)
+			upcall_done6(&mroute[i], handle_mroute6(&mroute[i]));
+
+		budget -= num;
+		if (num < UPCALL_BATCH)
+			break;
+	}
 }
 #endif
 
 #ifdef ENABLE_CLIENT
 /* Receive command from the smcroutectl */
-static void read_ipc_command(void)
+static void read_ipc_command(int sd, void *arg)
 {
 	const char *str;
 	struct ipc_msg *msg;
 	struct mroute mroute;
 	char buf[MX_CMDPKT_SZ];
 
+	(void)arg;
 	memset(buf, 0, sizeof(buf));
-	msg = ipc_server_read(buf, sizeof(buf));
+	msg = ipc_server_read(sd, buf, sizeof(buf));
 	if (!msg) {
 		/* Skip logging client disconnects */
-		if (errno != ECONNRESET)
+		if (errno == ECONNRESET) {
+			event_del(sd);
+			ipc_server_close(sd);
+		} else {
 			smclog(LOG_WARNING, "Failed receving IPC message from client: %s", strerror(errno));
+		}
 		return;
 	}
 
@@ -216,6 +382,7 @@ static void read_ipc_command(void)
 	case 'a':
 	case 'r':
 		if ((str = msg_to_mroute(&mroute, msg))) {
+			mroute_reclaim_vifs();
 			smclog(LOG_WARNING, "%s", str);
 			ipc_send(log_message, strlen(log_message) + 1);
 			break;
@@ -245,10 +412,13 @@ static void read_ipc_command(void)
 	case 'j':
 	case 'l':
 	{
+		char *tok = (char *)msg->argv;
 		int result = -1;
 
+		/* Source, or group, decides the IP version */
 		str = msg->cmd == 'j' ? "join" : "leave";
-		if (strchr(msg->argv[1], ':')) {
+		tok += strlen(tok) + 1;
+		if (strchr(tok, ':')) {
 #ifndef HAVE_IPV6_MULTICAST_HOST
 			smclog(LOG_WARNING, "IPv6 multicast support disabled.");
 #else
@@ -260,9 +430,9 @@ static void read_ipc_command(void)
 				smclog(LOG_WARNING, "%s: Invalid IPv6 source our group address.", str);
 			} else {
 				if (msg->cmd == 'j')
-					result = mcgroup6_join(ifname, group);
+					result = mcgroup6_join(ifname, source, group, 0, 0);
 				else
-					result = mcgroup6_leave(ifname, group);
+					result = mcgroup6_leave(ifname, source, group);
 			}
 #endif /* HAVE_IPV6_MULTICAST_HOST */
 		} else {
@@ -274,7 +444,7 @@ static void read_ipc_command(void)
 				smclog(LOG_WARNING, "%s: Invalid IPv4 source our group address.", str);
 			} else {
 				if (msg->cmd == 'j')
-					result = mcgroup4_join(ifname, source, group);
+					result = mcgroup4_join(ifname, source, group, 0, 0);
 				else
 					result = mcgroup4_leave(ifname, source, group);
 			}
@@ -291,6 +461,18 @@ static void read_ipc_command(void)
 
 	case 'F':
 		mroute4_dyn_flush();
+		mroute6_dyn_flush();
+		ipc_send("", 1);
+		break;
+
+	case 'w':
+		/* From now on the connection is only used for events */
+		if (watch_add(sd)) {
+			smclog(LOG_WARNING, "Failed adding IPC watch client: %s", strerror(errno));
+			ipc_send(log_message, strlen(log_message) + 1);
+			break;
+		}
+
 		ipc_send("", 1);
 		break;
 
@@ -299,109 +481,77 @@ static void read_ipc_command(void)
 		exit(0);
 	}
 }
-#endif
 
-/*
- * Signal handler.  Take note of the fact that the signal arrived
- * so that the main loop can take care of it.
- */
-static void handler(int sig)
+/* New client connection, each client is served until it disconnects */
+static void accept_ipc_client(int sd, void *arg)
 {
-	switch (sig) {
-	case SIGINT:
-	case SIGTERM:
-		running = 0;
-		break;
-
-	case SIGHUP:
-		smclog(LOG_NOTICE, "Got SIGHUP, reloading %s ...", conf_file);
-		restart();
-		read_conf_file(conf_file);
+	(void)arg;
 
-		/* Acknowledge client SIGHUP by touching the pidfile */
-		pidfile(NULL, uid, gid);
-		break;
+	sd = ipc_server_accept();
+	if (sd < 0) {
+		smclog(LOG_WARNING, "Failed accepting IPC client: %s", strerror(errno));
+		return;
 	}
-}
 
-static void signal_init(void)
-{
-	struct sigaction sa;
-
-	sa.sa_handler = handler;
-	sa.sa_flags = 0;	/* Interrupt system calls */
-	sigemptyset(&sa.sa_mask);
-	sigaction(SIGHUP, &sa, NULL);
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGINT, &sa, NULL);
+	if (event_add(sd, read_ipc_command, NULL)) {
+		smclog(LOG_WARNING, "Failed watching IPC client: %s", strerror(errno));
+		ipc_server_close(sd);
+	}
 }
-
-static int server_loop(int sd)
-{
-	fd_set fds;
-
-#ifdef HAVE_IPV6_MULTICAST_ROUTING
-	int max_fd_num = MAX(sd, MAX(mroute4_socket, mroute6_socket));
-#else
-	int max_fd_num = MAX(sd, mroute4_socket);
 #endif
-	struct timeval now     = { 0 };
-	struct timeval timeout = { 0 }, *tmo = NULL;
-	struct timeval last_cache_flush = { 0 };
 
-	/* Watch the MRouter and the IPC socket to the smcroute client */
-	while (running) {
-		int result;
-
-		FD_ZERO(&fds);
-#ifdef ENABLE_CLIENT
-		FD_SET(sd, &fds);
-#endif
-		FD_SET(mroute4_socket, &fds);
+/* Watch the multicast routing sockets for kernel upcalls */
+static void mroute_event_add(void)
+{
+	if (mroute4_socket >= 0 && event_add(mroute4_socket, read_mroute4_socket, NULL))
+		smclog(LOG_WARNING, "Failed watching IPv4 multicast routing socket: %s", strerror(errno));
 #ifdef HAVE_IPV6_MULTICAST_ROUTING
-		if (-1 != mroute6_socket)
-			FD_SET(mroute6_socket, &fds);
+	if (mroute6_socket >= 0 && event_add(mroute6_socket, read_mroute6_socket, NULL))
+		smclog(LOG_WARNING, "Failed watching IPv6 multicast routing socket: %s", strerror(errno));
 #endif
+}
 
-		if (cache_tmo) {
-			gettimeofday(&now, NULL);
-			if (last_cache_flush.tv_sec != 0)
-				timeout.tv_sec -=  now.tv_sec - last_cache_flush.tv_sec;
-			if (timeout.tv_sec <= 0)
-				timeout.tv_sec = cache_tmo;
-			timeout.tv_usec = 0;
-			tmo = &timeout;
-		}
+/*
+ * Kernel routes, VIFs and group memberships are kept on reload, only
+ * what differs in the .conf file is changed when it is read again.
+ */
+static void restart(void)
+{
+	/* Resync list of interfaces, keeping their VIF/MIF mappings. */
+	iface_init();
+}
 
-		/* wait for input */
-		result = select(max_fd_num + 1, &fds, NULL, NULL, tmo);
-		if (result < 0) {
-			/* Log all errors, except when signalled, ignore failures. */
-			if (EINTR != errno)
-				smclog(LOG_WARNING, "Failed select() in %s(): %s", strerror(errno), __func__);
-			continue;
-		}
+/*
+ * Signal callbacks, called from the event loop, so it is safe to
+ * reload the configuration from here.
+ */
+static void handle_exit(int signo, void *arg)
+{
+	(void)signo;
+	(void)arg;
+	event_stop();
+}
 
-		if (cache_tmo && (last_cache_flush.tv_sec + cache_tmo < now.tv_sec)) {
-			last_cache_flush = now;
-			smclog(LOG_NOTICE, "Cache timeout, flushing all (*,G) routes!");
-			mroute4_dyn_flush();
-		}
+static void handle_reload(int signo, void *arg)
+{
+	(void)signo;
+	(void)arg;
 
-		if (FD_ISSET(mroute4_socket, &fds))
-			read_mroute4_socket();
+	smclog(LOG_NOTICE, "Got SIGHUP, reloading %s ...", conf_file);
+	upcall_stats();
+	restart();
+	read_conf_file(conf_file);
 
-#ifdef HAVE_IPV6_MULTICAST_ROUTING
-		if (-1 != mroute6_socket && FD_ISSET(mroute6_socket, &fds))
-			read_mroute6_socket();
-#endif
+	/* Acknowledge client SIGHUP by touching the pidfile */
+	pidfile(NULL, uid, gid);
+}
 
-#ifdef ENABLE_CLIENT
-		/* loop back to select if there is no smcroute command */
-		if (FD_ISSET(sd, &fds))
-			read_ipc_command();
-#endif
-	}
+static int signal_init(void)
+{
+	if (event_signal(SIGHUP, handle_reload, NULL) ||
+	    event_signal(SIGTERM, handle_exit, NULL) ||
+	    event_signal(SIGINT, handle_exit, NULL))
+		return -1;
 
 	return 0;
 }
@@ -504,7 +654,10 @@ static int drop_root(const char *user)
  * error code in the parent and the initscript will fail */
 static int start_server(void)
 {
-	int sd = 0, api = 2, busy = 0;
+	int api = 2, busy = 0;
+#ifdef ENABLE_CLIENT
+	int sd;
+#endif
 
 	/* Hello world! */
 	smclog(LOG_NOTICE, "%s", version_info);
@@ -514,8 +667,16 @@ static int start_server(void)
 		sleep(startup_delay);
 	}
 
-	/* Build list of multicast-capable physical interfaces that
-	 * are currently assigned an IP address. */
+	if (event_init()) {
+		smclog(LOG_INIT, "Failed setting up event loop: %s", strerror(errno));
+		exit(1);
+	}
+
+	/* Follow interface changes, then build list of interfaces.
+	 * New interfaces get the VIFs, joins and routes of the .conf
+	 * file without a reload. */
+	if (netlink_init(parse_conf_reapply))
+		smclog(LOG_WARNING, "Failed monitoring interfaces, changes need a reload: %s", strerror(errno));
 	iface_init();
 
 	if (mroute4_enable()) {
@@ -539,15 +700,23 @@ static int start_server(void)
 			smclog(LOG_INIT, "Kernel does not support multicast routing.");
 		exit(1);
 	}
+	mroute_event_add();
 
 #ifdef ENABLE_CLIENT
 	sd = ipc_server_init();
 	if (sd < 0)
 		smclog(LOG_WARNING, "Failed setting up IPC socket, client communication disabled: %s", strerror(errno));
+	else if (event_add(sd, accept_ipc_client, NULL))
+		smclog(LOG_WARNING, "Failed watching IPC socket, client communication disabled: %s", strerror(errno));
 #endif
 
 	atexit(clean);
-	signal_init();
+	if (signal_init())
+		smclog(LOG_WARNING, "Failed setting up signal handling: %s", strerror(errno));
+	if (script_exec && script_init())
+		smclog(LOG_WARNING, "Failed setting up script execution: %s", strerror(errno));
+	if (upcall_init())
+		smclog(LOG_WARNING, "Failed setting up upcall rate limiting: %s", strerror(errno));
 	read_conf_file(conf_file);
 
 	/* Everything setup, notify any clients by creating the pidfile */
@@ -564,15 +733,20 @@ static int start_server(void)
 	}
 #endif
 
-	return server_loop(sd);
+	return event_run();
 }
 
 
 static int usage(int code)
 {
-	printf("Usage: %s [hnNsv] [-c SEC] [-f FILE] [-e CMD] [-L LVL] [-t SEC]\n"
+	printf("Usage: %s [hnNsvwz] [-b MSEC] [-B SEC] [-c SEC] [-f FILE] [-e CMD] [-L LVL]\n"
+	       "                  [-r RATE[:BURST]] [-t SEC]\n"
 	       "\n"
-	       "  -c SEC          Flush dynamic (*,G) multicast routes every SEC seconds\n"
+	       "  -b MSEC         Batch calls to the -e script, collect route events for MSEC\n"
+	       "                  milliseconds, then call it once with the events on stdin\n"
+	       "  -B SEC          Set blackhole routes in the kernel for multicast not matching\n"
+	       "                  any (*,G) rule, remove when idle for SEC seconds\n"
+	       "  -c SEC          Remove dynamic (*,G) multicast routes idle for SEC seconds\n"
 	       "  -e CMD          Script or command to call on startup/reload when all routes\n"
 	       "                  have been installed. Or when a source-less (ANY) route has\n"
 	       "                  been installed.\n"
@@ -584,9 +758,17 @@ static int usage(int code)
 #ifdef HAVE_LIBCAP
 	       "  -p USER[:GROUP] After initialization set UID and GID to USER and GROUP\n"
 #endif
+	       "  -r RATE[:BURST] Handle at most RATE new source upcalls per second and\n"
+	       "                  inbound interface, with bursts of up to BURST, default\n"
+	       "                  RATE.  Excess upcalls are dropped and summarized in the log\n"
 	       "  -s              Use syslog, default unless running in foreground, -n\n"
 	       "  -t SEC          Startup delay, useful for delaying interface probe at boot\n"
 	       "  -v              Show program version\n"
+	       "  -w              Set single group (*,G) rules as kernel (*,G) routes, this\n"
+	       "                  forwards without any upcall for new sources, if supported\n"
+	       "                  by the kernel\n"
+	       "  -z              No VIFs/MIFs created by default, set up on demand for the\n"
+	       "                  interfaces used by routes, and remove when no longer used\n"
 	       "\n"
 	       "Bug report address: %s\n"
 	       "Project homepage: %s\n\n", prognm, PACKAGE_BUGREPORT, PACKAGE_URL);
@@ -609,13 +791,19 @@ int main(int argc, char *argv[])
 {
 	int c;
 	int log_opts = LOG_CONS | LOG_PID;
-#ifdef HAVE_LIBCAP
 	char *ptr;
-#endif
 
 	prognm = progname(argv[0]);
-	while ((c = getopt(argc, argv, "c:de:f:hL:nNp:st:v")) != EOF) {
+	while ((c = getopt(argc, argv, "b:B:c:de:f:hL:nNp:r:st:vwz")) != EOF) {
 		switch (c) {
+		case 'b':	/* batch script calls */
+			script_batch = atoi(optarg);
+			break;
+
+		case 'B':	/* blackhole unmatched flows */
+			blackhole_tmo = atoi(optarg);
+			break;
+
 		case 'c':	/* cache timeout */
 			cache_tmo = atoi(optarg);
 			break;
@@ -667,6 +855,13 @@ int main(int argc, char *argv[])
 			break;
 #endif
 
+		case 'r':	/* upcall rate limit */
+			upcall_rate = atoi(optarg);
+			ptr = strchr(optarg, ':');
+			if (ptr)
+				upcall_burst = atoi(++ptr);
+			break;
+
 		case 's':	/* Force syslog even though in foreground */
 			do_syslog++;
 			break;
@@ -679,6 +874,15 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s\n", version_info);
 			return 0;
 
+		case 'w':
+			do_wildcard = 1;
+			break;
+
+		case 'z':
+			do_vifs   = 0;
+			lazy_vifs = 1;
+			break;
+
 		default:	/* unknown option */
 			return usage(1);
 		}
@@ -0,0 +1,192 @@
+/* Hierarchical timer wheel for per-route timeouts
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The wheel has one second resolution and WHEEL_LEVELS levels of
+ * WHEEL_SLOTS slots each.  Level 0 holds timers expiring within the
+ * next 64 seconds, one slot per second, level 1 those within the next
+ * 64 * 64 seconds, and so on.  Every time level 0 wraps around, the
+ * next slot of level 1 is cascaded down, and likewise for the higher
+ * levels.  So starting or stopping a timer is O(1), and each tick only
+ * touches the timers actually expiring, or being cascaded.
+ *
+ * The wheel is ticked by a periodic event loop timer, which is only
+ * armed while there are timers running.
+ */
+
+#include <time.h>
+
+#include "event.h"
+#include "timer.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX    ((1U << (WHEEL_LEVELS * WHEEL_BITS)) - 1)
+
+/* Slot @expires falls into at @level */
+#define INDEX(expires, level) (((expires) >> ((level) * WHEEL_BITS)) & WHEEL_MASK)
+
+LIST_HEAD(tlist, timer);
+
+static struct tlist wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned int wheel_now;
+static size_t       wheel_count;
+static int          wheel_timer = -1;
+
+static unsigned int now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static void enqueue(struct timer *timer)
+{
+	unsigned int delta = timer->expires - wheel_now;
+	int level;
+
+	/* Already expired, run on next tick */
+	if ((int)delta < 0) {
+		timer->expires = wheel_now;
+		delta = 0;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < 1U << ((level + 1) * WHEEL_BITS))
+			break;
+	}
+
+	LIST_INSERT_HEAD(&wheel[level][INDEX(timer->expires, level)], timer, link);
+}
+
+/* Move all timers in a slot of @level to lower levels */
+static int cascade(int level)
+{
+	struct tlist *slot;
+	struct timer *timer;
+	int index = INDEX(wheel_now, level);
+
+	slot = &wheel[level][index];
+	while ((timer = LIST_FIRST(slot))) {
+		LIST_REMOVE(timer, link);
+		enqueue(timer);
+	}
+
+	return index;
+}
+
+/* Run all expired timers, ticks missed, e.g. if the system has been
+ * busy, are caught up with. */
+static void tick(int id, void *arg)
+{
+	unsigned int until = now();
+
+	(void)arg;
+
+	while (wheel_count && (int)(until - wheel_now) >= 0) {
+		struct tlist *slot;
+		struct timer *timer;
+		int index = INDEX(wheel_now, 0);
+		int level;
+
+		for (level = 1; !index && level < WHEEL_LEVELS; level++)
+			index = cascade(level);
+
+		slot = &wheel[0][INDEX(wheel_now, 0)];
+		while ((timer = LIST_FIRST(slot))) {
+			timer_stop(timer);
+			timer->cb(timer->arg);
+		}
+
+		wheel_now++;
+	}
+
+	if (!wheel_count) {
+		wheel_now = until;
+		event_timer_set(id, 0, 0);
+	}
+}
+
+/**
+ * timer_init - Set up a timer
+ * @timer: Pointer to a &struct timer, usually embedded in another object
+ * @cb:    Callback to run when the timer expires
+ * @arg:   Argument to @cb
+ */
+void timer_init(struct timer *timer, void (*cb)(void *arg), void *arg)
+{
+	timer->pending = 0;
+	timer->cb      = cb;
+	timer->arg     = arg;
+}
+
+/**
+ * timer_start - Start, or restart, a timer
+ * @timer: Pointer to a &struct timer
+ * @sec:   Timeout in seconds
+ *
+ * The timer is one-shot, the callback may restart it.
+ */
+void timer_start(struct timer *timer, unsigned int sec)
+{
+	timer_stop(timer);
+
+	if (!wheel_count) {
+		wheel_now = now();
+		if (wheel_timer < 0)
+			wheel_timer = event_timer_add(tick, NULL);
+		event_timer_set(wheel_timer, 1000, 1000);
+	}
+	if (!sec)
+		sec = 1;
+	if (sec > WHEEL_MAX)
+		sec = WHEEL_MAX;
+
+	timer->expires = wheel_now + sec;
+	timer->pending = 1;
+	enqueue(timer);
+	wheel_count++;
+}
+
+/**
+ * timer_stop - Stop a timer
+ * @timer: Pointer to a &struct timer
+ *
+ * Safe to call also on timers not running.
+ */
+void timer_stop(struct timer *timer)
+{
+	if (!timer->pending)
+		return;
+
+	LIST_REMOVE(timer, link);
+	timer->pending = 0;
+	wheel_count--;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,27 @@
+/* Hierarchical timer wheel for per-route timeouts */
+#ifndef SMCROUTE_TIMER_H_
+#define SMCROUTE_TIMER_H_
+
+#include "queue.h"
+
+struct timer {
+	LIST_ENTRY(timer) link;
+	unsigned int      expires;	/* Absolute time, in seconds */
+	int               pending;
+
+	void            (*cb)(void *arg);
+	void             *arg;
+};
+
+void timer_init  (struct timer *timer, void (*cb)(void *arg), void *arg);
+void timer_start (struct timer *timer, unsigned int sec);
+void timer_stop  (struct timer *timer);
+
+#endif /* SMCROUTE_TIMER_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
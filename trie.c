@@ -0,0 +1,263 @@
+/* Binary prefix trie for longest-prefix match of group/source rules
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Keys are addresses in network byte order, e.g. a struct in_addr or a
+ * struct in6_addr, and are consumed one bit at a time starting with the
+ * most significant bit.  So a lookup never takes more than 32 steps for
+ * IPv4 and 128 steps for IPv6, regardless of the number of prefixes.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "trie.h"
+
+/* Bit @pos, counting from the most significant bit, of @key */
+static inline int bit(const uint8_t *key, int pos)
+{
+	return (key[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+/* Remove data at @key/@len, if any, and free nodes no longer in use */
+static void prune(struct trie_node **node, const uint8_t *key, int pos, int len, void **data)
+{
+	struct trie_node *n = *node;
+
+	if (!n)
+		return;
+
+	if (pos == len) {
+		if (data)
+			*data = n->data;
+		n->data = NULL;
+	} else {
+		prune(&n->child[bit(key, pos)], key, pos + 1, len, data);
+	}
+
+	if (!n->data && !n->child[0] && !n->child[1]) {
+		free(n);
+		*node = NULL;
+	}
+}
+
+static int equal(const struct trie_node *a, const struct trie_node *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	if (!a->data != !b->data)
+		return 0;
+
+	return equal(a->child[0], b->child[0]) && equal(a->child[1], b->child[1]);
+}
+
+static void flush(struct trie_node *node, void (*cb)(void *data))
+{
+	if (!node)
+		return;
+
+	flush(node->child[0], cb);
+	flush(node->child[1], cb);
+	if (node->data && cb)
+		cb(node->data);
+	free(node);
+}
+
+/**
+ * trie_lookup - Longest-prefix match
+ * @trie: Pointer to a &struct trie
+ * @key:  Address to look up, in network byte order
+ * @bits: Length of @key in bits, 32 for IPv4 and 128 for IPv6
+ *
+ * Returns:
+ * The data of the most specific prefix covering @key, or %NULL.
+ */
+void *trie_lookup(struct trie *trie, const void *key, int bits)
+{
+	struct trie_node *node = trie->root;
+	void *match = NULL;
+	int pos = 0;
+
+	while (node) {
+		if (node->data)
+			match = node->data;
+		if (pos == bits)
+			break;
+
+		node = node->child[bit(key, pos++)];
+	}
+
+	return match;
+}
+
+/**
+ * trie_match - All prefixes covering a key
+ * @trie:  Pointer to a &struct trie
+ * @key:   Address to look up, in network byte order
+ * @bits:  Length of @key in bits, 32 for IPv4 and 128 for IPv6
+ * @match: Array for the data of the prefixes found
+ * @num:   Number of elements in @match, @bits + 1 never runs out
+ *
+ * Like trie_lookup(), but all prefixes covering @key are returned, the
+ * least specific first, so callers can fall back to a less specific
+ * prefix when the most specific one does not qualify.
+ *
+ * Returns:
+ * The number of prefixes stored in @match.
+ */
+int trie_match(struct trie *trie, const void *key, int bits, void **match, int num)
+{
+	struct trie_node *node = trie->root;
+	int pos = 0, cnt = 0;
+
+	while (node && cnt < num) {
+		if (node->data)
+			match[cnt++] = node->data;
+		if (pos == bits)
+			break;
+
+		node = node->child[bit(key, pos++)];
+	}
+
+	return cnt;
+}
+
+/**
+ * trie_find - Exact match
+ * @trie: Pointer to a &struct trie
+ * @key:  Prefix, in network byte order
+ * @len:  Prefix length in bits
+ *
+ * Returns:
+ * The data stored for exactly @key/@len, or %NULL.
+ */
+void *trie_find(struct trie *trie, const void *key, int len)
+{
+	struct trie_node *node = trie->root;
+	int pos;
+
+	for (pos = 0; node && pos < len; pos++)
+		node = node->child[bit(key, pos)];
+
+	if (!node)
+		return NULL;
+
+	return node->data;
+}
+
+/**
+ * trie_insert - Store data for a prefix
+ * @trie: Pointer to a &struct trie
+ * @key:  Prefix, in network byte order, bits beyond @len are ignored
+ * @len:  Prefix length in bits
+ * @data: Non-%NULL data to store
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.  If the
+ * prefix already holds data @errno is set to %EEXIST.
+ */
+int trie_insert(struct trie *trie, const void *key, int len, void *data)
+{
+	struct trie_node **node = &trie->root;
+	int pos = 0;
+
+	while (1) {
+		if (!*node) {
+			*node = calloc(1, sizeof(struct trie_node));
+			if (!*node) {
+				int err = errno;
+
+				prune(&trie->root, key, 0, len, NULL);
+				errno = err;
+				return -1;
+			}
+		}
+
+		if (pos == len)
+			break;
+
+		node = &(*node)->child[bit(key, pos++)];
+	}
+
+	if ((*node)->data) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	(*node)->data = data;
+	trie->count++;
+
+	return 0;
+}
+
+/**
+ * trie_remove - Remove data for a prefix
+ * @trie: Pointer to a &struct trie
+ * @key:  Prefix, in network byte order
+ * @len:  Prefix length in bits
+ *
+ * Returns:
+ * The data that was stored for @key/@len, or %NULL if none.
+ */
+void *trie_remove(struct trie *trie, const void *key, int len)
+{
+	void *data = NULL;
+
+	prune(&trie->root, key, 0, len, &data);
+	if (data)
+		trie->count--;
+
+	return data;
+}
+
+/**
+ * trie_equal - Check if two tries hold the same prefixes
+ * @a: Pointer to a &struct trie
+ * @b: Pointer to a &struct trie
+ *
+ * Only the prefixes are compared, not their data.
+ *
+ * Returns:
+ * Non-zero if @a and @b hold the same prefixes, otherwise zero.
+ */
+int trie_equal(const struct trie *a, const struct trie *b)
+{
+	return a->count == b->count && equal(a->root, b->root);
+}
+
+/**
+ * trie_flush - Remove all prefixes
+ * @trie: Pointer to a &struct trie
+ * @cb:   Optional callback to release the data of each prefix
+ */
+void trie_flush(struct trie *trie, void (*cb)(void *data))
+{
+	flush(trie->root, cb);
+	trie->root  = NULL;
+	trie->count = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
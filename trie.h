@@ -0,0 +1,32 @@
+/* Binary prefix trie for longest-prefix match of group/source rules */
+#ifndef SMCROUTE_TRIE_H_
+#define SMCROUTE_TRIE_H_
+
+#include <stddef.h>
+
+struct trie_node {
+	struct trie_node *child[2];
+	void             *data;
+};
+
+struct trie {
+	struct trie_node *root;
+	size_t            count;	/* Number of nodes with data */
+};
+
+void *trie_lookup (struct trie *trie, const void *key, int bits);
+int   trie_match  (struct trie *trie, const void *key, int bits, void **match, int num);
+void *trie_find   (struct trie *trie, const void *key, int len);
+int   trie_insert (struct trie *trie, const void *key, int len, void *data);
+void *trie_remove (struct trie *trie, const void *key, int len);
+int   trie_equal  (const struct trie *a, const struct trie *b);
+void  trie_flush  (struct trie *trie, void (*cb)(void *data));
+
+#endif /* SMCROUTE_TRIE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,478 @@
+/* Rate limiting and coalescing of kernel upcalls
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * With -r RATE[:BURST] each inbound VIF, and MIF, has a token bucket
+ * that holds at most BURST upcalls and is refilled with RATE upcalls
+ * per second.  An upcall arriving on an empty bucket is shed: it is
+ * only counted, not matched against the (*,G) rules or logged.  The
+ * kernel resends it for a later packet, once its unresolved entry
+ * has expired.  So a feed with thousands of random sources on one
+ * port cannot starve upcalls on other ports, or IPC.
+ *
+ * Shed upcalls are summarized in the log every UPCALL_REPORT seconds,
+ * for as long as the storm lasts.
+ *
+ * While an (S,G) is unresolved the kernel may send more upcalls for it,
+ * and some are still queued on the socket when the route has been set.
+ * Each upcall handled is therefore recorded, on (S,G,iif), as pending,
+ * and kept for UPCALL_HOLDOFF msec after its route has been set.  Any
+ * duplicate arriving meanwhile is dropped before reaching the matcher,
+ * the kernel, or the -e script.  The set is a direct-mapped table of
+ * UPCALL_SLOTS entries, so a lookup is a single probe, and nothing is
+ * allocated.  A colliding upcall simply takes over the slot, at worst
+ * a duplicate is then handled like before.
+ *
+ * An upcall not matching any (*,G) rule keeps its slot as a negative
+ * entry for UPCALL_NEGATIVE sec, so stray multicast on a busy segment
+ * is not matched and logged again every time the unresolved entry in
+ * the kernel times out.  Negative entries are tagged with the rule
+ * generation, which is bumped by upcall_invalidate() when a new (*,G)
+ * rule is added, so all of them are stale as soon as rules may match
+ * more than before.  Hits and misses are logged on reload and exit.
+ */
+
+#include <time.h>
+
+#include "event.h"
+#include "htab.h"
+#include "ifvc.h"
+#include "mclab.h"
+
+#define UPCALL_REPORT  10	/* sec */
+#define UPCALL_HOLDOFF 1000	/* msec */
+#define UPCALL_NEGATIVE 60	/* sec */
+#define UPCALL_SLOTS   1024	/* Power of two */
+
+struct bucket {
+	unsigned long long tokens;	/* Upcalls, times 1000 */
+	unsigned long long last;	/* msec, last refill */
+	unsigned long      shed;	/* Since last report */
+};
+
+struct slot {
+	unsigned long long expires;	/* msec, 0 for a free slot */
+	unsigned int       gen;		/* Rule generation, if negative */
+	int                negative;	/* Matched no (*,G) rule */
+};
+
+struct pending4 {
+	struct slot        slot;
+	struct in_addr     source;
+	struct in_addr     group;
+	int                vif;
+};
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+struct pending6 {
+	struct slot        slot;
+	struct in6_addr    source;
+	struct in6_addr    group;
+	int                mif;
+};
+#endif
+
+int upcall_rate  = 0;
+int upcall_burst = 0;
+
+static struct bucket vif_bucket[MAXVIFS];
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+static struct bucket mif_bucket[MAXMIFS];
+#endif
+static struct pending4 pending4[UPCALL_SLOTS];
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+static struct pending6 pending6[UPCALL_SLOTS];
+#endif
+static unsigned int  upcall_gen;
+static unsigned long upcall_hits;
+static unsigned long upcall_misses;
+static int upcall_timer = -1;
+static int upcall_storm;	/* upcall_timer is armed */
+
+static unsigned long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns the number of upcalls shed, and resets the counters */
+static unsigned long report(struct bucket *bucket, size_t num, int mif)
+{
+	unsigned long total = 0;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		struct iface *iface;
+
+		if (!bucket[i].shed)
+			continue;
+
+		iface = mif ? iface_find_by_mif(i) : iface_find_by_vif(i);
+		smclog(LOG_NOTICE, "Upcall rate limit on %s, %s %zu, shed %lu upcalls in %d sec",
+		       iface ? iface->name : "-", mif ? "MIF" : "VIF", i, bucket[i].shed, UPCALL_REPORT);
+
+		total += bucket[i].shed;
+		bucket[i].shed = 0;
+	}
+
+	return total;
+}
+
+/* Log upcalls shed during the last period, stop when the storm is over */
+static void summary(int id, void *arg)
+{
+	unsigned long total;
+
+	(void)arg;
+
+	total = report(vif_bucket, NELEMS(vif_bucket), 0);
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	total += report(mif_bucket, NELEMS(mif_bucket), 1);
+#endif
+	if (!total) {
+		event_timer_set(id, 0, 0);
+		upcall_storm = 0;
+	}
+}
+
+static int allow(struct bucket *bucket, const char *type, int vif, unsigned long long msec)
+{
+	unsigned long long max;
+
+	max = (unsigned long long)upcall_burst * 1000;
+
+	bucket->tokens += (msec - bucket->last) * upcall_rate;
+	if (bucket->tokens > max)
+		bucket->tokens = max;
+	bucket->last = msec;
+
+	if (bucket->tokens >= 1000) {
+		bucket->tokens -= 1000;
+		return 1;
+	}
+
+	if (!bucket->shed++ && !upcall_storm) {
+		smclog(LOG_WARNING, "Too many upcalls on %s %d, shedding above %d/sec",
+		       type, vif, upcall_rate);
+		event_timer_set(upcall_timer, UPCALL_REPORT * 1000, UPCALL_REPORT * 1000);
+		upcall_storm = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * upcall_invalidate - Forget upcalls recently not matching any rule
+ *
+ * Called when a (*,G) rule is added, which may match upcalls that did
+ * not match before.
+ */
+void upcall_invalidate(void)
+{
+	upcall_gen++;
+}
+
+/**
+ * upcall_stats - Log negative cache hits and misses since last call
+ */
+void upcall_stats(void)
+{
+	if (!upcall_hits && !upcall_misses)
+		return;
+
+	smclog(LOG_NOTICE, "Upcall negative cache %lu hits, %lu misses",
+	       upcall_hits, upcall_misses);
+	upcall_hits = upcall_misses = 0;
+}
+
+/**
+ * upcall_init - Set up upcall rate limiting, if enabled with -r
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int upcall_init(void)
+{
+	unsigned long long msec;
+	size_t i;
+
+	if (upcall_rate <= 0)
+		return 0;
+	if (upcall_burst <= 0)
+		upcall_burst = upcall_rate;
+
+	upcall_timer = event_timer_add(summary, NULL);
+	if (upcall_timer < 0)
+		return -1;
+
+	/* Start with full buckets */
+	msec = now();
+	for (i = 0; i < NELEMS(vif_bucket); i++) {
+		vif_bucket[i].tokens = (unsigned long long)upcall_burst * 1000;
+		vif_bucket[i].last   = msec;
+	}
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+	for (i = 0; i < NELEMS(mif_bucket); i++) {
+		mif_bucket[i].tokens = (unsigned long long)upcall_burst * 1000;
+		mif_bucket[i].last   = msec;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * upcall_exit - Log any upcalls shed, and cache stats, since last report
+ */
+void upcall_exit(void)
+{
+	upcall_stats();
+	if (upcall_timer < 0)
+		return;
+
+	summary(upcall_timer, NULL);
+	event_timer_del(upcall_timer);
+	upcall_timer = -1;
+}
+
+/* Returns non-zero if a fresh entry for the upcall in @slot exists */
+static int slot_hit(struct slot *slot, unsigned long long msec)
+{
+	if (slot->expires <= msec)
+		return 0;
+
+	if (slot->negative) {
+		if (slot->gen != upcall_gen)
+			return 0;
+		upcall_hits++;
+	}
+
+	return 1;
+}
+
+/* Record upcall as pending, after slot_hit() */
+static void slot_set(struct slot *slot, unsigned long long msec)
+{
+	slot->expires  = msec + UPCALL_HOLDOFF;
+	slot->negative = 0;
+	upcall_misses++;
+}
+
+static void slot_done(struct slot *slot, int result)
+{
+	slot->negative = 0;
+	if (!result) {
+		slot->expires = now() + UPCALL_HOLDOFF;
+	} else if (result == ENOENT) {
+		slot->expires  = now() + UPCALL_NEGATIVE * 1000;
+		slot->gen      = upcall_gen;
+		slot->negative = 1;
+	} else {
+		slot->expires = 0;
+	}
+}
+
+static struct pending4 *slot4(struct mroute4 *route)
+{
+	uint32_t key[3];
+
+	key[0] = route->sender.s_addr;
+	key[1] = route->group.s_addr;
+	key[2] = route->inbound;
+
+	return &pending4[htab_hash(key, sizeof(key)) & (UPCALL_SLOTS - 1)];
+}
+
+/**
+ * upcall_filter4 - Check if an IPv4 upcall should be handled
+ * @route: Decoded upcall
+ *
+ * Drops duplicates of upcalls pending, or recently handled, upcalls
+ * recently not matching any (*,G) rule, and sheds upcalls above the
+ * rate limit of their inbound VIF.  An upcall to be
+ * handled is recorded as pending, report the outcome with upcall_done4().
+ *
+ * Returns:
+ * Non-zero if the upcall should be handled, zero if it is dropped.
+ */
+int upcall_filter4(struct mroute4 *route)
+{
+	struct pending4 *entry;
+	unsigned long long msec;
+
+	msec  = now();
+	entry = slot4(route);
+	if (entry->vif == route->inbound &&
+	    entry->source.s_addr == route->sender.s_addr &&
+	    entry->group.s_addr == route->group.s_addr &&
+	    slot_hit(&entry->slot, msec))
+		return 0;
+
+	if (upcall_rate > 0 && route->inbound >= 0 && route->inbound < (int)NELEMS(vif_bucket) &&
+	    !allow(&vif_bucket[route->inbound], "VIF", route->inbound, msec))
+		return 0;
+
+	entry->source = route->sender;
+	entry->group  = route->group;
+	entry->vif    = route->inbound;
+	slot_set(&entry->slot, msec);
+
+	return 1;
+}
+
+/**
+ * upcall_done4 - Report the outcome of a handled IPv4 upcall
+ * @route: Upcall passed by upcall_filter4()
+ * @result: Zero if its route was set, %ENOENT if it matched no (*,G)
+ *          rule, or any other non-zero value on error
+ *
+ * Duplicates are dropped for another UPCALL_HOLDOFF msec if the route
+ * was set, and for UPCALL_NEGATIVE sec if it matched no rule.  After an
+ * error the next upcall for the same (S,G) is handled.
+ */
+void upcall_done4(struct mroute4 *route, int result)
+{
+	struct pending4 *entry;
+
+	entry = slot4(route);
+	if (entry->vif != route->inbound ||
+	    entry->source.s_addr != route->sender.s_addr ||
+	    entry->group.s_addr != route->group.s_addr)
+		return;
+
+	slot_done(&entry->slot, result);
+}
+
+/**
+ * upcall_forget4 - Forget any pending, or negative, IPv4 upcall
+ * @route: Route with the (S,G,iif) of the upcall
+ *
+ * Called when a blackhole route expires, so the next upcall for it is
+ * handled and the route can be set again.
+ */
+void upcall_forget4(struct mroute4 *route)
+{
+	upcall_done4(route, -1);
+}
+
+/**
+ * upcall_flush4 - Forget all pending IPv4 upcalls
+ *
+ * Called when dynamic routes are flushed, so the upcalls setting them
+ * again are not taken for duplicates.
+ */
+void upcall_flush4(void)
+{
+	memset(pending4, 0, sizeof(pending4));
+}
+
+#ifdef HAVE_IPV6_MULTICAST_ROUTING
+static struct pending6 *slot6(struct mroute6 *route)
+{
+	uint32_t key[9];
+
+	memcpy(&key[0], &route->sender.sin6_addr, sizeof(struct in6_addr));
+	memcpy(&key[4], &route->group.sin6_addr, sizeof(struct in6_addr));
+	key[8] = route->inbound;
+
+	return &pending6[htab_hash(key, sizeof(key)) & (UPCALL_SLOTS - 1)];
+}
+
+static int match6(struct pending6 *entry, struct mroute6 *route)
+{
+	return entry->mif == route->inbound &&
+		IN6_ARE_ADDR_EQUAL(&entry->source, &route->sender.sin6_addr) &&
+		IN6_ARE_ADDR_EQUAL(&entry->group, &route->group.sin6_addr);
+}
+
+/**
+ * upcall_filter6 - Check if an IPv6 upcall should be handled
+ * @route: Decoded upcall
+ *
+ * IPv6 counterpart of upcall_filter4(), rate limited per inbound MIF.
+ *
+ * Returns:
+ * Non-zero if the upcall should be handled, zero if it is dropped.
+ */
+int upcall_filter6(struct mroute6 *route)
+{
+	struct pending6 *entry;
+	unsigned long long msec;
+
+	msec  = now();
+	entry = slot6(route);
+	if (match6(entry, route) && slot_hit(&entry->slot, msec))
+		return 0;
+
+	if (upcall_rate > 0 && route->inbound >= 0 && route->inbound < (int)NELEMS(mif_bucket) &&
+	    !allow(&mif_bucket[route->inbound], "MIF", route->inbound, msec))
+		return 0;
+
+	entry->source = route->sender.sin6_addr;
+	entry->group  = route->group.sin6_addr;
+	entry->mif    = route->inbound;
+	slot_set(&entry->slot, msec);
+
+	return 1;
+}
+
+/**
+ * upcall_done6 - Report the outcome of a handled IPv6 upcall
+ * @route: Upcall passed by upcall_filter6()
+ * @result: Zero if its route was set, %ENOENT if it matched no (*,G)
+ *          rule, or any other non-zero value on error
+ */
+void upcall_done6(struct mroute6 *route, int result)
+{
+	struct pending6 *entry;
+
+	entry = slot6(route);
+	if (!match6(entry, route))
+		return;
+
+	slot_done(&entry->slot, result);
+}
+
+/**
+ * upcall_forget6 - Forget any pending, or negative, IPv6 upcall
+ * @route: Route with the (S,G,iif) of the upcall
+ */
+void upcall_forget6(struct mroute6 *route)
+{
+	upcall_done6(route, -1);
+}
+
+/**
+ * upcall_flush6 - Forget all pending IPv6 upcalls
+ */
+void upcall_flush6(void)
+{
+	memset(pending6, 0, sizeof(pending6));
+}
+#endif
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,340 @@
+/* Event subscriptions on the IPC socket, smcroutectl watch
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * A client that sends the watch command keeps its IPC connection open
+ * and is sent one line per event from then on:
+ *
+ *     route add IIF SOURCE GROUP    Route set in the kernel
+ *     route del IIF SOURCE GROUP    Route removed from the kernel
+ *     miss IIF SOURCE GROUP         Upcall not matching any (*,G) rule
+ *     vif add IFNAME VIF            Interface mapped to VIF
+ *     vif del IFNAME VIF            VIF removed
+ *     mif add IFNAME MIF            Interface mapped to MIF, IPv6
+ *     mif del IFNAME MIF            MIF removed
+ *     join IFNAME SOURCE GROUP      Group joined, SOURCE is * for ASM
+ *     leave IFNAME SOURCE GROUP     Group left
+ *     block IFNAME SOURCE GROUP     Source excluded from group
+ *     unblock IFNAME SOURCE GROUP   Source no longer excluded
+ *     drop COUNT                    COUNT events lost, subscriber too slow
+ *
+ * Each subscriber has its own buffer, for what the socket cannot take
+ * right now.  Events that do not fit are counted and reported with a
+ * drop line once the subscriber has caught up.  So a stuck subscriber
+ * never blocks the daemon, or any other subscriber.
+ */
+
+#include "event.h"
+#include "ifvc.h"
+#include "mclab.h"
+
+#define WATCH_BUFSIZ  65536	/* Per subscriber, on top of the socket buffer */
+#define WATCH_RETRY   100	/* msec, retry sending buffered events */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct watch {
+	TAILQ_ENTRY(watch) link;
+
+	int           sd;
+	size_t        len;		/* Bytes in buf[] not yet sent */
+	unsigned long dropped;		/* Events lost since last drop line */
+	char          buf[WATCH_BUFSIZ];
+};
+
+static TAILQ_HEAD(, watch) watch_list = TAILQ_HEAD_INITIALIZER(watch_list);
+static int watch_timer = -1;
+static int watch_retry;		/* watch_timer is armed */
+
+static void watch_del(struct watch *w)
+{
+	TAILQ_REMOVE(&watch_list, w, link);
+	event_del(w->sd);
+	close(w->sd);
+	free(w);
+}
+
+/* Send as much as the socket takes, returns -1 if the subscriber is gone */
+static int flush(struct watch *w)
+{
+	ssize_t num;
+
+	if (!w->len)
+		return 0;
+
+	num = send(w->sd, w->buf, w->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (num < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+	w->len -= num;
+	memmove(w->buf, &w->buf[num], w->len);
+
+	return 0;
+}
+
+static int append(struct watch *w, const char *line, size_t len)
+{
+	if (len > sizeof(w->buf) - w->len)
+		return -1;
+
+	memcpy(&w->buf[w->len], line, len);
+	w->len += len;
+
+	return 0;
+}
+
+/* Queue @line, after the drop line for any events lost before it */
+static void queue(struct watch *w, const char *line, size_t len)
+{
+	if (w->dropped) {
+		char drop[32];
+		int num;
+
+		num = snprintf(drop, sizeof(drop), "drop %lu\n", w->dropped);
+		if (len + num > sizeof(w->buf) - w->len) {
+			if (len)
+				w->dropped++;
+			return;
+		}
+
+		append(w, drop, num);
+		w->dropped = 0;
+	}
+
+	if (append(w, line, len))
+		w->dropped++;
+}
+
+/* Retry subscribers with buffered events, while there are any */
+static void retry(int id, void *arg)
+{
+	struct watch *w, *tmp;
+	int pending = 0;
+
+	(void)arg;
+
+	TAILQ_FOREACH_SAFE(w, &watch_list, link, tmp) {
+		if (flush(w)) {
+			watch_del(w);
+			continue;
+		}
+
+		/* Report drops also when no new events arrive */
+		if (!w->len && w->dropped) {
+			queue(w, "", 0);
+			if (flush(w)) {
+				watch_del(w);
+				continue;
+			}
+		}
+
+		if (w->len || w->dropped)
+			pending = 1;
+	}
+
+	if (!pending) {
+		event_timer_set(id, 0, 0);
+		watch_retry = 0;
+	}
+}
+
+static void send_event(const char *fmt, ...)
+{
+	struct watch *w, *tmp;
+	va_list ap;
+	char line[256];
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+
+	TAILQ_FOREACH_SAFE(w, &watch_list, link, tmp) {
+		queue(w, line, len);
+		if (flush(w)) {
+			watch_del(w);
+			continue;
+		}
+
+		if ((w->len || w->dropped) && !watch_retry) {
+			event_timer_set(watch_timer, WATCH_RETRY, WATCH_RETRY);
+			watch_retry = 1;
+		}
+	}
+}
+
+static const char *vif_name(int vif, int mif)
+{
+	struct iface *iface;
+
+	iface = mif ? iface_find_by_mif(vif) : iface_find_by_vif(vif);
+	if (!iface)
+		return "-";
+
+	return iface->name;
+}
+
+/* Subscribers never send anything, so readable means hung up */
+static void watch_read(int sd, void *arg)
+{
+	struct watch *w = arg;
+	char buf[64];
+	ssize_t num;
+
+	num = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (num > 0 || (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
+		return;
+
+	smclog(LOG_DEBUG, "IPC watch client on socket %d disconnected", sd);
+	watch_del(w);
+}
+
+/**
+ * watch_add - Turn an IPC client connection into an event subscriber
+ * @sd: Connected IPC client socket
+ *
+ * The socket is owned by the subscription from now on, and is closed
+ * when the client disconnects, or at watch_exit().
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error with @errno set.
+ */
+int watch_add(int sd)
+{
+	struct watch *w;
+
+	if (watch_timer < 0) {
+		watch_timer = event_timer_add(retry, NULL);
+		if (watch_timer < 0)
+			return -1;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -1;
+
+	w->sd      = sd;
+	w->len     = 0;
+	w->dropped = 0;
+
+	event_del(sd);
+	if (event_add(sd, watch_read, w)) {
+		free(w);
+		return -1;
+	}
+	TAILQ_INSERT_TAIL(&watch_list, w, link);
+	smclog(LOG_DEBUG, "IPC client on socket %d now watching events", sd);
+
+	return 0;
+}
+
+/**
+ * watch_exit - Disconnect all subscribers
+ */
+void watch_exit(void)
+{
+	struct watch *w;
+
+	while ((w = TAILQ_FIRST(&watch_list)))
+		watch_del(w);
+}
+
+/**
+ * watch_mroute4 - Send IPv4 route event to subscribers
+ * @event: One of "route add", "route del", or "miss"
+ * @route: IPv4 route, or upcall
+ */
+void watch_mroute4(const char *event, struct mroute4 *route)
+{
+	char origin[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN];
+
+	if (TAILQ_EMPTY(&watch_list))
+		return;
+
+	send_event("%s %s %s %s\n", event, vif_name(route->inbound, 0),
+		   inet_ntop(AF_INET, &route->sender, origin, sizeof(origin)),
+		   inet_ntop(AF_INET, &route->group, group, sizeof(group)));
+}
+
+/**
+ * watch_mroute6 - Send IPv6 route event to subscribers
+ * @event: One of "route add", "route del", or "miss"
+ * @route: IPv6 route, or upcall
+ */
+void watch_mroute6(const char *event, struct mroute6 *route)
+{
+	char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+
+	if (TAILQ_EMPTY(&watch_list))
+		return;
+
+	send_event("%s %s %s %s\n", event, vif_name(route->inbound, 1),
+		   inet_ntop(AF_INET6, &route->sender.sin6_addr, origin, sizeof(origin)),
+		   inet_ntop(AF_INET6, &route->group.sin6_addr, group, sizeof(group)));
+}
+
+/**
+ * watch_vif - Send VIF/MIF event to subscribers
+ * @event:  Either "add" or "del"
+ * @ifname: Interface name
+ * @family: %AF_INET for a VIF, or %AF_INET6 for a MIF
+ * @vif:    VIF, or MIF, number
+ */
+void watch_vif(const char *event, const char *ifname, int family, int vif)
+{
+	if (TAILQ_EMPTY(&watch_list))
+		return;
+
+	send_event("%s %s %s %d\n", family == AF_INET6 ? "mif" : "vif", event, ifname, vif);
+}
+
+/**
+ * watch_group - Send group membership event to subscribers
+ * @event:  One of "join", "leave", "block", or "unblock"
+ * @ifname: Interface name
+ * @family: %AF_INET or %AF_INET6
+ * @source: Source address, or %NULL for any source
+ * @group:  Group address
+ */
+void watch_group(const char *event, const char *ifname, int family, const void *source, const void *group)
+{
+	char src[INET6_ADDRSTRLEN] = "*", grp[INET6_ADDRSTRLEN];
+
+	if (TAILQ_EMPTY(&watch_list))
+		return;
+
+	if (source)
+		inet_ntop(family, source, src, sizeof(src));
+	inet_ntop(family, group, grp, sizeof(grp));
+
+	send_event("%s %s %s %s\n", event, ifname, src, grp);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */